@@ -5,11 +5,13 @@
 
 #include "fbo.h"
 #include "shader.h"
+#include "glstate.h"
 #include "input.h"
 #include "includes.h"
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "task.h"
 
 #include <cmath>
 #include <string>
@@ -85,14 +87,17 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the gui of the last frame changed the state behind the cache
+	GLState::invalidate();
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if (render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -108,7 +113,7 @@ void Application::render(void)
 	//if(render_debug)
 		//drawGrid(); // No me termina de convencer la grid
 
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_DEPTH_TEST);
 	//render anything in the gui after this
 
 	//the swap buffers is done in the main loop after this function
@@ -246,7 +251,7 @@ void Application::renderDebugGUI(void)
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
-	ImGui::Combo("Light rendering [L]", (int*)&renderer->lightRender, "Singlepass\0Multipass", 2);
+	ImGui::Combo("Light rendering [L]", (int*)&renderer->lightRender, "Singlepass\0Multipass\0Clustered", 3);
 
 	ImGui::Checkbox("Emissive texture", &scene->emissive);
 	ImGui::Checkbox("Occlussion texture", &scene->occlussion);
@@ -254,6 +259,124 @@ void Application::renderDebugGUI(void)
 
 	ImGui::Combo("Pipeline [P]", (int*)&renderer->pipeline, "Forward\0Deferred", 2);
 	ImGui::Combo("Render Shape [G]", (int*)&renderer->renderShape, "Quads\0Geometry", 2);
+	if (renderer->pipeline == GTR::Renderer::FORWARD) {
+		ImGui::Checkbox("Depth pre-pass", &renderer->use_depth_prepass);
+		ImGui::SameLine();
+		ImGui::Text("GPU %.3f ms, with pre-pass %.3f ms", renderer->forward_timers[0].time, renderer->forward_timers[1].time);
+	}
+
+	ImGui::Checkbox("Parallel gather", &renderer->parallel_gather);
+	ImGui::SameLine();
+	ImGui::Text("%d calls in %.3f ms", (int)renderer->render_calls.size(), renderer->gather_time);
+	ImGui::SliderInt("Gather workers", &renderer->num_gather_workers, 1, getNumWorkers());
+	ImGui::Checkbox("Render cache", &renderer->use_render_cache);
+	ImGui::SameLine();
+	ImGui::Text("%d dirty entities", renderer->num_dirty_entities);
+	if (ImGui::Button("Benchmark culling"))
+		renderer->benchmarkCulling(camera);
+	ImGui::SameLine();
+	ImGui::Text("scalar %.4f ms, batch %.4f ms, bvh %.4f ms (%d mismatches)", renderer->culling_scalar_time, renderer->culling_batch_time, renderer->culling_bvh_time, renderer->culling_mismatches);
+	ImGui::Checkbox("BVH culling", &renderer->use_bvh);
+	ImGui::SameLine();
+	ImGui::Text("%d nodes, %d visited", (int)renderer->scene_bvh.nodes.size(), renderer->scene_bvh.num_visited);
+	ImGui::Text("%d views culled in %.3f ms", (int)renderer->cull_views.size(), renderer->cull_views_time);
+	ImGui::Checkbox("Occlusion culling", &renderer->use_occlusion_culling);
+	if (renderer->use_occlusion_culling) {
+		OcclusionCulling& occlusion = renderer->occlusion_culling;
+		ImGui::SameLine();
+		ImGui::Text("%d occluded", renderer->num_occluded_calls);
+		ImGui::SliderInt("Max occluders", &renderer->max_occluders, 1, 256);
+		ImGui::SliderFloat("Min occluder size", &renderer->min_occluder_size, 0.0f, 1.0f);
+		ImGui::Text("%d occluders, %d triangles, raster %.3f ms, test %.3f ms", (int)renderer->occluders.size(), occlusion.num_triangles, occlusion.raster_time, renderer->occlusion_test_time);
+		if (ImGui::Button("Benchmark occlusion"))
+			renderer->benchmarkOcclusion(camera);
+		ImGui::SameLine();
+		ImGui::Text("1 job %.3f ms, %d jobs %.3f ms", renderer->occlusion_single_time, renderer->num_gather_workers, renderer->occlusion_parallel_time);
+	}
+	int atlas_option = renderer->shadow_atlas_size >= 4096 ? 2 : renderer->shadow_atlas_size >= 2048 ? 1 : 0;
+	if (ImGui::Combo("Shadow atlas", &atlas_option, "1024\0" "2048\0" "4096\0", 3))
+		renderer->shadow_atlas_size = 1024 << atlas_option;
+	ImGui::SameLine();
+	ImGui::Text("%d tiles", renderer->num_shadow_tiles);
+	ImGui::SliderInt("Shadow cascades", &renderer->num_cascades, 0, GTR::MAX_SHADOW_CASCADES);
+	if (renderer->num_cascades) {
+		int cascade_option = renderer->cascade_tile_size >= 1024 ? 2 : renderer->cascade_tile_size >= 512 ? 1 : 0;
+		if (ImGui::Combo("Cascade tile", &cascade_option, "256\0" "512\0" "1024\0", 3))
+			renderer->cascade_tile_size = 256 << cascade_option;
+		ImGui::DragFloat("Cascade distance", &renderer->cascade_distance, 10.0, 10.0, 10000.0);
+		ImGui::SliderFloat("Cascade split lambda", &renderer->cascade_lambda, 0.0, 1.0);
+	}
+	ImGui::Checkbox("Shadow cache", &renderer->use_shadow_cache);
+	ImGui::SameLine();
+	ImGui::Text("%d rendered, %d cached", renderer->num_shadowmaps_rendered, renderer->num_shadowmaps_cached);
+	ImGui::SliderInt("Static after frames", &renderer->static_frames, 1, 300);
+	ImGui::Checkbox("GPU instancing", &renderer->use_instancing);
+	ImGui::SameLine();
+	ImGui::Text("%d instanced draws", renderer->num_instanced_draws);
+	ImGui::SliderInt("Min instances", &renderer->min_instances, 2, 16);
+	ImGui::Checkbox("Mesh LODs", &renderer->use_lods);
+	ImGui::SameLine();
+	ImGui::Text("calls per level %d / %d / %d / %d", renderer->num_lod_calls[0], renderer->num_lod_calls[1], renderer->num_lod_calls[2], renderer->num_lod_calls[3]);
+	ImGui::SliderFloat("LOD pixel error", &renderer->lod_pixel_error, 0.1f, 10.0f);
+	ImGui::SliderFloat("LOD hysteresis", &renderer->lod_hysteresis, 0.1f, 1.0f);
+	ImGui::Checkbox("Meshlet culling", &renderer->use_meshlets);
+	ImGui::SameLine();
+	ImGui::Text("%d drawn, %d culled", renderer->num_meshlets_drawn, renderer->num_meshlets_culled);
+	ImGui::Checkbox("Impostors", &renderer->use_impostors);
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("The entities drawn with impostors cast no shadows");
+	ImGui::SameLine();
+	ImGui::Text("%d prefabs baked, %d instances in %d draws", (int)renderer->impostors.size(), renderer->num_impostor_instances, renderer->num_impostor_draws);
+	ImGui::SliderFloat("Impostor distance", &renderer->impostor_distance, 10.0f, 2000.0f);
+	ImGui::Checkbox("HLOD", &renderer->use_hlod);
+	ImGui::SameLine();
+	if (ImGui::Button("Rebuild HLOD"))
+		renderer->hlod_built = false;
+	ImGui::Text("%d clusters (%d merged in %d levels), %d proxies for %d entities", (int)renderer->hlod.clusters.size(), renderer->hlod.num_merged, renderer->hlod.num_levels, renderer->num_hlod_proxies, renderer->num_hlod_entities);
+	ImGui::Text("%d triangles in %d, built in %.1f ms", renderer->hlod.num_source_triangles, renderer->hlod.num_triangles, renderer->hlod.build_time);
+	ImGui::SliderFloat("HLOD distance", &renderer->hlod_distance, 10.0f, 2000.0f);
+	ImGui::SliderFloat("HLOD cell size", &renderer->hlod.cell_size, 10.0f, 1000.0f);
+	if (GeometryPool::isSupported()) {
+		ImGui::Checkbox("Multi draw indirect", &renderer->use_multidraw);
+		ImGui::SameLine();
+		ImGui::Text("%d draws, %d commands", renderer->num_multidraws, renderer->num_multidraw_commands);
+		ImGui::Text("Geometry pool: %d meshes in %d pages", renderer->geometry_pool.num_meshes, (int)renderer->geometry_pool.pages.size());
+		if (GPUCulling::isSupported()) {
+			ImGui::Checkbox("GPU culling", &renderer->use_gpu_culling);
+			ImGui::SameLine();
+			ImGui::Checkbox("Occlusion", &renderer->gpu_culling.use_occlusion);
+			if (ImGui::IsItemHovered())
+				ImGui::SetTooltip("Deferred only. Against the depth of the last frame, then what it hid against the depth of this one");
+			ImGui::SameLine();
+			ImGui::Checkbox("Compare with CPU", &renderer->gpu_culling_compare);
+			ImGui::Text("%d objects in %d batches", (int)renderer->gpu_object_calls.size(), (int)renderer->gpu_batches.size());
+			if (renderer->gpu_culling_compare)
+				ImGui::Text("%d visible, %d occluded, %d mismatches", renderer->gpu_cull_visible, renderer->gpu_cull_occluded, renderer->gpu_cull_mismatches);
+		}
+	}
+	else
+		ImGui::Text("Multi draw indirect needs OpenGL 4.3");
+	ImGui::Text("%d uniform block uploads", renderer->num_block_uploads);
+	ImGui::Checkbox("Skip repeated uniforms", &Shader::use_uniform_cache);
+	ImGui::Text("Uniforms: %ld sent, %ld skipped", renderer->num_uniforms_sent, renderer->num_uniforms_skipped);
+	ImGui::Text("GL state: %ld calls, %ld avoided", renderer->num_state_calls, renderer->num_state_calls_avoided);
+	ImGui::Checkbox("Vertex arrays", &Mesh::use_vertex_arrays);
+	ImGui::SameLine();
+	ImGui::Text("%ld VAOs", Mesh::num_vertex_arrays);
+
+	if (renderer->lightRender == GTR::Renderer::CLUSTERED) {
+		LightClusters& clusters = renderer->light_clusters;
+		ImGui::SliderInt("Cluster slices", &clusters.grid_z, 1, 64);
+		ImGui::DragFloat("Cluster distance", &clusters.max_distance, 10.0f, 10.0f, 100000.0f);
+		ImGui::Text("%dx%dx%d clusters, %d indices, max %d lights, %.3f ms", clusters.grid_x, clusters.grid_y, clusters.grid_z,
+			clusters.num_indices, clusters.max_cluster_lights, clusters.build_time);
+	}
+
+	if (renderer->pipeline == GTR::Renderer::DEFERRED) {
+		RenderGraph& graph = renderer->render_graph;
+		ImGui::Text("Render graph: %d passes (%d culled), %d textures in %d", (int)graph.passes.size(), graph.num_culled_passes, (int)graph.resources.size(), (int)graph.pool.size());
+		ImGui::Text("Targets: %.1f MB, peak %.1f MB, without aliasing %.1f MB", graph.pool_bytes / (1024.0 * 1024.0), graph.peak_bytes / (1024.0 * 1024.0), graph.transient_bytes / (1024.0 * 1024.0));
+	}
 
 	ImGui::Checkbox("Show GBuffers", &renderer->show_gbuffers);
 	ImGui::Checkbox("Show SSAO", &renderer->show_ssao);
@@ -326,7 +449,7 @@ void Application::onKeyDown(SDL_KeyboardEvent event)
 	case SDLK_g: renderer->renderShape = (renderer->renderShape == GTR::Renderer::QUAD ? GTR::Renderer::GEOMETRY : GTR::Renderer::QUAD); break; // Quad / Geometry
 	case SDLK_j: renderer->pipelineSpace = (renderer->pipelineSpace == GTR::Renderer::LINEAR ? GTR::Renderer::GAMMA : GTR::Renderer::LINEAR); break; // Linear / Gamma
 	case SDLK_h: renderer->dynamicRange = (renderer->dynamicRange == GTR::Renderer::SDR ? GTR::Renderer::HDR : GTR::Renderer::SDR); break; // SDR / HDR
-	case SDLK_l: renderer->lightRender = (renderer->lightRender == GTR::Renderer::eLightRender::MULTIPASS ? GTR::Renderer::eLightRender::SINGLEPASS : GTR::Renderer::eLightRender::MULTIPASS); break; // Multipass / Singlepass
+	case SDLK_l: renderer->lightRender = (GTR::Renderer::eLightRender)((renderer->lightRender + 1) % 3); break; // Singlepass / Multipass / Clustered
 	case SDLK_i: renderer->show_irradiance = !renderer->show_irradiance; break; // Irradiance
  	case SDLK_r: renderer->show_reflections = !renderer->show_reflections; break; // Reflective
 
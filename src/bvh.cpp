@@ -0,0 +1,257 @@
+#include "bvh.h"
+#include "camera.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cassert>
+
+//like Camera::testBoxInFrustum but reporting when the box is completely inside
+static int classifyBox(const float planes[6][4], const Vector3& center, const Vector3& halfsize)
+{
+	int result = CLIP_INSIDE;
+	for (int p = 0; p < 6; ++p) {
+		int flag = planeBoxOverlap(*(const Vector4*)planes[p], center, halfsize);
+		if (flag == CLIP_OUTSIDE)
+			return CLIP_OUTSIDE;
+		if (flag == CLIP_OVERLAP)
+			result = CLIP_OVERLAP;
+	}
+	return result;
+}
+
+BVH::BVH()
+{
+	max_leaf_items = 4;
+	num_visited = 0;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	items.clear();
+	item_bounds.clear();
+}
+
+void BVH::build(const BoundingBoxArray& boxes)
+{
+	clear();
+	if (!boxes.size)
+		return;
+
+	item_bounds.resize(boxes.size);
+	items.resize(boxes.size);
+	std::vector<Vector3> centers(boxes.size);
+	for (int i = 0; i < boxes.size; ++i) {
+		items[i] = i;
+		BoundingBox& box = item_bounds[i];
+		box.center.set(boxes.center_x[i], boxes.center_y[i], boxes.center_z[i]);
+		box.halfsize.set(boxes.halfsize_x[i], boxes.halfsize_y[i], boxes.halfsize_z[i]);
+		centers[i] = box.center;
+	}
+
+	nodes.reserve(boxes.size * 2 / max_leaf_items + 1);
+	buildNode(centers, 0, boxes.size);
+
+	//store the bounds in the order of the items so the leaves read them consecutively
+	std::vector<BoundingBox> sorted_bounds(boxes.size);
+	for (int i = 0; i < boxes.size; ++i)
+		sorted_bounds[i] = item_bounds[items[i]];
+	item_bounds.swap(sorted_bounds);
+}
+
+int BVH::buildNode(std::vector<Vector3>& centers, int first, int count)
+{
+	int node_index = nodes.size();
+	nodes.push_back(sNode());
+	nodes[node_index].first = first;
+	nodes[node_index].count = count;
+	nodes[node_index].left = -1;
+	nodes[node_index].right = -1;
+
+	//bounds of the centers, used to choose the axis to split
+	Vector3 cmin(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vector3 cmax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	Vector3 bmin = cmin;
+	Vector3 bmax = cmax;
+	for (int i = first; i < first + count; ++i) {
+		const BoundingBox& box = item_bounds[items[i]];
+		bmin.setMin(box.center - box.halfsize);
+		bmax.setMax(box.center + box.halfsize);
+		cmin.setMin(centers[items[i]]);
+		cmax.setMax(centers[items[i]]);
+	}
+	nodes[node_index].min = bmin;
+	nodes[node_index].max = bmax;
+
+	if (count <= max_leaf_items)
+		return node_index;
+
+	Vector3 extent = cmax - cmin;
+	int axis = 0;
+	if (extent.y > extent.v[axis])
+		axis = 1;
+	if (extent.z > extent.v[axis])
+		axis = 2;
+	if (extent.v[axis] <= 0.0f) //all in the same spot, cannot split
+		return node_index;
+
+	int middle = first + count / 2;
+	std::nth_element(items.begin() + first, items.begin() + middle, items.begin() + first + count,
+		[&](int a, int b) { return centers[a].v[axis] < centers[b].v[axis]; });
+
+	//nodes can grow while building the children, do not keep references to them
+	int left = buildNode(centers, first, middle - first);
+	int right = buildNode(centers, middle, first + count - middle);
+	nodes[node_index].left = left;
+	nodes[node_index].right = right;
+	return node_index;
+}
+
+void BVH::refit(const BoundingBoxArray& boxes)
+{
+	if (boxes.size != items.size()) {
+		build(boxes);
+		return;
+	}
+
+	for (int i = 0; i < items.size(); ++i) {
+		int index = items[i];
+		BoundingBox& box = item_bounds[i];
+		box.center.set(boxes.center_x[index], boxes.center_y[index], boxes.center_z[index]);
+		box.halfsize.set(boxes.halfsize_x[index], boxes.halfsize_y[index], boxes.halfsize_z[index]);
+	}
+
+	//children are always after their parent, so going backwards they are updated first
+	for (int i = nodes.size() - 1; i >= 0; --i)
+		updateNodeBounds(i);
+}
+
+void BVH::updateNodeBounds(int node_index)
+{
+	sNode& node = nodes[node_index];
+	if (node.left != -1) {
+		const sNode& left = nodes[node.left];
+		const sNode& right = nodes[node.right];
+		node.min = left.min;
+		node.max = left.max;
+		node.min.setMin(right.min);
+		node.max.setMax(right.max);
+		return;
+	}
+
+	node.min.set(FLT_MAX, FLT_MAX, FLT_MAX);
+	node.max.set(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = node.first; i < node.first + node.count; ++i) {
+		const BoundingBox& box = item_bounds[i];
+		node.min.setMin(box.center - box.halfsize);
+		node.max.setMax(box.center + box.halfsize);
+	}
+}
+
+int BVH::cull(Camera* camera, std::vector<uint32>& mask)
+{
+	mask.assign((items.size() + 31) / 32, 0);
+	num_visited = 0;
+	int num_visible = 0;
+	if (nodes.size())
+		cullNode(0, camera->frustum, 0x3F, mask, num_visible);
+	return num_visible;
+}
+
+//plane_mask has one bit per plane still to test, planes that fully contain a node contain its children too
+void BVH::cullNode(int node_index, const float planes[6][4], int plane_mask, std::vector<uint32>& mask, int& num_visible)
+{
+	const sNode& node = nodes[node_index];
+	num_visited++;
+
+	Vector3 center = (node.min + node.max) * 0.5f;
+	Vector3 halfsize = (node.max - node.min) * 0.5f;
+	for (int p = 0; p < 6; ++p) {
+		if (!(plane_mask & (1 << p)))
+			continue;
+		int result = planeBoxOverlap(*(const Vector4*)planes[p], center, halfsize);
+		if (result == CLIP_OUTSIDE)
+			return;
+		if (result == CLIP_INSIDE)
+			plane_mask &= ~(1 << p);
+	}
+
+	//inner nodes go down, unless the node is fully inside, then all the items are visible without more tests
+	if (node.left != -1 && plane_mask) {
+		cullNode(node.left, planes, plane_mask, mask, num_visible);
+		cullNode(node.right, planes, plane_mask, mask, num_visible);
+		return;
+	}
+
+	for (int i = node.first; i < node.first + node.count; ++i) {
+		if (plane_mask) {
+			const BoundingBox& box = item_bounds[i];
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; ++p)
+				if (plane_mask & (1 << p))
+					outside = planeBoxOverlap(*(const Vector4*)planes[p], box.center, box.halfsize) == CLIP_OUTSIDE;
+			if (outside)
+				continue;
+		}
+		int index = items[i];
+		mask[index >> 5] |= 1u << (index & 31);
+		num_visible++;
+	}
+}
+
+int BVH::cullViews(Camera** cameras, int num_cameras, std::vector<uint32>& view_masks)
+{
+	assert(num_cameras <= 32);
+	view_masks.assign(items.size(), 0);
+	num_visited = 0;
+	if (!nodes.size() || !num_cameras)
+		return 0;
+
+	uint32 all_views = num_cameras == 32 ? 0xFFFFFFFF : (1u << num_cameras) - 1;
+	cullNodeViews(0, cameras, num_cameras, all_views, 0, view_masks);
+
+	int num_visible = 0;
+	for (int i = 0; i < view_masks.size(); ++i)
+		if (view_masks[i])
+			num_visible++;
+	return num_visible;
+}
+
+//active has a bit per camera that may see the node, inside the ones that see it completely (no need to test below)
+void BVH::cullNodeViews(int node_index, Camera** cameras, int num_cameras, uint32 active, uint32 inside, std::vector<uint32>& view_masks)
+{
+	const sNode& node = nodes[node_index];
+	num_visited++;
+
+	Vector3 center = (node.min + node.max) * 0.5f;
+	Vector3 halfsize = (node.max - node.min) * 0.5f;
+	for (int v = 0; v < num_cameras; ++v) {
+		uint32 bit = 1u << v;
+		if (!(active & bit) || (inside & bit))
+			continue;
+		int result = classifyBox(cameras[v]->frustum, center, halfsize);
+		if (result == CLIP_OUTSIDE)
+			active &= ~bit;
+		else if (result == CLIP_INSIDE)
+			inside |= bit;
+	}
+
+	if (!active)
+		return;
+
+	uint32 partial = active & ~inside;
+	if (node.left != -1 && partial) {
+		cullNodeViews(node.left, cameras, num_cameras, active, inside, view_masks);
+		cullNodeViews(node.right, cameras, num_cameras, active, inside, view_masks);
+		return;
+	}
+
+	for (int i = node.first; i < node.first + node.count; ++i) {
+		uint32 bits = inside;
+		const BoundingBox& box = item_bounds[i];
+		for (int v = 0; v < num_cameras; ++v)
+			if ((partial & (1u << v)) && classifyBox(cameras[v]->frustum, box.center, box.halfsize) != CLIP_OUTSIDE)
+				bits |= 1u << v;
+		view_masks[items[i]] |= bits;
+	}
+}
@@ -0,0 +1,54 @@
+/*	Bounding volume hierarchy over the world bounds of the render calls.
+	Culling walks the tree from the root, so a whole group of objects is rejected (or accepted) with a single box test
+	and the cost depends on how many objects are visible instead of on the size of the scene.
+*/
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "framework.h"
+
+class Camera;
+
+class BVH
+{
+public:
+	struct sNode {
+		Vector3 min;
+		Vector3 max;
+		int first; //first item of the subtree in items
+		int count; //number of items in the subtree
+		int left; //children, -1 if it is a leaf
+		int right;
+	};
+
+	std::vector<sNode> nodes; //depth-first order, a parent is always before its children
+	std::vector<int> items; //indices of the boxes sorted so every subtree is a contiguous range
+	std::vector<BoundingBox> item_bounds; //bounds of every item, same order than items
+	int max_leaf_items;
+	int num_visited; //nodes visited during the last cull
+
+	BVH();
+
+	void clear();
+
+	//builds the tree from scratch splitting by the median of the longest axis
+	void build(const BoundingBoxArray& boxes);
+
+	//updates the bounds of the nodes keeping the structure (the boxes moved but they are the same ones)
+	void refit(const BoundingBoxArray& boxes);
+
+	//sets one bit per box inside or overlapping the frustum, returns how many
+	int cull(Camera* camera, std::vector<uint32>& mask);
+
+	//culls against several cameras in the same walk (up to 32), view_masks gets one word per box with a bit per camera
+	int cullViews(Camera** cameras, int num_cameras, std::vector<uint32>& view_masks);
+
+private:
+	int buildNode(std::vector<Vector3>& centers, int first, int count);
+	void updateNodeBounds(int node_index);
+	void cullNode(int node_index, const float planes[6][4], int plane_mask, std::vector<uint32>& mask, int& num_visible);
+	void cullNodeViews(int node_index, Camera** cameras, int num_cameras, uint32 active, uint32 inside, std::vector<uint32>& view_masks);
+};
+
+#endif
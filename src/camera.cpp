@@ -3,6 +3,15 @@
 
 #include "includes.h"
 #include <iostream>
+#include <cassert>
+
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define CULLING_AVX
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <xmmintrin.h>
+	#define CULLING_SSE
+#endif
 
 Camera* Camera::current = NULL;
 
@@ -387,3 +396,174 @@ char Camera::testBoxInFrustum(const Vector3& center, const Vector3& halfsize)
 	return o == 0 ? CLIP_INSIDE : CLIP_OVERLAP;
 }
 
+
+//same test as planeBoxOverlap (box outside if distance <= -radius) but for a batch of boxes against the six planes
+int Camera::testBoxesInFrustum(const BoundingBoxArray& boxes, std::vector<uint32>& mask)
+{
+	int num_words = (boxes.size + 31) / 32;
+	mask.assign(num_words, 0);
+	if (!boxes.size)
+		return 0;
+
+	const float* cx = &boxes.center_x[0];
+	const float* cy = &boxes.center_y[0];
+	const float* cz = &boxes.center_z[0];
+	const float* hx = &boxes.halfsize_x[0];
+	const float* hy = &boxes.halfsize_y[0];
+	const float* hz = &boxes.halfsize_z[0];
+
+#if defined(CULLING_AVX)
+	__m256 plane[6][4];
+	__m256 abs_plane[6][3];
+	for (int p = 0; p < 6; ++p)
+		for (int k = 0; k < 4; ++k) {
+			plane[p][k] = _mm256_set1_ps(frustum[p][k]);
+			if (k < 3)
+				abs_plane[p][k] = _mm256_set1_ps(fabs(frustum[p][k]));
+		}
+
+	for (int i = 0; i < boxes.size; i += 8) {
+		__m256 x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i), z = _mm256_loadu_ps(cz + i);
+		__m256 sx = _mm256_loadu_ps(hx + i), sy = _mm256_loadu_ps(hy + i), sz = _mm256_loadu_ps(hz + i);
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; ++p) {
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(plane[p][0], x), _mm256_mul_ps(plane[p][1], y)), _mm256_mul_ps(plane[p][2], z)), plane[p][3]);
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(abs_plane[p][0], sx), _mm256_mul_ps(abs_plane[p][1], sy)), _mm256_mul_ps(abs_plane[p][2], sz));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_sub_ps(_mm256_setzero_ps(), radius), _CMP_LE_OQ));
+		}
+		uint32 bits = ~_mm256_movemask_ps(outside) & 0xFF;
+		mask[i >> 5] |= bits << (i & 31);
+	}
+#elif defined(CULLING_SSE)
+	__m128 plane[6][4];
+	__m128 abs_plane[6][3];
+	for (int p = 0; p < 6; ++p)
+		for (int k = 0; k < 4; ++k) {
+			plane[p][k] = _mm_set1_ps(frustum[p][k]);
+			if (k < 3)
+				abs_plane[p][k] = _mm_set1_ps(fabs(frustum[p][k]));
+		}
+
+	for (int i = 0; i < boxes.size; i += 4) {
+		__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+		__m128 sx = _mm_loadu_ps(hx + i), sy = _mm_loadu_ps(hy + i), sz = _mm_loadu_ps(hz + i);
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; ++p) {
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(plane[p][0], x), _mm_mul_ps(plane[p][1], y)), _mm_mul_ps(plane[p][2], z)), plane[p][3]);
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abs_plane[p][0], sx), _mm_mul_ps(abs_plane[p][1], sy)), _mm_mul_ps(abs_plane[p][2], sz));
+			outside = _mm_or_ps(outside, _mm_cmple_ps(distance, _mm_sub_ps(_mm_setzero_ps(), radius)));
+		}
+		uint32 bits = ~_mm_movemask_ps(outside) & 0xF;
+		mask[i >> 5] |= bits << (i & 31);
+	}
+#else
+	for (int i = 0; i < boxes.size; ++i) {
+		bool outside = false;
+		for (int p = 0; p < 6 && !outside; ++p) {
+			float distance = frustum[p][0] * cx[i] + frustum[p][1] * cy[i] + frustum[p][2] * cz[i] + frustum[p][3];
+			float radius = fabs(frustum[p][0]) * hx[i] + fabs(frustum[p][1]) * hy[i] + fabs(frustum[p][2]) * hz[i];
+			outside = distance <= -radius;
+		}
+		if (!outside)
+			mask[i >> 5] |= 1u << (i & 31);
+	}
+#endif
+
+	//the padding boxes may have set bits past the end
+	if (boxes.size & 31)
+		mask[num_words - 1] &= (1u << (boxes.size & 31)) - 1;
+
+	int count = 0;
+	for (int i = 0; i < num_words; ++i) {
+		uint32 v = mask[i];
+		for (; v; ++count)
+			v &= v - 1;
+	}
+	return count;
+}
+
+int Camera::testBoxesInFrusta(const BoundingBoxArray& boxes, Camera** cameras, int num_cameras, std::vector<uint32>& view_masks)
+{
+	assert(num_cameras <= 32);
+	view_masks.assign(boxes.center_x.size(), 0); //padded, the extra words are removed at the end
+	if (!boxes.size || !num_cameras)
+	{
+		view_masks.resize(boxes.size);
+		return 0;
+	}
+
+	//planes and their absolute values packed together for every camera
+	float planes[32][6][7];
+	for (int v = 0; v < num_cameras; ++v)
+		for (int p = 0; p < 6; ++p)
+			for (int k = 0; k < 4; ++k) {
+				planes[v][p][k] = cameras[v]->frustum[p][k];
+				if (k < 3)
+					planes[v][p][4 + k] = fabs(cameras[v]->frustum[p][k]);
+			}
+
+	const float* cx = &boxes.center_x[0];
+	const float* cy = &boxes.center_y[0];
+	const float* cz = &boxes.center_z[0];
+	const float* hx = &boxes.halfsize_x[0];
+	const float* hy = &boxes.halfsize_y[0];
+	const float* hz = &boxes.halfsize_z[0];
+	uint32* masks = &view_masks[0];
+
+#if defined(CULLING_AVX)
+	for (int i = 0; i < boxes.size; i += 8) {
+		__m256 x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i), z = _mm256_loadu_ps(cz + i);
+		__m256 sx = _mm256_loadu_ps(hx + i), sy = _mm256_loadu_ps(hy + i), sz = _mm256_loadu_ps(hz + i);
+		for (int v = 0; v < num_cameras; ++v) {
+			__m256 outside = _mm256_setzero_ps();
+			for (int p = 0; p < 6; ++p) {
+				const float* plane = planes[v][p];
+				__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_broadcast_ss(plane), x), _mm256_mul_ps(_mm256_broadcast_ss(plane + 1), y)), _mm256_mul_ps(_mm256_broadcast_ss(plane + 2), z)), _mm256_broadcast_ss(plane + 3));
+				__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_broadcast_ss(plane + 4), sx), _mm256_mul_ps(_mm256_broadcast_ss(plane + 5), sy)), _mm256_mul_ps(_mm256_broadcast_ss(plane + 6), sz));
+				outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_sub_ps(_mm256_setzero_ps(), radius), _CMP_LE_OQ));
+			}
+			uint32 bits = ~_mm256_movemask_ps(outside) & 0xFF;
+			for (int j = 0; j < 8; ++j)
+				masks[i + j] |= ((bits >> j) & 1) << v;
+		}
+	}
+#elif defined(CULLING_SSE)
+	for (int i = 0; i < boxes.size; i += 4) {
+		__m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+		__m128 sx = _mm_loadu_ps(hx + i), sy = _mm_loadu_ps(hy + i), sz = _mm_loadu_ps(hz + i);
+		for (int v = 0; v < num_cameras; ++v) {
+			__m128 outside = _mm_setzero_ps();
+			for (int p = 0; p < 6; ++p) {
+				const float* plane = planes[v][p];
+				__m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load1_ps(plane), x), _mm_mul_ps(_mm_load1_ps(plane + 1), y)), _mm_mul_ps(_mm_load1_ps(plane + 2), z)), _mm_load1_ps(plane + 3));
+				__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load1_ps(plane + 4), sx), _mm_mul_ps(_mm_load1_ps(plane + 5), sy)), _mm_mul_ps(_mm_load1_ps(plane + 6), sz));
+				outside = _mm_or_ps(outside, _mm_cmple_ps(distance, _mm_sub_ps(_mm_setzero_ps(), radius)));
+			}
+			uint32 bits = ~_mm_movemask_ps(outside) & 0xF;
+			for (int j = 0; j < 4; ++j)
+				masks[i + j] |= ((bits >> j) & 1) << v;
+		}
+	}
+#else
+	for (int i = 0; i < boxes.size; ++i) {
+		for (int v = 0; v < num_cameras; ++v) {
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; ++p) {
+				const float* plane = planes[v][p];
+				float distance = plane[0] * cx[i] + plane[1] * cy[i] + plane[2] * cz[i] + plane[3];
+				float radius = plane[4] * hx[i] + plane[5] * hy[i] + plane[6] * hz[i];
+				outside = distance <= -radius;
+			}
+			if (!outside)
+				masks[i] |= 1u << v;
+		}
+	}
+#endif
+
+	view_masks.resize(boxes.size);
+	int count = 0;
+	for (int i = 0; i < boxes.size; ++i)
+		if (masks[i])
+			count++;
+	return count;
+}
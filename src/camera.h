@@ -79,6 +79,13 @@ public:
 	bool testPointInFrustum( Vector3 v );
 	char testSphereInFrustum( const Vector3& v, float radius);
 	char testBoxInFrustum( const Vector3& center, const Vector3& halfsize );
+
+	//tests many boxes at once (4 or 8 per instruction), sets one bit per box not outside the frustum, returns how many
+	int testBoxesInFrustum( const BoundingBoxArray& boxes, std::vector<uint32>& mask );
+
+	//same test for several cameras at once (up to 32), the bounds are read only once
+	//view_masks gets one word per box with the bit of every camera that sees it, returns how many boxes are seen by any
+	static int testBoxesInFrusta( const BoundingBoxArray& boxes, Camera** cameras, int num_cameras, std::vector<uint32>& view_masks );
 };
 
 
@@ -1327,6 +1327,28 @@ BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 	return BoundingBox(box_max - halfsize, halfsize );
 }
 
+void BoundingBoxArray::resize(int num)
+{
+	size = num;
+	int padded = (num + 7) & ~7;
+	center_x.resize(padded, 0.0f);
+	center_y.resize(padded, 0.0f);
+	center_z.resize(padded, 0.0f);
+	halfsize_x.resize(padded, 0.0f);
+	halfsize_y.resize(padded, 0.0f);
+	halfsize_z.resize(padded, 0.0f);
+}
+
+void BoundingBoxArray::set(int index, const BoundingBox& box)
+{
+	center_x[index] = box.center.x;
+	center_y[index] = box.center.y;
+	center_z[index] = box.center.z;
+	halfsize_x[index] = box.halfsize.x;
+	halfsize_y[index] = box.halfsize.y;
+	halfsize_z[index] = box.halfsize.z;
+}
+
 BoundingBox mergeBoundingBoxes(const BoundingBox& a, const BoundingBox& b)
 {
 	BoundingBox result;
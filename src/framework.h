@@ -21,6 +21,7 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 inline float clamp(float v, float a, float b) { return v < a ? a : (v > b ? b : v); }
 inline float lerp(float a, float b, float v ) { return a*(1.0f-v) + b*v; }
@@ -363,6 +364,23 @@ public:
 	float getArea() { return halfsize.x * halfsize.y * halfsize.z * 2.0f; }
 };
 
+//many bounding boxes stored as structure of arrays, to test them in batches with SIMD
+//arrays are padded to a multiple of 8 with empty boxes
+class BoundingBoxArray
+{
+public:
+	std::vector<float> center_x, center_y, center_z;
+	std::vector<float> halfsize_x, halfsize_y, halfsize_z;
+	int size;
+
+	BoundingBoxArray() { size = 0; }
+	void resize(int num);
+	void set(int index, const BoundingBox& box);
+};
+
+//to read visibility masks (one bit per object)
+inline bool testMaskBit(const std::vector<uint32>& mask, int index) { return (mask[index >> 5] >> (index & 31)) & 1; }
+
 class Ray
 {
 public:
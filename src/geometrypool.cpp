@@ -0,0 +1,243 @@
+#include "geometrypool.h"
+#include "mesh.h"
+#include "glstate.h"
+#include "utils.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+GeometryPool::GeometryPool()
+{
+	num_meshes = 0;
+	num_multidraws = 0;
+	num_commands = 0;
+	indirect_buffer = 0;
+	models_buffer = 0;
+	indirect_buffer_size = 0;
+	models_buffer_size = 0;
+	uploaded_commands = 0;
+	uploaded_triangles = 0;
+}
+
+GeometryPool::~GeometryPool()
+{
+	for (int i = 0; i < pages.size(); ++i) {
+		sPage& page = pages[i];
+		for (int j = 0; j < page.vertex_arrays.size(); ++j) {
+			GLState::forgetVertexArray(page.vertex_arrays[j].vao);
+			glDeleteVertexArrays(1, &page.vertex_arrays[j].vao);
+		}
+		glDeleteBuffers(1, &page.vertex_buffer);
+		glDeleteBuffers(1, &page.index_buffer);
+	}
+	if (indirect_buffer)
+		glDeleteBuffers(1, &indirect_buffer);
+	if (models_buffer)
+		glDeleteBuffers(1, &models_buffer);
+}
+
+bool GeometryPool::isSupported()
+{
+	static int supported = -1;
+	if (supported == -1)
+		supported = checkGLVersion(4, 3) ? 1 : 0;
+	return supported == 1;
+}
+
+int GeometryPool::getPage(Mesh* mesh)
+{
+	if (mesh->pool_page == -1 && !add(mesh))
+		mesh->pool_page = -2; //do not try again
+	return mesh->pool_page < 0 ? -1 : mesh->pool_page;
+}
+
+bool GeometryPool::add(Mesh* mesh)
+{
+	//only the attributes of the interleaved layout are in the pages
+	if (mesh->bones.size() || mesh->colors.size() || mesh->m_uvs1.size())
+		return false;
+
+	int num_vertices = mesh->getNumVertices();
+	int num_indices = mesh->m_indices.size() ? (int)mesh->m_indices.size() : num_vertices;
+	if (!num_vertices || num_vertices > PAGE_VERTICES || num_indices > PAGE_INDICES)
+		return false;
+
+	int page_index = 0;
+	for (; page_index < pages.size(); ++page_index)
+		if (pages[page_index].used_vertices + num_vertices <= PAGE_VERTICES && pages[page_index].used_indices + num_indices <= PAGE_INDICES)
+			break;
+
+	//the copy target does not change the element buffer of the bound VAO
+	if (page_index == pages.size()) {
+		sPage page;
+		page.used_vertices = 0;
+		page.used_indices = 0;
+		glGenBuffers(1, &page.vertex_buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page.vertex_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, PAGE_VERTICES * sizeof(Mesh::tInterleaved), NULL, GL_STATIC_DRAW);
+		glGenBuffers(1, &page.index_buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, page.index_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, PAGE_INDICES * sizeof(uint32), NULL, GL_STATIC_DRAW);
+		pages.push_back(page);
+	}
+	sPage& page = pages[page_index];
+
+	std::vector<Mesh::tInterleaved> vertices;
+	const Mesh::tInterleaved* vertex_data = mesh->interleaved.size() ? &mesh->interleaved[0] : NULL;
+	if (!vertex_data) {
+		vertices.resize(num_vertices);
+		for (int i = 0; i < num_vertices; ++i) {
+			vertices[i].vertex = mesh->vertices[i];
+			vertices[i].normal = mesh->normals.size() ? mesh->normals[i] : Vector3(0, 1, 0);
+			vertices[i].uv = mesh->uvs.size() ? mesh->uvs[i] : Vector2();
+		}
+		vertex_data = &vertices[0];
+	}
+
+	std::vector<uint32> indices;
+	const uint32* index_data = mesh->m_indices.size() ? &mesh->m_indices[0] : NULL;
+	if (!index_data) {
+		indices.resize(num_indices);
+		for (int i = 0; i < num_indices; ++i)
+			indices[i] = i;
+		index_data = &indices[0];
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, page.vertex_buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, page.used_vertices * sizeof(Mesh::tInterleaved), num_vertices * sizeof(Mesh::tInterleaved), vertex_data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, page.index_buffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, page.used_indices * sizeof(uint32), num_indices * sizeof(uint32), index_data);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	checkGLErrors();
+
+	mesh->pool_page = page_index;
+	mesh->pool_base_vertex = page.used_vertices;
+	mesh->pool_first_index = page.used_indices;
+	mesh->pool_num_indices = num_indices;
+	page.used_vertices += num_vertices;
+	page.used_indices += num_indices;
+	num_meshes++;
+	return true;
+}
+
+void GeometryPool::addCommand(Mesh* mesh, int first_instance, int num_instances, std::vector<sDrawCommand>& commands)
+{
+	assert(mesh->pool_page >= 0 && "the mesh is not in the pool");
+	sDrawCommand command;
+	command.count = mesh->pool_num_indices;
+	command.instance_count = num_instances;
+	command.first_index = mesh->pool_first_index;
+	command.base_vertex = mesh->pool_base_vertex;
+	command.base_instance = first_instance;
+	commands.push_back(command);
+}
+
+void GeometryPool::reserve(int num_commands, int num_models)
+{
+	if (!indirect_buffer)
+		glGenBuffers(1, &indirect_buffer);
+	if (!models_buffer)
+		glGenBuffers(1, &models_buffer);
+	indirect_buffer_size = std::max(indirect_buffer_size, num_commands * (int)sizeof(sDrawCommand));
+	models_buffer_size = std::max(models_buffer_size, num_models * (int)sizeof(Matrix44));
+	glBindBuffer(GL_ARRAY_BUFFER, indirect_buffer);
+	glBufferData(GL_ARRAY_BUFFER, indirect_buffer_size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, models_buffer);
+	glBufferData(GL_ARRAY_BUFFER, models_buffer_size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	uploaded_commands = num_commands;
+	uploaded_triangles = -1;
+}
+
+void GeometryPool::upload(const std::vector<sDrawCommand>& commands, const std::vector<Matrix44>& models)
+{
+	uploaded_commands = commands.size();
+	uploaded_triangles = 0;
+	if (!uploaded_commands)
+		return;
+	for (int i = 0; i < commands.size(); ++i)
+		uploaded_triangles += (commands[i].count / 3) * commands[i].instance_count;
+
+	if (!indirect_buffer)
+		glGenBuffers(1, &indirect_buffer);
+	int size = commands.size() * sizeof(sDrawCommand);
+	if (size > indirect_buffer_size)
+		indirect_buffer_size = size;
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, indirect_buffer_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, size, &commands[0]);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	if (!models_buffer)
+		glGenBuffers(1, &models_buffer);
+	size = models.size() * sizeof(Matrix44);
+	if (size > models_buffer_size)
+		models_buffer_size = size;
+	glBindBuffer(GL_ARRAY_BUFFER, models_buffer);
+	glBufferData(GL_ARRAY_BUFFER, models_buffer_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, &models[0]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+GLuint GeometryPool::getVertexArray(sPage& page, Shader* shader)
+{
+	int locations[4] = { shader->attribute_locations[ATTRIB_VERTEX], shader->attribute_locations[ATTRIB_NORMAL],
+		shader->attribute_locations[ATTRIB_COORD], shader->attribute_locations[ATTRIB_INSTANCE_MODEL] };
+	for (int i = 0; i < page.vertex_arrays.size(); ++i)
+		if (memcmp(page.vertex_arrays[i].locations, locations, sizeof(locations)) == 0)
+			return page.vertex_arrays[i].vao;
+
+	sVertexArray vertex_array;
+	memcpy(vertex_array.locations, locations, sizeof(locations));
+	glGenVertexArrays(1, &vertex_array.vao);
+	GLState::bindVertexArray(vertex_array.vao);
+
+	int stride = sizeof(Mesh::tInterleaved);
+	int sizes[3] = { 3, 3, 2 };
+	size_t offsets[3] = { 0, sizeof(Vector3), sizeof(Vector3) * 2 };
+	glBindBuffer(GL_ARRAY_BUFFER, page.vertex_buffer);
+	for (int i = 0; i < 3; ++i) {
+		if (locations[i] == -1)
+			continue;
+		glEnableVertexAttribArray(locations[i]);
+		glVertexAttribPointer(locations[i], sizes[i], GL_FLOAT, GL_FALSE, stride, (void*)offsets[i]);
+	}
+
+	//the base instance of every command offsets where its models start
+	glBindBuffer(GL_ARRAY_BUFFER, models_buffer);
+	for (int k = 0; k < 4; ++k) {
+		glEnableVertexAttribArray(locations[3] + k);
+		glVertexAttribPointer(locations[3] + k, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix44), (void*)(sizeof(float) * 4 * k));
+		glVertexAttribDivisor(locations[3] + k, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, page.index_buffer);
+	checkGLErrors();
+
+	page.vertex_arrays.push_back(vertex_array);
+	return vertex_array.vao;
+}
+
+void GeometryPool::draw(int page_index, int first_command, int num_commands)
+{
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
+	assert(shader->attribute_locations[ATTRIB_INSTANCE_MODEL] != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (num_commands == -1)
+		num_commands = uploaded_commands - first_command;
+	if (num_commands <= 0 || shader->attribute_locations[ATTRIB_INSTANCE_MODEL] == -1)
+		return;
+
+	GLState::bindVertexArray(getVertexArray(pages[page_index], shader));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first_command * sizeof(sDrawCommand)), num_commands, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	checkGLErrors();
+
+	num_multidraws++;
+	this->num_commands += num_commands;
+	Mesh::num_meshes_rendered += num_commands;
+	if (uploaded_triangles != -1 && num_commands == uploaded_commands) //the instances written by the GPU are not known
+		Mesh::num_triangles_rendered += uploaded_triangles;
+}
@@ -0,0 +1,86 @@
+/*	Geometry of the static meshes sub-allocated in a few big buffers (pages). Every page has one vertex buffer, with the
+	layout of Mesh::tInterleaved, and one index buffer, so the meshes of a page can be drawn together with a single
+	glMultiDrawElementsIndirect: one command per mesh, and the model of every instance read from a buffer starting
+	at the base instance of its command (the shader must be an _instanced one).
+	Meshes are added the first time they are drawn. Their ranges are never freed, the pool only grows.
+*/
+
+#ifndef GEOMETRYPOOL_H
+#define GEOMETRYPOOL_H
+
+#include "includes.h"
+#include "framework.h"
+#include "shader.h"
+
+class Mesh;
+
+class GeometryPool
+{
+public:
+	static const int PAGE_VERTICES = 1 << 20; //32MB with the interleaved layout
+	static const int PAGE_INDICES = 3 << 20;
+
+	//same layout as the DrawElementsIndirectCommand read by GL
+	struct sDrawCommand {
+		uint32 count;
+		uint32 instance_count;
+		uint32 first_index;
+		int base_vertex;
+		uint32 base_instance;
+	};
+
+	//the VAO of a page depends on the locations of the shader, like the ones of the meshes
+	struct sVertexArray {
+		int locations[4]; //vertex, normal, coord and instance model
+		GLuint vao;
+	};
+
+	struct sPage {
+		GLuint vertex_buffer;
+		GLuint index_buffer;
+		int used_vertices;
+		int used_indices;
+		std::vector<sVertexArray> vertex_arrays;
+	};
+
+	std::vector<sPage> pages;
+	int num_meshes;
+	int num_multidraws; //since the last reset
+	int num_commands;
+
+	GeometryPool();
+	~GeometryPool();
+
+	//multi draw indirect with base instance needs GL 4.3
+	static bool isSupported();
+
+	//page of the mesh, it is added to the pool the first time, -1 if it cannot be pooled
+	//(skinned meshes, meshes with colors or secondary uvs and the ones that do not fit in a page)
+	int getPage(Mesh* mesh);
+
+	//adds to commands the draw of the mesh, instances are taken from the models starting at first_instance
+	void addCommand(Mesh* mesh, int first_instance, int num_instances, std::vector<sDrawCommand>& commands);
+
+	//uploads the commands and the models of the next draws
+	void upload(const std::vector<sDrawCommand>& commands, const std::vector<Matrix44>& models);
+
+	//makes room for commands and models written by the GPU (see GPUCulling), what they had is lost
+	void reserve(int num_commands, int num_models);
+
+	//draws the uploaded commands (or a range of them), all of them must be of meshes of this page
+	void draw(int page_index, int first_command = 0, int num_commands = -1);
+
+	GLuint indirect_buffer;
+	GLuint models_buffer; //its storage is orphaned in every upload, the name (kept by the VAOs) never changes
+
+private:
+	int indirect_buffer_size; //in bytes
+	int models_buffer_size;
+	int uploaded_commands;
+	long uploaded_triangles; //-1 if the GPU wrote the commands
+
+	bool add(Mesh* mesh);
+	GLuint getVertexArray(sPage& page, Shader* shader);
+};
+
+#endif
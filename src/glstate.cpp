@@ -0,0 +1,222 @@
+#include "glstate.h"
+
+//value of the states that have not been set since the last invalidate
+static const int UNKNOWN = -1;
+static const GLuint UNKNOWN_OBJECT = 0xFFFFFFFF;
+
+enum eCachedCap { CAP_BLEND, CAP_CULL_FACE, CAP_DEPTH_TEST, CAP_SCISSOR_TEST, NUM_CACHED_CAPS };
+enum eCachedTarget { TARGET_2D, TARGET_CUBE_MAP, TARGET_3D, TARGET_2D_ARRAY, NUM_CACHED_TARGETS };
+
+static int caps[NUM_CACHED_CAPS];
+static GLenum blend_src, blend_dst;
+static GLenum depth_func;
+static int depth_mask;
+static int color_mask; //one bit per channel
+static GLenum front_face;
+static GLenum cull_face;
+static GLuint program;
+static int active_unit;
+static GLuint textures[GLState::MAX_TEXTURE_UNITS][NUM_CACHED_TARGETS];
+static GLuint framebuffer;
+static GLuint vertex_array;
+
+long GLState::num_calls = 0;
+long GLState::num_avoided = 0;
+
+//the cache starts invalidated
+static bool initialized = (GLState::invalidate(), true);
+
+static int getCapIndex(GLenum cap)
+{
+	switch (cap) {
+		case GL_BLEND: return CAP_BLEND;
+		case GL_CULL_FACE: return CAP_CULL_FACE;
+		case GL_DEPTH_TEST: return CAP_DEPTH_TEST;
+		case GL_SCISSOR_TEST: return CAP_SCISSOR_TEST;
+	}
+	return -1;
+}
+
+static int getTargetIndex(GLenum target)
+{
+	switch (target) {
+		case GL_TEXTURE_2D: return TARGET_2D;
+		case GL_TEXTURE_CUBE_MAP: return TARGET_CUBE_MAP;
+		case GL_TEXTURE_3D: return TARGET_3D;
+		case GL_TEXTURE_2D_ARRAY: return TARGET_2D_ARRAY;
+	}
+	return -1;
+}
+
+//true if the cached value is already the wanted one, otherwise stores it and counts the call
+template<typename T>
+static bool isCached(T& cached, T value)
+{
+	if (cached == value) {
+		GLState::num_avoided++;
+		return true;
+	}
+	cached = value;
+	GLState::num_calls++;
+	return false;
+}
+
+void GLState::invalidate()
+{
+	for (int i = 0; i < NUM_CACHED_CAPS; ++i)
+		caps[i] = UNKNOWN;
+	blend_src = blend_dst = UNKNOWN_OBJECT;
+	depth_func = UNKNOWN_OBJECT;
+	depth_mask = UNKNOWN;
+	color_mask = UNKNOWN;
+	front_face = UNKNOWN_OBJECT;
+	cull_face = UNKNOWN_OBJECT;
+	program = UNKNOWN_OBJECT;
+	active_unit = UNKNOWN;
+	for (int i = 0; i < MAX_TEXTURE_UNITS; ++i)
+		for (int j = 0; j < NUM_CACHED_TARGETS; ++j)
+			textures[i][j] = UNKNOWN_OBJECT;
+	framebuffer = UNKNOWN_OBJECT;
+	vertex_array = UNKNOWN_OBJECT;
+}
+
+void GLState::setEnabled(GLenum cap, bool enabled)
+{
+	int index = getCapIndex(cap);
+	if (index != -1 && isCached(caps[index], enabled ? 1 : 0))
+		return;
+	if (index == -1)
+		num_calls++;
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+}
+
+void GLState::enable(GLenum cap)
+{
+	setEnabled(cap, true);
+}
+
+void GLState::disable(GLenum cap)
+{
+	setEnabled(cap, false);
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+	if (blend_src == src && blend_dst == dst) {
+		num_avoided++;
+		return;
+	}
+	blend_src = src;
+	blend_dst = dst;
+	num_calls++;
+	glBlendFunc(src, dst);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (!isCached(depth_func, func))
+		glDepthFunc(func);
+}
+
+void GLState::depthMask(bool write)
+{
+	if (!isCached(depth_mask, write ? 1 : 0))
+		glDepthMask(write);
+}
+
+void GLState::colorMask(bool r, bool g, bool b, bool a)
+{
+	int mask = (r ? 1 : 0) | (g ? 2 : 0) | (b ? 4 : 0) | (a ? 8 : 0);
+	if (!isCached(color_mask, mask))
+		glColorMask(r, g, b, a);
+}
+
+void GLState::frontFace(GLenum mode)
+{
+	if (!isCached(front_face, mode))
+		glFrontFace(mode);
+}
+
+void GLState::cullFace(GLenum mode)
+{
+	if (!isCached(cull_face, mode))
+		glCullFace(mode);
+}
+
+void GLState::useProgram(GLuint id)
+{
+	if (!isCached(program, id))
+		glUseProgram(id);
+}
+
+void GLState::activeTexture(int unit)
+{
+	if (!isCached(active_unit, unit))
+		glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	int index = getTargetIndex(target);
+	if (index == -1 || active_unit < 0 || active_unit >= MAX_TEXTURE_UNITS) {
+		num_calls++;
+		glBindTexture(target, texture);
+		return;
+	}
+	if (!isCached(textures[active_unit][index], texture))
+		glBindTexture(target, texture);
+}
+
+//only changes the active unit when the binding changes
+void GLState::bindTexture(int unit, GLenum target, GLuint texture)
+{
+	int index = getTargetIndex(target);
+	if (index != -1 && unit < MAX_TEXTURE_UNITS && textures[unit][index] == texture) {
+		num_avoided++;
+		return;
+	}
+	activeTexture(unit);
+	bindTexture(target, texture);
+}
+
+void GLState::bindFramebuffer(GLuint fbo)
+{
+	if (!isCached(framebuffer, fbo))
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+	if (!isCached(vertex_array, vao))
+		glBindVertexArray(vao);
+}
+
+void GLState::forgetTexture(GLuint texture)
+{
+	for (int i = 0; i < MAX_TEXTURE_UNITS; ++i)
+		for (int j = 0; j < NUM_CACHED_TARGETS; ++j)
+			if (textures[i][j] == texture)
+				textures[i][j] = 0;
+}
+
+void GLState::forgetFramebuffer(GLuint fbo)
+{
+	if (framebuffer == fbo)
+		framebuffer = 0;
+}
+
+void GLState::forgetProgram(GLuint id)
+{
+	//a deleted program stays in use until another one is, just make sure the next useProgram is sent
+	if (program == id)
+		program = UNKNOWN_OBJECT;
+}
+
+void GLState::forgetVertexArray(GLuint vao)
+{
+	if (vertex_array == vao)
+		vertex_array = 0;
+}
@@ -0,0 +1,48 @@
+/*	Cache of the OpenGL state changed by the renderer, so setting a state that is already active does not reach the driver.
+	All the code changing these states must do it through here, otherwise the cache gets out of sync
+	(call invalidate after code that cannot, like external libraries).
+*/
+
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+class GLState
+{
+public:
+	static const int MAX_TEXTURE_UNITS = 32;
+
+	static long num_calls; //state calls that reached the driver since the last reset
+	static long num_avoided; //calls skipped because the state was already set
+
+	//forgets everything, the next change of every state is sent
+	static void invalidate();
+
+	//GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST and GL_SCISSOR_TEST are cached, other caps are always sent
+	static void enable(GLenum cap);
+	static void disable(GLenum cap);
+	static void setEnabled(GLenum cap, bool enabled);
+
+	static void blendFunc(GLenum src, GLenum dst);
+	static void depthFunc(GLenum func);
+	static void depthMask(bool write);
+	static void colorMask(bool r, bool g, bool b, bool a);
+	static void frontFace(GLenum mode);
+	static void cullFace(GLenum mode);
+
+	static void useProgram(GLuint program);
+	static void activeTexture(int unit);
+	static void bindTexture(GLenum target, GLuint texture); //in the active unit
+	static void bindTexture(int unit, GLenum target, GLuint texture);
+	static void bindFramebuffer(GLuint fbo);
+	static void bindVertexArray(GLuint vao);
+
+	//objects being deleted, GL unbinds them so the cache must too
+	static void forgetTexture(GLuint texture);
+	static void forgetFramebuffer(GLuint fbo);
+	static void forgetProgram(GLuint program);
+	static void forgetVertexArray(GLuint vao);
+};
+
+#endif
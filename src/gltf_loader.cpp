@@ -152,6 +152,16 @@ void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor
 	}
 }
 
+//file next to the gltf where a submesh (with its LOD chain) is cached, the name without the characters a path cannot have
+std::string getGLTFMeshCacheName(const char* basename, const char* mesh_name, int submesh)
+{
+	std::string name = mesh_name;
+	for (int i = 0; i < name.size(); ++i)
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-')
+			name[i] = '_';
+	return std::string(basename) + "." + name + "." + std::to_string(submesh);
+}
+
 std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 {
 	std::vector<Mesh*> result;
@@ -177,7 +187,16 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 			}
 		}
 
+		//simplifying is slow, the mesh and its LODs can come from the binary cache
+		std::string cache_name = meshdata->name ? getGLTFMeshCacheName(basename, meshdata->name, i) : "";
 		mesh = new Mesh();
+		if (meshdata->name && Mesh::use_binary && mesh->readBin((cache_name + ".mbin").c_str(), basename))
+		{
+			mesh->uploadToVRAM();
+			mesh->registerMesh(submesh_name);
+			result.push_back(mesh);
+			continue;
+		}
 
 		//streams
 		for (int j = 0; j < primitive->attributes_count; ++j)
@@ -213,9 +232,17 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 			if (primitive->indices && primitive->indices->count)
 				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
 		}
+		if (Mesh::create_lods)
+			mesh->createLODs();
+		if (Mesh::create_meshlets)
+			mesh->createMeshlets();
 		mesh->uploadToVRAM();
 		if (meshdata->name)
+		{
 			mesh->registerMesh(submesh_name);
+			if (Mesh::use_binary)
+				mesh->writeBin(cache_name.c_str(), basename);
+		}
 		result.push_back(mesh);
 	}
 
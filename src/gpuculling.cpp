@@ -0,0 +1,189 @@
+#include "gpuculling.h"
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "glstate.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+GPUCulling::GPUCulling()
+{
+	use_occlusion = true;
+	pyramid_width = 0;
+	pyramid_height = 0;
+	pyramid_levels = 0;
+	pyramid_ready = false;
+	occlusion_culled = false;
+	objects_buffer = 0;
+	commands_buffer = 0;
+	visibility_buffer = 0;
+	pyramid_texture = 0;
+	num_objects = 0;
+	num_commands = 0;
+}
+
+GPUCulling::~GPUCulling()
+{
+	if (objects_buffer)
+		glDeleteBuffers(1, &objects_buffer);
+	if (commands_buffer)
+		glDeleteBuffers(1, &commands_buffer);
+	if (visibility_buffer)
+		glDeleteBuffers(1, &visibility_buffer);
+	if (pyramid_texture) {
+		GLState::forgetTexture(pyramid_texture);
+		glDeleteTextures(1, &pyramid_texture);
+	}
+}
+
+bool GPUCulling::isSupported()
+{
+	return GeometryPool::isSupported() && Shader::Get("gpu_cull") && Shader::Get("depth_pyramid");
+}
+
+void GPUCulling::upload()
+{
+	num_objects = objects.size();
+	num_commands = commands.size();
+	if (!objects_buffer) {
+		glGenBuffers(1, &objects_buffer);
+		glGenBuffers(1, &commands_buffer);
+		glGenBuffers(1, &visibility_buffer);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, objects_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(num_objects, 1) * sizeof(sObject), num_objects ? &objects[0] : NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, commands_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(num_commands, 1) * sizeof(GeometryPool::sDrawCommand), num_commands ? &commands[0] : NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibility_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(num_objects, 1) * sizeof(uint32), NULL, GL_STREAM_READ);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	checkGLErrors();
+}
+
+void GPUCulling::cull(Camera* camera, GeometryPool& pool)
+{
+	occlusion_culled = false;
+	Shader* shader = Shader::Get("gpu_cull");
+	if (!num_commands || !shader)
+		return;
+
+	shader->enable();
+	shader->setUniform4Array(UNIFORM_ID("u_frustum"), &camera->frustum[0][0], 6);
+	occlusion_culled = use_occlusion && pyramid_ready;
+	dispatch(pool, false);
+
+	//the next cull uses it only if it is built again after this frame
+	pyramid_ready = false;
+}
+
+void GPUCulling::cullOccluded(GeometryPool& pool)
+{
+	Shader* shader = Shader::Get("gpu_cull");
+	if (!num_commands || !shader || !occlusion_culled || !pyramid_ready)
+		return;
+
+	shader->enable();
+	dispatch(pool, true);
+	occlusion_culled = false;
+	pyramid_ready = false;
+}
+
+void GPUCulling::dispatch(GeometryPool& pool, bool second_pass)
+{
+	Shader* shader = Shader::Get("gpu_cull");
+
+	//commands start without instances, the compute shader counts them
+	pool.reserve(num_commands, num_objects);
+	glBindBuffer(GL_COPY_READ_BUFFER, commands_buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, pool.indirect_buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, num_commands * sizeof(GeometryPool::sDrawCommand));
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	shader->setUniform(UNIFORM_ID("u_num_objects"), num_objects);
+	shader->setUniform(UNIFORM_ID("u_second_pass"), second_pass);
+	bool occlusion = occlusion_culled;
+	shader->setUniform(UNIFORM_ID("u_use_occlusion"), occlusion);
+	if (occlusion) {
+		GLState::bindTexture(0, GL_TEXTURE_2D, pyramid_texture);
+		shader->setUniform(UNIFORM_ID("u_depth_pyramid"), 0);
+		shader->setUniform(UNIFORM_ID("u_pyramid_viewprojection"), pyramid_viewprojection);
+		shader->setUniform(UNIFORM_ID("u_pyramid_size"), Vector2((float)pyramid_width, (float)pyramid_height));
+		shader->setUniform(UNIFORM_ID("u_pyramid_levels"), pyramid_levels);
+	}
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, objects_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, pool.indirect_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, pool.models_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, visibility_buffer);
+	glDispatchCompute((num_objects + 63) / 64, 1, 1);
+
+	//the draws read the commands and the models as indirect and vertex data
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+	checkGLErrors();
+}
+
+void GPUCulling::buildDepthPyramid(Texture* depth_texture, const Matrix44& viewprojection)
+{
+	Shader* shader = Shader::Get("depth_pyramid");
+	if (!shader || !depth_texture)
+		return;
+
+	int width = std::max((int)depth_texture->width / 2, 1);
+	int height = std::max((int)depth_texture->height / 2, 1);
+	if (width != pyramid_width || height != pyramid_height) {
+		if (pyramid_texture) {
+			GLState::forgetTexture(pyramid_texture);
+			glDeleteTextures(1, &pyramid_texture);
+		}
+		pyramid_width = width;
+		pyramid_height = height;
+		pyramid_levels = (int)floor(log2((float)std::max(width, height))) + 1;
+		glGenTextures(1, &pyramid_texture);
+		GLState::bindTexture(0, GL_TEXTURE_2D, pyramid_texture);
+		glTexStorage2D(GL_TEXTURE_2D, pyramid_levels, GL_R32F, width, height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+
+	shader->enable();
+	int source_width = (int)depth_texture->width;
+	int source_height = (int)depth_texture->height;
+	for (int level = 0; level < pyramid_levels; ++level) {
+		int level_width = std::max(pyramid_width >> level, 1);
+		int level_height = std::max(pyramid_height >> level, 1);
+
+		//the first level reads the depth buffer, the others the previous level
+		GLState::bindTexture(0, GL_TEXTURE_2D, level ? pyramid_texture : depth_texture->texture_id);
+		shader->setUniform(UNIFORM_ID("u_source"), 0);
+		shader->setUniform(UNIFORM_ID("u_source_level"), level ? level - 1 : 0);
+		shader->setUniform(UNIFORM_ID("u_source_size"), Vector2((float)source_width, (float)source_height));
+		shader->setUniform(UNIFORM_ID("u_size"), Vector2((float)level_width, (float)level_height));
+		glBindImageTexture(0, pyramid_texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((level_width + 7) / 8, (level_height + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+		source_width = level_width;
+		source_height = level_height;
+	}
+	checkGLErrors();
+
+	pyramid_viewprojection = viewprojection;
+	pyramid_ready = true;
+}
+
+void GPUCulling::readVisibility()
+{
+	visibility.resize(num_objects);
+	if (!num_objects)
+		return;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibility_buffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, num_objects * sizeof(uint32), &visibility[0]);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
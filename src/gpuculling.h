@@ -0,0 +1,82 @@
+/*	GPU driven culling of the calls drawn from the geometry pool (needs OpenGL 4.3).
+	The objects (model and world bounds) live in a shader storage buffer, a compute shader tests them against the frustum
+	and the depth pyramid of the last frame and the visible ones are appended to the instances of their draw command,
+	so the multidraws read the commands and the models straight from what the compute shader wrote.
+	The commands are built in the CPU once per frame, with no instances, every one with room for all the objects using it.
+	The pyramid of the last frame misses what just came out from behind an occluder, so after the first pass is drawn
+	cullOccluded tests the objects it hid against a pyramid of this frame and the commands get only the ones visible now,
+	to be drawn on top. The pyramid needs a depth texture, only the deferred pipeline builds it.
+*/
+
+#ifndef GPUCULLING_H
+#define GPUCULLING_H
+
+#include "includes.h"
+#include "framework.h"
+#include "geometrypool.h"
+
+class Camera;
+class Texture;
+
+class GPUCulling
+{
+public:
+	//must match sObject in gpu_cull.cs (std430)
+	struct sObject {
+		Matrix44 model;
+		Vector4 center; //w is the index of its command
+		Vector4 halfsize;
+	};
+
+	//visibility flags written for every object
+	enum {
+		IN_FRUSTUM = 1,
+		VISIBLE = 2 //in the frustum and not occluded
+	};
+
+	std::vector<sObject> objects;
+	std::vector<GeometryPool::sDrawCommand> commands;
+
+	bool use_occlusion;
+	int pyramid_width; //of the first level, half the depth buffer
+	int pyramid_height;
+	int pyramid_levels;
+	bool pyramid_ready; //built since the last cull, otherwise only the frustum is tested
+	bool occlusion_culled; //the last cull used the pyramid, the objects it hid need cullOccluded
+
+	std::vector<uint32> visibility; //flags of every object, only filled by readVisibility
+
+	GPUCulling();
+	~GPUCulling();
+
+	static bool isSupported();
+
+	//uploads objects and commands, call it after filling them
+	void upload();
+
+	//resets the commands of the pool and fills them with the objects visible from the camera
+	//(the pool buffers are shared with the CPU multidraws, call it after the passes using those)
+	void cull(Camera* camera, GeometryPool& pool);
+	//second pass, with a pyramid built from the depth of the first one: resets the commands again and fills them with
+	//the objects the last cull found occluded that are visible now (only those are drawn, the rest already are)
+	void cullOccluded(GeometryPool& pool);
+
+	//farthest depth of every texel in a mip chain, used to cull against this frame in the next one
+	void buildDepthPyramid(Texture* depth_texture, const Matrix44& viewprojection);
+
+	//copies the flags of the last cull to visibility (stalls until the GPU finishes, only for debugging)
+	void readVisibility();
+
+private:
+	void dispatch(GeometryPool& pool, bool second_pass);
+
+	GLuint objects_buffer;
+	GLuint commands_buffer; //the commands without instances, copied to the pool before every cull
+	GLuint visibility_buffer;
+	GLuint pyramid_texture;
+	Matrix44 pyramid_viewprojection;
+	int num_objects; //uploaded
+	int num_commands;
+};
+
+#endif
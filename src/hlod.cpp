@@ -0,0 +1,346 @@
+#include "hlod.h"
+#include "mesh.h"
+#include "meshsimplifier.h"
+#include "impostor.h"
+#include "material.h"
+#include "camera.h"
+#include "fbo.h"
+#include "utils.h"
+#include "task.h"
+
+#include "includes.h"
+#include "glstate.h"
+
+#include <algorithm>
+#include <map>
+#include <cmath>
+#include <climits>
+
+struct sPositionLess {
+	bool operator()(const Vector3& a, const Vector3& b) const {
+		if (a.x != b.x)
+			return a.x < b.x;
+		if (a.y != b.y)
+			return a.y < b.y;
+		return a.z < b.z;
+	}
+};
+
+HLOD::HLOD()
+{
+	cell_size = 100.0f;
+	ratio = 0.1f;
+	merge_ratio = 0.25f;
+	max_top_clusters = 1;
+	min_entities = 2;
+	tile_size = 256;
+	build_time = 0.0f;
+	num_source_triangles = 0;
+	num_triangles = 0;
+	num_merged = 0;
+	num_levels = 0;
+}
+
+HLOD::~HLOD()
+{
+	clear();
+}
+
+void HLOD::clear()
+{
+	for (int i = 0; i < clusters.size(); ++i) {
+		delete clusters[i].mesh;
+		delete clusters[i].fbo;
+		delete clusters[i].material;
+	}
+	clusters.clear();
+	num_source_triangles = 0;
+	num_triangles = 0;
+	num_merged = 0;
+	num_levels = 0;
+}
+
+Vector3 HLOD::getAxisDirection(int axis)
+{
+	Vector3 direction;
+	direction.v[axis / 2] = axis % 2 ? -1.0f : 1.0f;
+	return direction;
+}
+
+void HLOD::build(const std::vector<BoundingBox>& bounds, const std::vector< std::vector<sPart> >& parts, int num_workers)
+{
+	double start_time = getPreciseTime();
+	clear();
+
+	//cells in a map so the clusters come always in the same order
+	std::map< std::pair<int, int>, std::vector<int> > cells;
+	for (int i = 0; i < bounds.size(); ++i) {
+		const Vector3& center = bounds[i].center;
+		cells[std::make_pair((int)floor(center.x / cell_size), (int)floor(center.z / cell_size))].push_back(i);
+	}
+	std::vector< std::pair<int, int> > cluster_cells; //in the grid of the level being merged
+	for (std::map< std::pair<int, int>, std::vector<int> >::iterator it = cells.begin(); it != cells.end(); ++it) {
+		if (it->second.size() < min_entities)
+			continue;
+		sCluster cluster;
+		cluster.entities = it->second;
+		cluster.bounding = bounds[cluster.entities[0]];
+		for (int i = 1; i < cluster.entities.size(); ++i)
+			cluster.bounding = mergeBoundingBoxes(cluster.bounding, bounds[cluster.entities[i]]);
+		cluster.level = 0;
+		clusters.push_back(cluster);
+		cluster_cells.push_back(it->first);
+	}
+	int num_cells = clusters.size();
+	for (int i = 0; i < clusters.size(); ++i)
+		initCluster(clusters[i]);
+
+	//the simplification is the slow part, every cluster is independent inside its level
+	std::vector< std::vector<Vector3> > cluster_positions(clusters.size());
+	std::vector< std::vector<unsigned int> > cluster_indices(clusters.size());
+	parallelFor(num_cells, num_workers, [&](int worker, int start, int end) {
+		for (int i = start; i < end; ++i) {
+			gatherParts(clusters[i], parts, cluster_positions[i], cluster_indices[i]);
+			clusters[i].num_source_triangles = cluster_indices[i].size() / 3;
+			buildProxy(clusters[i], cluster_positions[i], cluster_indices[i], (int)(clusters[i].num_source_triangles * ratio));
+		}
+	});
+
+	//every round merges the top clusters of every 2x2 block of the grid and doubles its cells, until max_top_clusters
+	//cover the scene. A cluster alone in its block goes up as it is, a proxy repeating it would be a waste
+	//from the first cell, halving positive coordinates always ends in a single block
+	std::vector<int> top(num_cells);
+	std::pair<int, int> first_cell(INT_MAX, INT_MAX);
+	for (int i = 0; i < num_cells; ++i) {
+		top[i] = i;
+		first_cell.first = std::min(first_cell.first, cluster_cells[i].first);
+		first_cell.second = std::min(first_cell.second, cluster_cells[i].second);
+	}
+	for (int i = 0; i < num_cells; ++i) {
+		cluster_cells[i].first -= first_cell.first;
+		cluster_cells[i].second -= first_cell.second;
+	}
+	num_levels = num_cells ? 1 : 0;
+	while (top.size() > std::max(max_top_clusters, 1)) {
+		std::map< std::pair<int, int>, std::vector<int> > blocks;
+		for (int i = 0; i < top.size(); ++i) {
+			std::pair<int, int>& cell = cluster_cells[top[i]];
+			cell = std::make_pair((int)floor(cell.first * 0.5f), (int)floor(cell.second * 0.5f));
+			blocks[cell].push_back(top[i]);
+		}
+
+		int first = clusters.size();
+		top.clear();
+		for (std::map< std::pair<int, int>, std::vector<int> >::iterator it = blocks.begin(); it != blocks.end(); ++it) {
+			if (it->second.size() < 2) {
+				top.push_back(it->second[0]);
+				continue;
+			}
+			sCluster cluster;
+			cluster.children = it->second;
+			cluster.bounding = clusters[cluster.children[0]].bounding;
+			cluster.level = 0;
+			for (int i = 0; i < cluster.children.size(); ++i) {
+				sCluster& child = clusters[cluster.children[i]];
+				child.parent = clusters.size();
+				cluster.entities.insert(cluster.entities.end(), child.entities.begin(), child.entities.end());
+				cluster.bounding = mergeBoundingBoxes(cluster.bounding, child.bounding);
+				cluster.level = std::max(cluster.level, child.level + 1);
+			}
+			top.push_back(clusters.size());
+			clusters.push_back(cluster);
+			cluster_cells.push_back(it->first);
+		}
+		if (first == clusters.size())
+			continue; //all alone in their blocks, the cells keep growing until they share one
+
+		for (int i = first; i < clusters.size(); ++i) {
+			initCluster(clusters[i]);
+			num_levels = std::max(num_levels, clusters[i].level + 1);
+		}
+		cluster_positions.resize(clusters.size());
+		cluster_indices.resize(clusters.size());
+		//the merges start from the triangles kept in the children, their errors are added
+		parallelFor(clusters.size() - first, num_workers, [&](int worker, int start, int end) {
+			for (int i = first + start; i < first + end; ++i) {
+				sCluster& cluster = clusters[i];
+				gatherChildren(cluster, cluster_positions, cluster_indices, cluster_positions[i], cluster_indices[i]);
+				cluster.num_source_triangles = 0;
+				float children_error = 0.0f;
+				for (int c = 0; c < cluster.children.size(); ++c) {
+					cluster.num_source_triangles += clusters[cluster.children[c]].num_source_triangles;
+					children_error = std::max(children_error, clusters[cluster.children[c]].error);
+				}
+				buildProxy(cluster, cluster_positions[i], cluster_indices[i], (int)(cluster_indices[i].size() / 3 * merge_ratio));
+				cluster.error += children_error;
+			}
+		});
+	}
+	num_merged = clusters.size() - num_cells;
+
+	for (int i = 0; i < clusters.size(); ++i) {
+		sCluster& cluster = clusters[i];
+		cluster.mesh->uploadToVRAM();
+		cluster.fbo = new FBO();
+		cluster.fbo->create(tile_size * ATLAS_COLUMNS, tile_size * ATLAS_ROWS, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
+		cluster.material = new GTR::Material(cluster.fbo->color_textures[0]);
+		cluster.material->alpha_cutoff = 0.0f; //the alpha of the atlas is not an opacity
+		if (cluster.level == 0)
+			num_source_triangles += cluster.num_source_triangles;
+		num_triangles += cluster.mesh->m_indices.size() / 3;
+	}
+
+	build_time = (float)(getPreciseTime() - start_time);
+}
+
+//the ids of the meshes are not thread safe, the proxy meshes are created here
+void HLOD::initCluster(sCluster& cluster)
+{
+	cluster.center = cluster.bounding.center;
+	cluster.radius = std::max((float)cluster.bounding.halfsize.length(), 0.001f);
+	cluster.mesh = new Mesh();
+	cluster.fbo = NULL;
+	cluster.material = NULL;
+	cluster.parent = -1;
+	cluster.error = 0.0f;
+	cluster.num_source_triangles = 0;
+}
+
+void HLOD::gatherParts(const sCluster& cluster, const std::vector< std::vector<sPart> >& parts, std::vector<Vector3>& positions, std::vector<unsigned int>& indices)
+{
+	//the same positions welded so only the real borders are locked when simplifying
+	std::map<Vector3, unsigned int, sPositionLess> welded;
+	std::vector<unsigned int> remap;
+	for (int e = 0; e < cluster.entities.size(); ++e) {
+		const std::vector<sPart>& entity_parts = parts[cluster.entities[e]];
+		for (int p = 0; p < entity_parts.size(); ++p) {
+			Mesh* mesh = entity_parts[p].mesh;
+			int num_vertices = mesh->interleaved.size() ? mesh->interleaved.size() : mesh->vertices.size();
+			if (!num_vertices)
+				continue;
+			remap.resize(num_vertices);
+			for (int i = 0; i < num_vertices; ++i) {
+				Vector3 position = entity_parts[p].model * (mesh->interleaved.size() ? mesh->interleaved[i].vertex : mesh->vertices[i]);
+				std::pair<std::map<Vector3, unsigned int, sPositionLess>::iterator, bool> found = welded.insert(std::make_pair(position, (unsigned int)positions.size()));
+				if (found.second)
+					positions.push_back(position);
+				remap[i] = found.first->second;
+			}
+			bool indexed = mesh->m_indices.size() > 0;
+			int num_indices = indexed ? mesh->m_indices.size() : num_vertices;
+			for (int i = 0; i + 2 < num_indices; i += 3)
+				for (int k = 0; k < 3; ++k)
+					indices.push_back(remap[indexed ? mesh->m_indices[i + k] : i + k]);
+		}
+	}
+}
+
+void HLOD::gatherChildren(const sCluster& cluster, const std::vector< std::vector<Vector3> >& cluster_positions, const std::vector< std::vector<unsigned int> >& cluster_indices,
+	std::vector<Vector3>& positions, std::vector<unsigned int>& indices)
+{
+	//the borders of the children were locked, where two cells touch they still share the positions
+	std::map<Vector3, unsigned int, sPositionLess> welded;
+	std::vector<int> remap;
+	for (int c = 0; c < cluster.children.size(); ++c) {
+		const std::vector<Vector3>& child_positions = cluster_positions[cluster.children[c]];
+		const std::vector<unsigned int>& child_indices = cluster_indices[cluster.children[c]];
+		remap.assign(child_positions.size(), -1);
+		for (int i = 0; i < child_indices.size(); ++i) {
+			unsigned int index = child_indices[i];
+			if (remap[index] == -1) {
+				std::pair<std::map<Vector3, unsigned int, sPositionLess>::iterator, bool> found = welded.insert(std::make_pair(child_positions[index], (unsigned int)positions.size()));
+				if (found.second)
+					positions.push_back(child_positions[index]);
+				remap[index] = found.first->second;
+			}
+			indices.push_back(remap[index]);
+		}
+	}
+}
+
+void HLOD::buildProxy(sCluster& cluster, const std::vector<Vector3>& positions, std::vector<unsigned int>& indices, int target_triangles)
+{
+	MeshSimplifier simplifier(positions, indices);
+	simplifier.simplify(target_triangles);
+	simplifier.getIndices(indices);
+	cluster.error = simplifier.getError();
+
+	//every triangle reads the tile of the axis closest to its normal, so the vertices are split by axis
+	Mesh* mesh = cluster.mesh;
+	std::map<std::pair<unsigned int, int>, unsigned int> vertices;
+	for (int t = 0; t + 2 < indices.size(); t += 3) {
+		const Vector3& p0 = positions[indices[t]];
+		Vector3 normal = (positions[indices[t + 1]] - p0).cross(positions[indices[t + 2]] - p0);
+		int axis = 0;
+		for (int k = 1; k < 3; ++k)
+			if (fabs(normal.v[k]) > fabs(normal.v[axis]))
+				axis = k;
+		axis = axis * 2 + (normal.v[axis] < 0.0f ? 1 : 0);
+
+		for (int k = 0; k < 3; ++k) {
+			std::pair<std::map<std::pair<unsigned int, int>, unsigned int>::iterator, bool> found =
+				vertices.insert(std::make_pair(std::make_pair(indices[t + k], axis), (unsigned int)mesh->vertices.size()));
+			if (found.second) {
+				Vector3 position = positions[indices[t + k]] - cluster.center;
+				mesh->vertices.push_back(position);
+				mesh->normals.push_back(Vector3());
+				mesh->uvs.push_back(getAtlasCoord(cluster, position, axis));
+			}
+			//weighted by the area of the triangle (the length of the cross product)
+			mesh->normals[found.first->second] = mesh->normals[found.first->second] + normal;
+			mesh->m_indices.push_back(found.first->second);
+		}
+	}
+	for (int i = 0; i < mesh->normals.size(); ++i)
+		mesh->normals[i].normalize();
+	mesh->updateBoundingBox();
+	mesh->radius = cluster.radius;
+}
+
+//where the orthographic camera of the axis sees the position (relative to the center)
+Vector2 HLOD::getAtlasCoord(const sCluster& cluster, const Vector3& position, int axis)
+{
+	Vector3 right, up;
+	Impostor::getFrameBasis(getAxisDirection(axis), right, up);
+	float u = position.dot(right) / cluster.radius * 0.5f + 0.5f;
+	float v = position.dot(up) / cluster.radius * 0.5f + 0.5f;
+	return Vector2((axis % ATLAS_COLUMNS + u) / ATLAS_COLUMNS, (axis / ATLAS_COLUMNS + v) / ATLAS_ROWS);
+}
+
+void HLOD::bind(const sCluster& cluster)
+{
+	cluster.fbo->bind();
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	GLState::enable(GL_SCISSOR_TEST);
+}
+
+//same framing than the frames of the impostors
+void HLOD::setupAxisCamera(const sCluster& cluster, int axis, Camera* camera)
+{
+	Vector3 direction = getAxisDirection(axis);
+	Vector3 right, up;
+	Impostor::getFrameBasis(direction, right, up);
+	float radius = cluster.radius;
+	camera->lookAt(cluster.center + direction * (radius * 2.0f), cluster.center, up);
+	camera->setOrthographic(-radius, radius, -radius, radius, radius, radius * 3.0f);
+}
+
+void HLOD::setTile(int axis)
+{
+	int x = (axis % ATLAS_COLUMNS) * tile_size;
+	int y = (axis / ATLAS_COLUMNS) * tile_size;
+	glViewport(x, y, tile_size, tile_size);
+	glScissor(x, y, tile_size, tile_size);
+}
+
+void HLOD::unbind(const sCluster& cluster)
+{
+	GLState::disable(GL_SCISSOR_TEST);
+	cluster.fbo->unbind();
+
+	//the proxies are only seen far, without mipmaps the atlas would shimmer
+	Texture* atlas = cluster.fbo->color_textures[0];
+	atlas->generateMipmaps();
+	glTexParameteri(atlas->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
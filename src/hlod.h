@@ -0,0 +1,96 @@
+/*	Hierarchical LOD of the static prefab entities: they are clustered by the cell of a grid (in the XZ plane) where
+	the center of their bounds falls, and every cluster gets a proxy mesh with the opaque geometry of all its entities
+	merged and simplified. The proxy is textured with an atlas of the cluster seen from the six axes, every triangle
+	reads the view of the axis closest to its normal (wrong for the parts hidden from that side, but it is only seen far).
+	Far from the camera the whole cluster is one render call of its proxy, so the far field costs a draw per cell of
+	the grid whatever the number of entities in it.
+	The proxies of every block of 2x2 cells are merged and simplified again in the next level, with its own atlas, and so
+	on doubling the cells until max_top_clusters cover the scene (a single root by default). The renderer uses a proxy
+	instead of its children when its error (added to the ones of the levels below) is small enough once projected, so
+	far enough the draws are bounded by the clusters of the top whatever the size of the scene.
+	The meshes are built in parallel from the CPU copies, the atlas is baked by the renderer between bind and unbind.
+*/
+
+#ifndef HLOD_H
+#define HLOD_H
+
+#include "framework.h"
+
+class Mesh;
+class FBO;
+class Camera;
+
+namespace GTR {
+	class Material;
+}
+
+class HLOD
+{
+public:
+	static const int ATLAS_COLUMNS = 3; //one tile per axis
+	static const int ATLAS_ROWS = 2;
+
+	struct sPart {
+		Mesh* mesh;
+		Matrix44 model;
+	};
+
+	struct sCluster {
+		std::vector<int> entities; //indices in the lists given to build
+		BoundingBox bounding; //world space
+		Vector3 center; //bounding sphere, the tiles of the atlas are fitted to it
+		float radius;
+		Mesh* mesh; //proxy, relative to center
+		FBO* fbo; //atlas
+		GTR::Material* material; //of the proxy, with the atlas as color texture
+		int num_source_triangles;
+		int level; //0 for the cells, one more than the highest of its children for the merged ones
+		int parent; //cluster of the next level containing this one, -1 if none
+		std::vector<int> children; //clusters of the level below merged in this one
+		float error; //of the simplification, a distance in world units (with the one of the children added)
+	};
+
+	std::vector<sCluster> clusters; //the cells go first, a parent always comes after its children
+	float cell_size;
+	float ratio; //of the triangles kept by the simplification
+	float merge_ratio; //of the triangles of the children kept when merging them
+	int max_top_clusters; //the levels are merged until there are no more clusters without parent than this
+	int min_entities; //smaller clusters are not worth a proxy
+	int tile_size; //of every axis in the atlas, in pixels
+
+	//last build
+	float build_time; //ms, without the bake
+	int num_source_triangles;
+	int num_triangles; //of the proxies of both levels
+	int num_merged; //clusters above the cells
+	int num_levels;
+
+	HLOD();
+	~HLOD();
+
+	void clear();
+
+	//clusters the entities by their world bounds and builds the proxy meshes from their parts (the models are in world space)
+	void build(const std::vector<BoundingBox>& bounds, const std::vector< std::vector<sPart> >& parts, int num_workers = 1);
+
+	//binds the atlas of the cluster and clears it, every axis is drawn with its camera and its tile
+	void bind(const sCluster& cluster);
+	void setupAxisCamera(const sCluster& cluster, int axis, Camera* camera);
+	void setTile(int axis);
+	void unbind(const sCluster& cluster); //also builds the mipmaps of the atlas
+
+	//axes in the order of the tiles: +x, -x, +y, -y, +z, -z
+	static Vector3 getAxisDirection(int axis);
+
+private:
+	void initCluster(sCluster& cluster);
+	//the triangles of the parts of the entities, or the simplified ones of the children, in world space and welded
+	void gatherParts(const sCluster& cluster, const std::vector< std::vector<sPart> >& parts, std::vector<Vector3>& positions, std::vector<unsigned int>& indices);
+	void gatherChildren(const sCluster& cluster, const std::vector< std::vector<Vector3> >& cluster_positions, const std::vector< std::vector<unsigned int> >& cluster_indices,
+		std::vector<Vector3>& positions, std::vector<unsigned int>& indices);
+	//simplifies the triangles (the indices are left with the ones kept) and builds the proxy mesh from them
+	void buildProxy(sCluster& cluster, const std::vector<Vector3>& positions, std::vector<unsigned int>& indices, int target_triangles);
+	Vector2 getAtlasCoord(const sCluster& cluster, const Vector3& position, int axis);
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "impostor.h"
+#include "fbo.h"
+#include "camera.h"
+
+#include "includes.h"
+#include "glstate.h"
+
+#include <algorithm>
+#include <cmath>
+
+Impostor::Impostor()
+{
+	fbo = NULL;
+	radius = 0.0f;
+	frames = 0;
+	size = 0;
+}
+
+Impostor::~Impostor()
+{
+	delete fbo;
+}
+
+void Impostor::create(const BoundingBox& bounding, int frames, int size)
+{
+	delete fbo;
+	this->bounding = bounding;
+	this->frames = frames;
+	this->size = size;
+	center = bounding.center;
+	radius = std::max((float)bounding.halfsize.length(), 0.001f);
+
+	fbo = new FBO();
+	fbo->create(size, size, 3, GL_RGBA, GL_UNSIGNED_BYTE, true);
+}
+
+//the center of the cell decoded from the hemi-octahedral map, |x| + |z| is the distance to the center of the atlas
+Vector3 Impostor::getFrameDirection(int x, int y, int frames)
+{
+	float u = (x + 0.5f) / frames * 2.0f - 1.0f;
+	float v = (y + 0.5f) / frames * 2.0f - 1.0f;
+	Vector3 direction((u + v) * 0.5f, 0.0f, (u - v) * 0.5f);
+	direction.y = 1.0f - fabs(direction.x) - fabs(direction.z);
+	return direction.normalize();
+}
+
+void Impostor::getFrameBasis(const Vector3& direction, Vector3& right, Vector3& up)
+{
+	Vector3 reference = fabs(direction.y) > 0.999f ? Vector3(0.0f, 0.0f, -1.0f) : Vector3(0.0f, 1.0f, 0.0f);
+	right = reference.cross(direction);
+	right.normalize();
+	up = direction.cross(right);
+}
+
+void Impostor::setupFrameCamera(int x, int y, Camera* camera)
+{
+	Vector3 direction = getFrameDirection(x, y, frames);
+	Vector3 right, up;
+	getFrameBasis(direction, right, up);
+
+	//the sphere goes from near to far, so the depth 0.5 is the plane of the quad
+	camera->lookAt(center + direction * (radius * 2.0f), center, up);
+	camera->setOrthographic(-radius, radius, -radius, radius, radius, radius * 3.0f);
+}
+
+void Impostor::bind()
+{
+	fbo->bind();
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	GLState::enable(GL_SCISSOR_TEST);
+}
+
+void Impostor::setFrame(int x, int y)
+{
+	int frame_size = size / frames;
+	glViewport(x * frame_size, y * frame_size, frame_size, frame_size);
+	glScissor(x * frame_size, y * frame_size, frame_size, frame_size);
+}
+
+void Impostor::unbind()
+{
+	GLState::disable(GL_SCISSOR_TEST);
+	fbo->unbind();
+}
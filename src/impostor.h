@@ -0,0 +1,47 @@
+/*	Octahedral impostor of a prefab: the prefab is rendered from frames x frames directions of the upper hemisphere
+	into an atlas with the same three gbuffers than the deferred pipeline (albedo, normal and material) plus the depth,
+	linear because the frames use an orthographic camera fitted to the bounding sphere.
+	The directions come from a hemi-octahedral map of the grid, a view uses the frame of the cell where it falls.
+	Far instances are drawn as quads facing that direction (see impostor.vs in the shader atlas), one instanced draw
+	for all the instances of the prefab. The math of the frames must match the one of the shader.
+*/
+
+#ifndef IMPOSTOR_H
+#define IMPOSTOR_H
+
+#include "framework.h"
+
+class FBO;
+class Camera;
+
+class Impostor
+{
+public:
+	FBO* fbo;
+	BoundingBox bounding; //of the prefab, in the space of its entity
+	Vector3 center; //bounding sphere
+	float radius;
+	int frames; //per side of the atlas
+	int size; //of the atlas, in pixels
+	std::vector<Matrix44> models; //entities drawn with the impostor this frame
+
+	Impostor();
+	~Impostor();
+
+	void create(const BoundingBox& bounding, int frames = 8, int size = 1024);
+
+	//orthographic camera looking at the prefab from the direction of the frame
+	void setupFrameCamera(int x, int y, Camera* camera);
+
+	//binds the fbo and clears the whole atlas, then every frame restricts the viewport to its cell
+	void bind();
+	void setFrame(int x, int y);
+	void unbind();
+
+	//direction from the center to the camera of the frame, y is up
+	static Vector3 getFrameDirection(int x, int y, int frames);
+	//axes of the frame image in the space of the prefab
+	static void getFrameBasis(const Vector3& direction, Vector3& right, Vector3& up);
+};
+
+#endif
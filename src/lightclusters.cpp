@@ -0,0 +1,236 @@
+#include "lightclusters.h"
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "scene.h"
+#include "utils.h"
+#include "task.h"
+
+#include <algorithm>
+#include <cstring>
+
+LightClusters::LightClusters()
+{
+	grid_x = 16;
+	grid_y = 9;
+	grid_z = 24;
+	max_distance = 2000.0f;
+	num_global_lights = 0;
+	cascaded_light = -1;
+	num_indices = 0;
+	max_cluster_lights = 0;
+	build_time = 0.0f;
+	near_plane = 1.0f;
+	far_plane = 1000.0f;
+	lights_texture = NULL;
+	grid_texture = NULL;
+	indices_texture = NULL;
+}
+
+LightClusters::~LightClusters()
+{
+	delete lights_texture;
+	delete grid_texture;
+	delete indices_texture;
+}
+
+//view space point of the ndc (x,y) at depth (positive distance along -z), interpolating between the near and far points
+static Vector3 pointAtDepth(const Vector3& near_point, const Vector3& far_point, float depth)
+{
+	float t = (depth + near_point.z) / (near_point.z - far_point.z);
+	return near_point + (far_point - near_point) * t;
+}
+
+void LightClusters::build(Camera* camera, const std::vector<GTR::LightEntity*>& scene_lights, int num_workers)
+{
+	double start_time = getPreciseTime();
+
+	view = camera->view_matrix;
+	viewprojection = camera->viewprojection_matrix;
+	near_plane = std::max(camera->near_plane, 0.001f);
+	far_plane = std::max(std::min(camera->far_plane, max_distance), near_plane * 2.0f);
+
+	//global lights first, they are not binned
+	lights.clear();
+	for (int i = 0; i < scene_lights.size(); ++i)
+		if (scene_lights[i]->light_type == GTR::DIRECTIONAL)
+			lights.push_back(scene_lights[i]);
+	num_global_lights = lights.size();
+	for (int i = 0; i < scene_lights.size(); ++i)
+		if (scene_lights[i]->light_type != GTR::DIRECTIONAL)
+			lights.push_back(scene_lights[i]);
+
+	fillLightData();
+
+	//bounding sphere of every local light in view space
+	std::vector<Vector4> spheres(lights.size());
+	for (int i = num_global_lights; i < lights.size(); ++i) {
+		Vector3 center = view * lights[i]->model.getTranslation();
+		spheres[i].set(center.x, center.y, center.z, lights[i]->max_distance);
+	}
+
+	//view space points of the corners of the tiles in the near and far planes of the camera
+	Matrix44 inv_projection = camera->projection_matrix;
+	inv_projection.inverse();
+	near_points.resize((grid_x + 1) * (grid_y + 1));
+	far_points.resize(near_points.size());
+	for (int y = 0; y <= grid_y; ++y)
+		for (int x = 0; x <= grid_x; ++x) {
+			float ndc_x = x / (float)grid_x * 2.0f - 1.0f;
+			float ndc_y = y / (float)grid_y * 2.0f - 1.0f;
+			Vector4 a = inv_projection * Vector4(ndc_x, ndc_y, -1.0f, 1.0f);
+			Vector4 b = inv_projection * Vector4(ndc_x, ndc_y, 1.0f, 1.0f);
+			int index = x + y * (grid_x + 1);
+			near_points[index].set(a.x / a.w, a.y / a.w, a.z / a.w);
+			far_points[index].set(b.x / b.w, b.y / b.w, b.z / b.w);
+		}
+
+	//every slice is binned by one job in its own list, then merged in slice order
+	grid_data.assign(grid_x * grid_y * grid_z * 4, 0.0f);
+	slice_indices.resize(grid_z);
+	parallelFor(grid_z, num_workers, [&](int worker, int start, int end) {
+		for (int slice = start; slice < end; ++slice)
+			binSlice(slice, camera, spheres);
+	});
+
+	num_indices = 0;
+	max_cluster_lights = 0;
+	for (int slice = 0; slice < grid_z; ++slice) {
+		float* cell = &grid_data[slice * grid_x * grid_y * 4];
+		for (int i = 0; i < grid_x * grid_y; ++i, cell += 4) {
+			cell[0] += num_indices;
+			max_cluster_lights = std::max(max_cluster_lights, (int)cell[1]);
+		}
+		num_indices += slice_indices[slice].size();
+	}
+
+	int index_texels = std::max((num_indices + 3) / 4, 1);
+	int index_rows = (index_texels + INDEX_TEXTURE_WIDTH - 1) / INDEX_TEXTURE_WIDTH;
+	index_data.resize(index_rows * INDEX_TEXTURE_WIDTH * 4);
+	float* dst = &index_data[0];
+	for (int slice = 0; slice < grid_z; ++slice) {
+		std::copy(slice_indices[slice].begin(), slice_indices[slice].end(), dst);
+		dst += slice_indices[slice].size();
+	}
+
+	uploadTexture(lights_texture, LIGHT_TEXELS, std::max((int)lights.size(), 1), light_data);
+	uploadTexture(grid_texture, grid_x, grid_y * grid_z, grid_data);
+	uploadTexture(indices_texture, INDEX_TEXTURE_WIDTH, index_rows, index_data);
+
+	build_time = (float)(getPreciseTime() - start_time);
+}
+
+void LightClusters::fillLightData()
+{
+	light_data.assign(std::max((int)lights.size(), 1) * LIGHT_TEXELS * 4, 0.0f);
+	cascaded_light = -1;
+
+	for (int i = 0; i < lights.size(); ++i) {
+		GTR::LightEntity* light = lights[i];
+		float* texel = &light_data[i * LIGHT_TEXELS * 4];
+
+		Vector3 position = light->model.getTranslation();
+		Vector3 color = light->color * light->intensity;
+		Vector3 direction = light->model.rotateVector(Vector3(0, 0, -1));
+
+		bool cast_shadows = light->cast_shadows && light->shadowmap;
+		if (cast_shadows && light->num_cascades) {
+			if (cascaded_light == -1)
+				cascaded_light = i;
+			else
+				cast_shadows = false;
+		}
+
+		texel[0] = position.x; texel[1] = position.y; texel[2] = position.z; texel[3] = light->max_distance;
+		texel[4] = color.x; texel[5] = color.y; texel[6] = color.z; texel[7] = (float)light->light_type;
+		texel[8] = direction.x; texel[9] = direction.y; texel[10] = direction.z; texel[11] = cos(light->cone_angle * DEG2RAD);
+		texel[12] = light->cone_exp; texel[13] = cast_shadows ? 1.0f : 0.0f; texel[14] = light->shadow_bias;
+
+		//cascades have their own uniforms, see Renderer::uploadShadowCascades
+		if (!cast_shadows || light->num_cascades)
+			continue;
+		const Vector4& tile = light->shadowmap_region;
+		texel[16] = tile.x; texel[17] = tile.y; texel[18] = tile.z; texel[19] = tile.w;
+		memcpy(texel + 20, light->light_camera->viewprojection_matrix.m, sizeof(float) * 16);
+	}
+}
+
+void LightClusters::binSlice(int slice, Camera* camera, const std::vector<Vector4>& spheres)
+{
+	std::vector<float>& indices = slice_indices[slice];
+	indices.clear();
+
+	//the first slice starts in the camera and the last one goes until the far plane
+	float ratio = far_plane / near_plane;
+	float slice_near = slice == 0 ? 0.0f : near_plane * pow(ratio, slice / (float)grid_z);
+	float slice_far = slice == grid_z - 1 ? camera->far_plane : near_plane * pow(ratio, (slice + 1) / (float)grid_z);
+
+	//lights touching the slice at all
+	std::vector<int> candidates;
+	for (int i = num_global_lights; i < spheres.size(); ++i) {
+		float depth = -spheres[i].z;
+		if (depth + spheres[i].w >= slice_near && depth - spheres[i].w <= slice_far)
+			candidates.push_back(i);
+	}
+
+	//corners of the tiles in the near and far planes of the slice
+	std::vector<Vector3> near_corners(near_points.size());
+	std::vector<Vector3> far_corners(near_points.size());
+	if (candidates.size())
+		for (int i = 0; i < near_points.size(); ++i) {
+			near_corners[i] = pointAtDepth(near_points[i], far_points[i], slice_near);
+			far_corners[i] = pointAtDepth(near_points[i], far_points[i], slice_far);
+		}
+
+	for (int y = 0; y < grid_y; ++y)
+		for (int x = 0; x < grid_x; ++x) {
+			float* cell = &grid_data[((slice * grid_y + y) * grid_x + x) * 4];
+			cell[0] = (float)indices.size(); //offset inside the slice, made global when merging
+			if (!candidates.size())
+				continue;
+
+			//box of the froxel in view space
+			Vector3 box_min(1e10f, 1e10f, 1e10f);
+			Vector3 box_max(-1e10f, -1e10f, -1e10f);
+			for (int c = 0; c < 4; ++c) {
+				int index = (x + (c & 1)) + (y + (c >> 1)) * (grid_x + 1);
+				box_min.setMin(near_corners[index]);
+				box_max.setMax(near_corners[index]);
+				box_min.setMin(far_corners[index]);
+				box_max.setMax(far_corners[index]);
+			}
+
+			for (int j = 0; j < candidates.size(); ++j) {
+				const Vector4& sphere = spheres[candidates[j]];
+				float dx = std::max(std::max(box_min.x - sphere.x, sphere.x - box_max.x), 0.0f);
+				float dy = std::max(std::max(box_min.y - sphere.y, sphere.y - box_max.y), 0.0f);
+				float dz = std::max(std::max(box_min.z - sphere.z, sphere.z - box_max.z), 0.0f);
+				if (dx * dx + dy * dy + dz * dz <= sphere.w * sphere.w)
+					indices.push_back((float)candidates[j]);
+			}
+			cell[1] = indices.size() - cell[0];
+		}
+}
+
+void LightClusters::uploadTexture(Texture*& texture, int width, int height, std::vector<float>& data)
+{
+	if (texture && texture->width == width && texture->height == height) {
+		texture->upload(GL_RGBA, GL_FLOAT, false, (Uint8*)&data[0]);
+		return;
+	}
+	delete texture;
+	texture = new Texture(width, height, GL_RGBA, GL_FLOAT, false, (Uint8*)&data[0]);
+}
+
+void LightClusters::upload(Shader* shader, int first_slot)
+{
+	shader->setUniform(UNIFORM_ID("u_cluster_lights"), lights_texture, first_slot);
+	shader->setUniform(UNIFORM_ID("u_cluster_grid"), grid_texture, first_slot + 1);
+	shader->setUniform(UNIFORM_ID("u_cluster_indices"), indices_texture, first_slot + 2);
+	shader->setUniform3(UNIFORM_ID("u_cluster_dims"), grid_x, grid_y, grid_z);
+	shader->setUniform(UNIFORM_ID("u_cluster_depth"), Vector2(near_plane, grid_z / log(far_plane / near_plane)));
+	shader->setUniform(UNIFORM_ID("u_cluster_view"), view);
+	shader->setUniform(UNIFORM_ID("u_cluster_viewprojection"), viewprojection);
+	shader->setUniform(UNIFORM_ID("u_num_global_lights"), num_global_lights);
+	shader->setUniform(UNIFORM_ID("u_num_cluster_lights"), (int)lights.size());
+}
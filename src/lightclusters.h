@@ -0,0 +1,71 @@
+/*	Clustered lighting: the view frustum is split in a grid of froxels (tiles of the screen times exponential depth slices)
+	and every froxel gets the list of the lights whose range touches it, so a pixel only evaluates the lights that can reach it.
+	The lists are built in the CPU (one depth slice per job) and sent to the GPU as float textures:
+	- lights: LIGHT_TEXELS texels per light (one row each), the global ones (directional) first, they are not binned
+	- grid: offset and count in the indices of every froxel, grid_x wide and grid_y * grid_z tall
+	- indices: four light indices per texel, rows of INDEX_TEXTURE_WIDTH texels
+*/
+
+#ifndef LIGHTCLUSTERS_H
+#define LIGHTCLUSTERS_H
+
+#include "framework.h"
+
+class Camera;
+class Shader;
+class Texture;
+
+namespace GTR {
+	class LightEntity;
+}
+
+class LightClusters
+{
+public:
+	static const int LIGHT_TEXELS = 9;
+	static const int INDEX_TEXTURE_WIDTH = 1024;
+
+	int grid_x;
+	int grid_y;
+	int grid_z; //depth slices, exponential between the near plane and max_distance
+	float max_distance; //the last slice ends here (or in the camera far plane if closer)
+
+	std::vector<GTR::LightEntity*> lights; //in the order of the lights texture
+	int num_global_lights; //directional lights, evaluated in every pixel
+	int cascaded_light; //index of the light using shadow cascades, -1 if none (the uniforms only fit one)
+	int num_indices; //total of light indices in the clusters
+	int max_cluster_lights; //lights in the most crowded cluster
+	float build_time; //ms
+
+	Texture* lights_texture;
+	Texture* grid_texture;
+	Texture* indices_texture;
+
+	LightClusters();
+	~LightClusters();
+
+	//bins the lights in the clusters of this camera and uploads the textures
+	void build(Camera* camera, const std::vector<GTR::LightEntity*>& scene_lights, int num_workers = 1);
+
+	//binds the textures in first_slot and the next two and sets the uniforms of the clustered_lights shader section
+	void upload(Shader* shader, int first_slot);
+
+private:
+	Matrix44 view;
+	Matrix44 viewprojection;
+	float near_plane;
+	float far_plane;
+
+	std::vector<float> light_data;
+	std::vector<float> grid_data;
+	std::vector<float> index_data;
+	std::vector<Vector3> near_points; //corners of the tiles in the near and far planes, view space
+	std::vector<Vector3> far_points;
+	std::vector< std::vector<float> > slice_indices; //per depth slice, merged in order after the jobs
+
+	void fillLightData();
+	void binSlice(int slice, Camera* camera, const std::vector<Vector4>& spheres);
+	void uploadTexture(Texture*& texture, int width, int height, std::vector<float>& data);
+};
+
+#endif
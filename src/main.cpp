@@ -40,9 +40,11 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 	SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
 
 #ifndef __APPLE__
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+	//4.5 enables the GPU driven paths (multidraw indirect and compute), if the driver cannot create it 3.1 is used
+	//compatibility profile, the framework still uses the fixed pipeline (matrix stack, client states, attrib stack)
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
 #endif
     
 	//antialiasing (disable this lines if it goes too slow)
@@ -64,6 +66,14 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
   
 	// Create an OpenGL context associated with the window.
 	glcontext = SDL_GL_CreateContext(sdl_window);
+#ifndef __APPLE__
+	if (!glcontext)
+	{
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+		SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
+		glcontext = SDL_GL_CreateContext(sdl_window);
+	}
+#endif
 
 	//in case of exit, call SDL_Quit()
 	atexit(SDL_Quit);
@@ -43,6 +43,9 @@ namespace GTR {
 		std::string name;
 		void registerMaterial(const char* name);
 
+		static int s_MaterialID;
+		int m_Id; //unique number, used to sort render calls by material
+
 		//parameters to control transparency
 		eAlphaMode alpha_mode;	//could be NO_ALPHA, MASK (alpha cut) or BLEND (alpha blend)
 		float alpha_cutoff;		//pixels with alpha than this value shouldnt be rendered
@@ -66,6 +69,7 @@ namespace GTR {
 
 		//ctors
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+			m_Id = s_MaterialID++;
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
@@ -4,8 +4,13 @@
 #include "shader.h"
 #include "includes.h"
 #include "framework.h"
+#include "glstate.h"
+#include "meshsimplifier.h"
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <limits>
 #include <sys/stat.h>
@@ -17,13 +22,19 @@
 
 //#include "engine/application.h"
 
-bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
+bool Mesh::use_binary = true;			//checks if there is .wbin, it there is one tries to read it instead of the other file (on, so the LODs are built only once)
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+long Mesh::num_instances_rendered = 0;
+bool Mesh::use_vertex_arrays = true;
+long Mesh::num_vertex_arrays = 0;
+bool Mesh::create_lods = true;
+bool Mesh::create_meshlets = true;
+int Mesh::s_MeshID = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -32,9 +43,11 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	m_Id = s_MeshID++;
 	radius = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
+	lod_error = 0.0f;
 
 	clear();
 }
@@ -47,6 +60,10 @@ Mesh::~Mesh()
 
 void Mesh::clear()
 {
+	clearVertexArrays();
+	pool_page = -1; //its range in the pool is not freed
+	pool_base_vertex = pool_first_index = pool_num_indices = 0;
+
 	//Free VBOs
 	#ifdef USE_OPENGL_EXT
 		if (vertices_vbo_id)
@@ -103,6 +120,11 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
+	for (int i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
+	meshlets.clear();
+
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
 }
@@ -117,7 +139,7 @@ int weights_location = -1;
 
 void Mesh::enableBuffers(Shader* sh)
 {
-	vertex_location = sh->getAttribLocation("a_vertex");
+	vertex_location = sh->attribute_locations[ATTRIB_VERTEX];
 	/*
 	assert(vertex_location != -1 && "No a_vertex found in shader");
 	if (vertex_location == -1)
@@ -151,7 +173,7 @@ void Mesh::enableBuffers(Shader* sh)
 	normal_location = -1;
 	if (normals.size() || spacing)
 	{
-		normal_location = sh->getAttribLocation("a_normal");
+		normal_location = sh->attribute_locations[ATTRIB_NORMAL];
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
@@ -169,7 +191,7 @@ void Mesh::enableBuffers(Shader* sh)
 	uv_location = -1;
 	if (uvs.size() || spacing)
 	{
-		uv_location = sh->getAttribLocation("a_coord");
+		uv_location = sh->attribute_locations[ATTRIB_COORD];
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
@@ -187,7 +209,7 @@ void Mesh::enableBuffers(Shader* sh)
 	uv1_location = -1;
 	if (m_uvs1.size())
 	{
-		uv1_location = sh->getAttribLocation("a_coord1");
+		uv1_location = sh->attribute_locations[ATTRIB_COORD1];
 		if (uv1_location != -1)
 		{
 			glEnableVertexAttribArray(uv1_location);
@@ -205,7 +227,7 @@ void Mesh::enableBuffers(Shader* sh)
 	color_location = -1;
 	if (colors.size())
 	{
-		color_location = sh->getAttribLocation("a_color");
+		color_location = sh->attribute_locations[ATTRIB_COLOR];
 		if (color_location != -1)
 		{
 			glEnableVertexAttribArray(color_location);
@@ -223,7 +245,7 @@ void Mesh::enableBuffers(Shader* sh)
 	bones_location = -1;
 	if (bones.size())
 	{
-		bones_location = sh->getAttribLocation("a_bones");
+		bones_location = sh->attribute_locations[ATTRIB_BONES];
 		if (bones_location != -1)
 		{
 			glEnableVertexAttribArray(bones_location);
@@ -239,7 +261,7 @@ void Mesh::enableBuffers(Shader* sh)
 	weights_location = -1;
 	if (weights.size())
 	{
-		weights_location = sh->getAttribLocation("a_weights");
+		weights_location = sh->attribute_locations[ATTRIB_WEIGHTS];
 		if (weights_location != -1)
 		{
 			glEnableVertexAttribArray(weights_location);
@@ -253,6 +275,87 @@ void Mesh::enableBuffers(Shader* sh)
 		}
 	}
 
+	//part of the VAO state when one is bound
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+}
+
+//must match the attributes enableBuffers sets up
+void Mesh::getAttributeLayout(Shader* sh, bool instanced, int* locations)
+{
+	bool has_interleaved = interleaved.size() > 0;
+	for (int i = 0; i < NUM_VERTEX_ATTRIBUTES; ++i)
+		locations[i] = -1;
+	locations[ATTRIB_VERTEX] = sh->attribute_locations[ATTRIB_VERTEX];
+	if (normals.size() || has_interleaved)
+		locations[ATTRIB_NORMAL] = sh->attribute_locations[ATTRIB_NORMAL];
+	if (uvs.size() || has_interleaved)
+		locations[ATTRIB_COORD] = sh->attribute_locations[ATTRIB_COORD];
+	if (m_uvs1.size())
+		locations[ATTRIB_COORD1] = sh->attribute_locations[ATTRIB_COORD1];
+	if (colors.size())
+		locations[ATTRIB_COLOR] = sh->attribute_locations[ATTRIB_COLOR];
+	if (bones.size())
+		locations[ATTRIB_BONES] = sh->attribute_locations[ATTRIB_BONES];
+	if (weights.size())
+		locations[ATTRIB_WEIGHTS] = sh->attribute_locations[ATTRIB_WEIGHTS];
+	if (instanced)
+		locations[ATTRIB_INSTANCE_MODEL] = sh->attribute_locations[ATTRIB_INSTANCE_MODEL];
+}
+
+//one buffer shared by all the instanced draws, its storage is orphaned every time so the driver
+//does not wait for the previous draw to finish reading it (the name never changes, so the VAOs can keep it)
+GLuint instances_buffer_id = 0;
+int instances_buffer_size = 0; //in bytes
+
+//mat4 count as 4 different attributes of vec4... (thanks opengl...)
+static void enableInstanceAttributes(int location)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	for (int k = 0; k < 4; ++k)
+	{
+		glEnableVertexAttribArray(location + k);
+		size_t offset = sizeof(float) * 4 * k;
+		const Uint8* addr = (Uint8*)offset;
+		glVertexAttribPointer(location + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
+		glVertexAttribDivisor(location + k, 1); // This makes it instanced!
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+unsigned int Mesh::getVertexArray(Shader* shader, bool instanced)
+{
+	int locations[NUM_VERTEX_ATTRIBUTES];
+	getAttributeLayout(shader, instanced, locations);
+	for (int i = 0; i < vertex_arrays.size(); ++i)
+		if (memcmp(vertex_arrays[i].locations, locations, sizeof(locations)) == 0)
+			return vertex_arrays[i].vao;
+
+	//first draw with this layout, the attribute setup is recorded in a new VAO
+	sVertexArray vertex_array;
+	memcpy(vertex_array.locations, locations, sizeof(locations));
+	glGenVertexArrays(1, &vertex_array.vao);
+	GLState::bindVertexArray(vertex_array.vao);
+	enableBuffers(shader);
+	if (locations[ATTRIB_INSTANCE_MODEL] != -1)
+		enableInstanceAttributes(locations[ATTRIB_INSTANCE_MODEL]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkGLErrors();
+
+	vertex_arrays.push_back(vertex_array);
+	num_vertex_arrays++;
+	return vertex_array.vao;
+}
+
+void Mesh::clearVertexArrays()
+{
+	for (int i = 0; i < vertex_arrays.size(); ++i)
+	{
+		GLState::forgetVertexArray(vertex_arrays[i].vao);
+		glDeleteVertexArrays(1, &vertex_arrays[i].vao);
+	}
+	num_vertex_arrays -= vertex_arrays.size();
+	vertex_arrays.clear();
 }
 
 void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
@@ -267,6 +370,18 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//all the attributes are in the VAO, the draw only has to bind it (it stays bound, GLState skips binding it again)
+	if (canUseVertexArrays())
+	{
+		GLState::bindVertexArray(getVertexArray(shader, num_instances > 0 && instances_buffer_id));
+		drawCall(primitive, submesh_id, num_instances);
+		checkGLErrors();
+		return;
+	}
+
+	//the setup below would change the bound VAO
+	GLState::bindVertexArray(0);
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 	checkGLErrors();
@@ -301,25 +416,18 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	//DRAW
 	if (m_indices.size())
 	{
+		//the index buffer was bound by enableBuffers (or is part of the VAO)
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
 		}
 		else
 		{
 			if (indices_vbo_id)
 			{
 				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				}
 				checkGLErrors();
 			}
@@ -330,13 +438,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	else
 	{
 		if (num_instances > 0)
-		{
-			#ifdef OPENGL_ES3
-				glDrawArraysInstanced(primitive, start, size, num_instances);
-            #else
-				assert(0 && "not supported in OpenGL ES2");
-            #endif
-		}
+			glDrawArraysInstanced(primitive, start, size, num_instances);
 		else
 			glDrawArrays(primitive, start, size);
 	}
@@ -354,11 +456,44 @@ void Mesh::disableBuffers(Shader* shader)
 	if (color_location != -1) glDisableVertexAttribArray(color_location);
 	if (bones_location != -1) glDisableVertexAttribArray(bones_location);
 	if (weights_location != -1) glDisableVertexAttribArray(weights_location);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 	checkGLErrors();
 }
 
-GLuint instances_buffer_id = 0;
+void Mesh::renderRanges(unsigned int primitive, const int* first_indices, const int* counts, int num_ranges)
+{
+	if (!num_ranges)
+		return;
+
+	Shader* shader = Shader::current;
+	assert(shader && shader->compiled && "no shader or shader not compiled or enabled");
+	assert(indices_vbo_id && "indices must be uploaded to the GPU");
+
+	//offsets in bytes inside the index buffer
+	static std::vector<const void*> offsets;
+	offsets.resize(num_ranges);
+	int size = 0;
+	for (int i = 0; i < num_ranges; ++i) {
+		offsets[i] = (const void*)(first_indices[i] * sizeof(unsigned int));
+		size += counts[i];
+	}
+
+	bool use_vao = canUseVertexArrays();
+	if (use_vao)
+		GLState::bindVertexArray(getVertexArray(shader, false));
+	else {
+		GLState::bindVertexArray(0);
+		enableBuffers(shader);
+	}
+	glMultiDrawElements(primitive, counts, GL_UNSIGNED_INT, &offsets[0], num_ranges);
+	checkGLErrors();
+	if (!use_vao)
+		disableBuffers(shader);
+
+	num_triangles_rendered += size / 3;
+	num_meshes_rendered++;
+}
 
 //should be faster but in some system it is slower
 void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
@@ -366,42 +501,45 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
-		Shader* shader = Shader::current;
-		assert(shader && "shader must be enabled");
-
-		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
-
-		int attribLocation = shader->getAttribLocation("u_model");
-		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-		if (attribLocation == -1)
-			return; //this shader doesnt support instanced model
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
+
+	int attribLocation = shader->getAttribLocation("u_model");
+	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+	if (attribLocation == -1)
+		return; //this shader doesnt support instanced model
+
+	int size = num_instances * sizeof(Matrix44);
+	if (instances_buffer_id == 0)
+		glGenBuffers(1, &instances_buffer_id);
+	glBindBuffer(GL_ARRAY_BUFFER, instances_buffer_id);
+	if (size > instances_buffer_size)
+		instances_buffer_size = size;
+	glBufferData(GL_ARRAY_BUFFER, instances_buffer_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, size, instanced_models);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	//the VAO of the instanced layout already points to the buffer
+	if (canUseVertexArrays())
+	{
+		render(primitive, -1, num_instances);
+		num_instances_rendered += num_instances;
+		return;
+	}
 
-		//mat4 count as 4 different attributes of vec4... (thanks opengl...)
-		for (int k = 0; k < 4; ++k)
-		{
-			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
-			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
-		}
+	GLState::bindVertexArray(0);
+	enableInstanceAttributes(attribLocation);
 
-		//regular render
-		render(primitive, 0, num_instances);
+	//regular render
+	render(primitive, -1, num_instances);
+	num_instances_rendered += num_instances;
 
-		//disable instanced attribs
-		for (int k = 0; k < 4; ++k)
-		{
-			glDisableVertexAttribArray(attribLocation + k);
-			glVertexAttribDivisor(attribLocation + k, 0);
-		}
-    #else
-		assert(0 && "not supported");
-    #endif
+	//disable instanced attribs
+	for (int k = 0; k < 4; ++k)
+	{
+		glDisableVertexAttribArray(attribLocation + k);
+		glVertexAttribDivisor(attribLocation + k, 0);
+	}
 }
 
 //super obsolete rendering method, do not use
@@ -509,6 +647,11 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
+	//the buffers may change, and binding the index buffer below would modify the bound VAO
+	clearVertexArrays();
+	pool_page = -1;
+	GLState::bindVertexArray(0);
+
 	if (interleaved.size())
 	{
 		// Vertex,Normal,UV
@@ -591,6 +734,237 @@ void Mesh::uploadToVRAM()
 
 	checkGLErrors();
 	//clear buffers to save memory
+
+	for (int i = 0; i < lods.size(); ++i)
+		lods[i]->uploadToVRAM();
+}
+
+//orders vertices by their bytes, to merge the repeated ones
+struct sInterleavedLess {
+	bool operator()(const Mesh::tInterleaved& a, const Mesh::tInterleaved& b) const { return memcmp(&a, &b, sizeof(Mesh::tInterleaved)) < 0; }
+};
+
+void Mesh::createLODs(int num_levels, float ratio)
+{
+	for (int i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
+
+	//skinned meshes or meshes with several submeshes only have the full version
+	if (bones.size() || submeshes.size() > 1)
+		return;
+
+	//the vertices with what the LODs keep of them, merging the repeated ones if it is not indexed
+	int num_vertices = getNumVertices();
+	std::vector<tInterleaved> source(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		if (interleaved.size())
+			source[i] = interleaved[i];
+		else {
+			source[i].vertex = vertices[i];
+			source[i].normal = normals.size() ? normals[i] : Vector3();
+			source[i].uv = uvs.size() ? uvs[i] : Vector2();
+		}
+
+	std::vector<tInterleaved> unique;
+	std::vector<unsigned int> indices;
+	if (m_indices.size()) {
+		unique.swap(source);
+		indices = m_indices;
+	}
+	else {
+		std::map<tInterleaved, unsigned int, sInterleavedLess> merged;
+		indices.resize(num_vertices);
+		for (int i = 0; i < num_vertices; ++i) {
+			std::map<tInterleaved, unsigned int, sInterleavedLess>::iterator it = merged.find(source[i]);
+			if (it == merged.end()) {
+				it = merged.insert(std::make_pair(source[i], (unsigned int)unique.size())).first;
+				unique.push_back(source[i]);
+			}
+			indices[i] = it->second;
+		}
+	}
+
+	//small meshes are not worth it
+	int num_triangles = indices.size() / 3;
+	if (num_triangles < 64)
+		return;
+
+	std::vector<Vector3> positions(unique.size());
+	for (int i = 0; i < unique.size(); ++i)
+		positions[i] = unique[i].vertex;
+
+	//every level goes on simplifying the previous one
+	MeshSimplifier simplifier(positions, indices);
+	std::vector<unsigned int> lod_indices;
+	std::vector<int> remap;
+	for (int level = 0; level < num_levels; ++level) {
+		int result = simplifier.simplify((int)(num_triangles * ratio));
+		//stuck in borders and seams, a level that barely changes is not worth it
+		if (result > num_triangles * (1.0f + ratio) * 0.5f)
+			break;
+		num_triangles = result;
+		simplifier.getIndices(lod_indices);
+
+		//only the vertices used by the level
+		Mesh* lod = new Mesh();
+		remap.assign(unique.size(), -1);
+		lod->m_indices.resize(lod_indices.size());
+		for (int i = 0; i < lod_indices.size(); ++i) {
+			int& index = remap[lod_indices[i]];
+			if (index == -1) {
+				index = lod->interleaved.size();
+				lod->interleaved.push_back(unique[lod_indices[i]]);
+			}
+			lod->m_indices[i] = index;
+		}
+		lod->name = name + "_lod" + std::to_string(level + 1);
+		lod->lod_error = simplifier.getError();
+		lod->aabb_min = aabb_min;
+		lod->aabb_max = aabb_max;
+		lod->box = box;
+		lod->radius = radius;
+		lods.push_back(lod);
+	}
+}
+
+void Mesh::createMeshlets(int max_triangles)
+{
+	meshlets.clear();
+
+	//skinned meshes move their triangles out of the bounds, and the submeshes are ranges of the indices
+	if (!m_indices.size() || bones.size() || submeshes.size() > 1)
+		return;
+
+	//small meshes are drawn whole
+	int num_triangles = m_indices.size() / 3;
+	if (num_triangles < max_triangles * 4)
+		return;
+
+	int num_vertices = getNumVertices();
+	std::vector<Vector3> positions(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		positions[i] = interleaved.size() ? interleaved[i].vertex : vertices[i];
+
+	//the vertices in the same position are the same one for the adjacency, or the meshlets would stop at the seams of the uvs
+	std::vector<int> order(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		const Vector3& pa = positions[a];
+		const Vector3& pb = positions[b];
+		if (pa.x != pb.x)
+			return pa.x < pb.x;
+		if (pa.y != pb.y)
+			return pa.y < pb.y;
+		return pa.z < pb.z;
+	});
+	std::vector<int> welded(num_vertices);
+	for (int i = 0; i < num_vertices; ++i) {
+		const Vector3& p = positions[order[i]];
+		if (i && p.x == positions[order[i - 1]].x && p.y == positions[order[i - 1]].y && p.z == positions[order[i - 1]].z)
+			welded[order[i]] = welded[order[i - 1]];
+		else
+			welded[order[i]] = order[i];
+	}
+
+	//triangles around every welded vertex
+	std::vector<int> first_triangle(num_vertices + 1, 0);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		first_triangle[welded[m_indices[i]] + 1]++;
+	for (int i = 0; i < num_vertices; ++i)
+		first_triangle[i + 1] += first_triangle[i];
+	std::vector<int> vertex_triangles(num_triangles * 3);
+	std::vector<int> filled(first_triangle.begin(), first_triangle.end() - 1);
+	for (int i = 0; i < num_triangles * 3; ++i)
+		vertex_triangles[filled[welded[m_indices[i]]]++] = i / 3;
+
+	std::vector<Vector3> triangle_normals(num_triangles);
+	for (int t = 0; t < num_triangles; ++t) {
+		const Vector3& p0 = positions[m_indices[t * 3]];
+		Vector3 normal = (positions[m_indices[t * 3 + 1]] - p0).cross(positions[m_indices[t * 3 + 2]] - p0);
+		float length = (float)normal.length();
+		triangle_normals[t] = length > 0.0f ? normal * (1.0f / length) : Vector3(); //degenerated ones go anywhere
+	}
+
+	//every meshlet grows from the first free triangle to its neighbours, breadth first so it stays compact,
+	//skipping the ones whose normal is too far from the average (a wide cone can never be culled by facing)
+	const float min_normal_dot = 0.7f;
+	std::vector<int> meshlet_of(num_triangles, -1);
+	std::vector<int> considered(num_triangles, -1); //last meshlet that queued the triangle
+	std::vector<int> triangles;
+	std::vector<int> queue;
+	std::vector<unsigned int> indices;
+	indices.reserve(m_indices.size());
+	int seed = 0;
+	while (true) {
+		while (seed < num_triangles && meshlet_of[seed] != -1)
+			seed++;
+		if (seed == num_triangles)
+			break;
+
+		int id = meshlets.size();
+		Vector3 normal_sum;
+		triangles.clear();
+		queue.clear();
+		queue.push_back(seed);
+		considered[seed] = id;
+		for (int q = 0; q < queue.size() && triangles.size() < max_triangles; ++q) {
+			int t = queue[q];
+			const Vector3& normal = triangle_normals[t];
+			float sum_length = (float)normal_sum.length();
+			if (sum_length > 0.0f && normal.dot(normal_sum) < min_normal_dot * sum_length && normal.dot(normal) > 0.0f)
+				continue;
+			meshlet_of[t] = id;
+			triangles.push_back(t);
+			normal_sum += normal;
+			for (int k = 0; k < 3; ++k) {
+				int vertex = welded[m_indices[t * 3 + k]];
+				for (int j = first_triangle[vertex]; j < first_triangle[vertex + 1]; ++j) {
+					int neighbour = vertex_triangles[j];
+					if (meshlet_of[neighbour] == -1 && considered[neighbour] != id) {
+						considered[neighbour] = id;
+						queue.push_back(neighbour);
+					}
+				}
+			}
+		}
+
+		sMeshlet meshlet;
+		meshlet.first_index = indices.size();
+		meshlet.num_indices = triangles.size() * 3;
+		Vector3 min_position = positions[m_indices[triangles[0] * 3]];
+		Vector3 max_position = min_position;
+		for (int i = 0; i < triangles.size(); ++i)
+			for (int k = 0; k < 3; ++k) {
+				unsigned int index = m_indices[triangles[i] * 3 + k];
+				indices.push_back(index);
+				min_position.setMin(positions[index]);
+				max_position.setMax(positions[index]);
+			}
+		meshlet.center = (min_position + max_position) * 0.5f;
+		meshlet.radius = 0.0f;
+		for (int i = meshlet.first_index; i < indices.size(); ++i)
+			meshlet.radius = std::max(meshlet.radius, meshlet.center.distance(positions[indices[i]]));
+
+		//the cone holds all the normals, its cutoff is what the culling test needs (see Renderer::cullMeshlets)
+		float sum_length = (float)normal_sum.length();
+		meshlet.cone_axis = sum_length > 0.0f ? normal_sum * (1.0f / sum_length) : Vector3(0.0f, 0.0f, 1.0f);
+		meshlet.cone_cutoff = 1.0f;
+		if (sum_length > 0.0f) {
+			float min_dot = 1.0f;
+			for (int i = 0; i < triangles.size(); ++i) {
+				const Vector3& normal = triangle_normals[triangles[i]];
+				if (normal.dot(normal) > 0.0f)
+					min_dot = std::min(min_dot, normal.dot(meshlet.cone_axis));
+			}
+			if (min_dot > 0.0f)
+				meshlet.cone_cutoff = sqrt(1.0f - min_dot * min_dot);
+		}
+		meshlets.push_back(meshlet);
+	}
+
+	m_indices.swap(indices);
 }
 
 bool Mesh::createCollisionModel(bool is_static)
@@ -750,10 +1124,34 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_lods; //after the submeshes, every one is a sLODInfo, its interleaved vertices and its indices
+	int num_meshlets; //after the LODs
+	int build_flags; //Mesh::getBuildFlags when written
+	uint64 source_time; //modification time of the file it was built from, 0 if unknown
+	char extra[12]; //unused
 } sMeshInfo;
 
-bool Mesh::readBin(const char* filename)
+typedef struct
+{
+	int num_vertices;
+	int num_indices;
+	float error;
+} sLODInfo;
+
+static uint64 getFileModificationTime(const char* filename)
+{
+	struct stat stbuffer;
+	if (stat(filename, &stbuffer) != 0)
+		return 0;
+	return (uint64)stbuffer.st_mtime;
+}
+
+int Mesh::getBuildFlags()
+{
+	return (create_lods ? 1 : 0) | (create_meshlets ? 2 : 0);
+}
+
+bool Mesh::readBin(const char* filename, const char* source_filename)
 {
 	FILE *f;
 	assert(filename);
@@ -785,6 +1183,14 @@ bool Mesh::readBin(const char* filename)
 	if(info.version != MESH_BIN_VERSION || info.header_bytes != sizeof(sMeshInfo) )
 	{
 		std::cout << "[WARN] loading BIN: old version: " << filename << std::endl;
+		delete[] data;
+		return false;
+	}
+
+	if (source_filename && (info.source_time != getFileModificationTime(source_filename) || info.build_flags != getBuildFlags()))
+	{
+		std::cout << "[WARN] loading BIN: outdated, built from another version of the source or with other flags: " << filename << std::endl;
+		delete[] data;
 		return false;
 	}
 
@@ -826,7 +1232,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -865,14 +1271,40 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes) //meshes from gltf have none
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
+	for (int i = 0; i < info.num_lods; ++i)
+	{
+		sLODInfo lod_info;
+		memcpy(&lod_info, pos, sizeof(sLODInfo));
+		pos += sizeof(sLODInfo);
+		Mesh* lod = new Mesh();
+		lod->interleaved.resize(lod_info.num_vertices);
+		memcpy((void*)&lod->interleaved[0], pos, sizeof(tInterleaved) * lod_info.num_vertices);
+		pos += sizeof(tInterleaved) * lod_info.num_vertices;
+		lod->m_indices.resize(lod_info.num_indices);
+		memcpy((void*)&lod->m_indices[0], pos, sizeof(unsigned int) * lod_info.num_indices);
+		pos += sizeof(unsigned int) * lod_info.num_indices;
+		lod->lod_error = lod_info.error;
+		lod->aabb_min = aabb_min;
+		lod->aabb_max = aabb_max;
+		lod->box = box;
+		lod->radius = radius;
+		lods.push_back(lod);
+	}
+
+	meshlets.resize(info.num_meshlets);
+	if (info.num_meshlets)
+		memcpy((void*)&meshlets[0], pos, sizeof(sMeshlet) * info.num_meshlets);
+	pos += sizeof(sMeshlet) * info.num_meshlets;
+
 	createCollisionModel();
 	return true;
 }
 
-bool Mesh::writeBin(const char* filename)
+bool Mesh::writeBin(const char* filename, const char* source_filename)
 {
 	assert( vertices.size() || interleaved.size() );
 	std::string s_filename = filename;
@@ -902,6 +1334,10 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.num_lods = lods.size();
+	info.num_meshlets = meshlets.size();
+	info.build_flags = getBuildFlags();
+	info.source_time = source_filename ? getFileModificationTime(source_filename) : 0;
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -942,7 +1378,23 @@ bool Mesh::writeBin(const char* filename)
 	if (m_uvs1.size())
 		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+
+	for (int i = 0; i < lods.size(); ++i)
+	{
+		Mesh* lod = lods[i];
+		sLODInfo lod_info;
+		lod_info.num_vertices = lod->interleaved.size();
+		lod_info.num_indices = lod->m_indices.size();
+		lod_info.error = lod->lod_error;
+		fwrite((void*)&lod_info, sizeof(sLODInfo), 1, f);
+		fwrite((void*)&lod->interleaved[0], lod->interleaved.size() * sizeof(tInterleaved), 1, f);
+		fwrite((void*)&lod->m_indices[0], lod->m_indices.size() * sizeof(unsigned int), 1, f);
+	}
+
+	if (meshlets.size())
+		fwrite((void*)&meshlets[0], meshlets.size() * sizeof(sMeshlet), 1, f);
 
 	fclose(f);
 	return true;
@@ -1595,7 +2047,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		binfilename = binfilename + ".mbin";
 
 	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str()) )
+	if (use_binary && m->readBin(binfilename.c_str(), file_format != FORMAT_MBIN ? filename : NULL) )
 	{
 		if (interleave_meshes && m->interleaved.size() == 0)
 		{
@@ -1637,6 +2089,18 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		m->interleaveBuffers();
 	}
 
+	if (create_lods)
+	{
+		m->createLODs();
+		std::cout << "[LODS " << m->lods.size() << "] ";
+	}
+
+	if (create_meshlets)
+	{
+		m->createMeshlets();
+		std::cout << "[MESHLETS " << m->meshlets.size() << "] ";
+	}
+
 	//and upload them to VRAM
 	if (auto_upload_to_vram)
 	{
@@ -1648,7 +2112,7 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	if (use_binary)
 	{
 		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
+		m->writeBin(filename, filename);
 		std::cout << "[OK]" << std::endl;
 	}
 
@@ -3,16 +3,16 @@
 
 #include <vector>
 #include "framework.h"
+#include "shader.h"
 
 #include <map>
 #include <string>
 
-class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
 
 //version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 14 //this is used to regenerate bins if the format changes (12 added the LOD chain, 13 the meshlets, 14 the source time and build flags)
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -27,6 +27,17 @@ struct sSubmeshInfo
 	int length;//in primitive
 };
 
+//cluster of neighbour triangles, a contiguous range of the indices of the mesh
+struct sMeshlet
+{
+	Vector3 center; //bounding sphere
+	float radius;
+	Vector3 cone_axis; //average normal of the triangles
+	float cone_cutoff; //sine of the spread of the normals around the axis, 1 if they are too spread to cull it
+	int first_index;
+	int num_indices;
+};
+
 class Mesh
 {
 public:
@@ -36,8 +47,17 @@ public:
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static long num_instances_rendered; //by renderInstanced
+	static bool use_vertex_arrays; //meshes in VRAM are drawn binding a VAO instead of setting up every attribute
+	static long num_vertex_arrays; //VAOs created by all the meshes
+	static bool create_lods; //loaded meshes build their LOD chain (kept in the .mbin when use_binary)
+	static const int MAX_LODS = 3; //simplified levels, besides the full mesh
+	static bool create_meshlets; //loaded meshes split their triangles in meshlets (kept in the .mbin when use_binary)
+	static const int MESHLET_TRIANGLES = 128; //most triangles of a meshlet
+	static int s_MeshID;
 
 	std::string name;
+	int m_Id; //unique number, used to sort render calls by mesh
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -80,12 +100,35 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	//a VAO for every attribute layout of the shaders that rendered this mesh, created in the first draw with it
+	struct sVertexArray {
+		int locations[NUM_VERTEX_ATTRIBUTES]; //-1 for the attributes this mesh does not have
+		unsigned int vao;
+	};
+	std::vector<sVertexArray> vertex_arrays;
+
+	//range of the geometry in the GeometryPool, pool_page is -1 if it was never added and -2 if it cannot be
+	int pool_page;
+	int pool_base_vertex;
+	int pool_first_index;
+	int pool_num_indices;
+
+	//coarser versions of the mesh made with MeshSimplifier, every one with about half the triangles of the previous
+	//they are always interleaved and indexed, and keep the bounding box of the full mesh
+	std::vector<Mesh*> lods;
+	float lod_error; //of a LOD, how far (in the units of the mesh) it can be from the full mesh
+
+	//the triangles of the mesh reordered in meshlets, so the visible ones can be drawn as ranges of the index buffer
+	std::vector<sMeshlet> meshlets;
+
 	Mesh();
 	~Mesh();
 
 	void clear();
 
 	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
+	//draws some ranges of the indices (in indices, not primitives) with a single glMultiDrawElements
+	void renderRanges(unsigned int primitive, const int* first_indices, const int* counts, int num_ranges);
 	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
@@ -95,8 +138,25 @@ public:
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
 
-	bool readBin(const char* filename);
-	bool writeBin(const char* filename);
+	//locations of the attributes of the shader this mesh can feed, the layout that identifies a VAO
+	void getAttributeLayout(Shader* shader, bool instanced, int* locations);
+	unsigned int getVertexArray(Shader* shader, bool instanced);
+	bool canUseVertexArrays() { return use_vertex_arrays && (interleaved_vbo_id || vertices_vbo_id) && (!m_indices.size() || indices_vbo_id); } //everything must be in VRAM
+	void clearVertexArrays(); //call it when the buffers change
+
+	//replaces the LOD chain, stops early if the simplification gets stuck (see MeshSimplifier)
+	void createLODs(int num_levels = MAX_LODS, float ratio = 0.5f);
+	//level 0 is the mesh itself, levels past the last LOD give the last one
+	Mesh* getLOD(int level) { return level <= 0 || !lods.size() ? this : lods[(level < lods.size() ? level : lods.size()) - 1]; }
+	float getLODError(int level) { return level <= 0 || !lods.size() ? 0.0f : getLOD(level)->lod_error; }
+
+	//reorders the indices grouping the triangles in meshlets, only indexed meshes with a single submesh and no skin
+	void createMeshlets(int max_triangles = MESHLET_TRIANGLES);
+
+	//with the source file, a bin written from an older version of it or with other build flags is not loaded
+	bool readBin(const char* filename, const char* source_filename = NULL);
+	bool writeBin(const char* filename, const char* source_filename = NULL);
+	static int getBuildFlags(); //of the data built on load that is kept in the bin (LODs and meshlets)
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
 	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
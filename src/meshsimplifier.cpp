@@ -0,0 +1,274 @@
+#include "meshsimplifier.h"
+
+#include <algorithm>
+#include <map>
+#include <cmath>
+#include <cstring>
+
+MeshSimplifier::MeshSimplifier(const std::vector<Vector3>& vertex_positions, const std::vector<unsigned int>& indices)
+{
+	error = 0.0f;
+	num_triangles = 0;
+
+	//group the vertices sharing the exact same position
+	int num_vertices = vertex_positions.size();
+	std::vector<int> order(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		const Vector3& pa = vertex_positions[a];
+		const Vector3& pb = vertex_positions[b];
+		if (pa.x != pb.x)
+			return pa.x < pb.x;
+		if (pa.y != pb.y)
+			return pa.y < pb.y;
+		return pa.z < pb.z;
+	});
+	std::vector<int> vertex_group(num_vertices);
+	for (int i = 0; i < num_vertices; ++i) {
+		const Vector3& p = vertex_positions[order[i]];
+		if (!i || p.x != positions.back().x || p.y != positions.back().y || p.z != positions.back().z)
+			positions.push_back(p);
+		vertex_group[order[i]] = positions.size() - 1;
+	}
+
+	int num_groups = positions.size();
+	group_vertex.assign(num_groups, -1);
+	group_triangles.resize(num_groups);
+	locked.assign(num_groups, false);
+	removed.assign(num_groups, false);
+	sQuadric zero;
+	memset(&zero, 0, sizeof(zero));
+	quadrics.assign(num_groups, zero);
+
+	//triangles (without the degenerated ones), the plane of every one goes to the quadrics of its corners
+	for (int i = 0; i + 2 < indices.size(); i += 3) {
+		int groups[3];
+		for (int k = 0; k < 3; ++k)
+			groups[k] = vertex_group[indices[i + k]];
+		if (groups[0] == groups[1] || groups[1] == groups[2] || groups[0] == groups[2])
+			continue;
+
+		int triangle = triangle_alive.size();
+		for (int k = 0; k < 3; ++k) {
+			triangles.push_back(indices[i + k]);
+			triangle_groups.push_back(groups[k]);
+			group_triangles[groups[k]].push_back(triangle);
+			//a position used by more than one vertex is in a seam
+			if (group_vertex[groups[k]] == -1)
+				group_vertex[groups[k]] = indices[i + k];
+			else if (group_vertex[groups[k]] != indices[i + k])
+				locked[groups[k]] = true;
+		}
+		triangle_alive.push_back(true);
+		num_triangles++;
+
+		const Vector3& p0 = positions[groups[0]];
+		Vector3 normal = (positions[groups[1]] - p0).cross(positions[groups[2]] - p0);
+		double area = normal.length() * 0.5;
+		if (area <= 0.0)
+			continue;
+		normal = normal * (float)(0.5 / area);
+		double n[4] = { normal.x, normal.y, normal.z, -normal.dot(p0) };
+		sQuadric plane;
+		int index = 0;
+		for (int r = 0; r < 4; ++r)
+			for (int c = r; c < 4; ++c)
+				plane.a[index++] = n[r] * n[c] * area;
+		plane.weight = area;
+		for (int k = 0; k < 3; ++k) {
+			sQuadric& q = quadrics[groups[k]];
+			for (int j = 0; j < 10; ++j)
+				q.a[j] += plane.a[j];
+			q.weight += plane.weight;
+		}
+	}
+
+	//edges not shared by exactly two triangles are borders or non manifold, their ends never move
+	std::map<uint64, int> edges;
+	for (int t = 0; t < triangle_alive.size(); ++t)
+		for (int k = 0; k < 3; ++k) {
+			uint64 a = triangle_groups[t * 3 + k];
+			uint64 b = triangle_groups[t * 3 + (k + 1) % 3];
+			edges[a < b ? (a << 32) | b : (b << 32) | a]++;
+		}
+	for (std::map<uint64, int>::iterator it = edges.begin(); it != edges.end(); ++it)
+		if (it->second != 2) {
+			locked[it->first >> 32] = true;
+			locked[it->first & 0xFFFFFFFF] = true;
+		}
+
+	std::vector<int> neighbours;
+	for (int i = 0; i < num_groups; ++i) {
+		getNeighbours(i, neighbours);
+		for (int j = 0; j < neighbours.size(); ++j)
+			pushCollapse(i, neighbours[j]);
+	}
+}
+
+double MeshSimplifier::evaluate(const sQuadric& q, const Vector3& p)
+{
+	const double* a = q.a;
+	double x = p.x, y = p.y, z = p.z;
+	return a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x
+		+ a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y
+		+ a[7] * z * z + 2.0 * a[8] * z
+		+ a[9];
+}
+
+void MeshSimplifier::getNeighbours(int group, std::vector<int>& neighbours)
+{
+	neighbours.clear();
+	std::vector<int>& list = group_triangles[group];
+	for (int i = 0; i < list.size(); ++i) {
+		int t = list[i];
+		if (!triangle_alive[t])
+			continue;
+		for (int k = 0; k < 3; ++k) {
+			int other = triangle_groups[t * 3 + k];
+			if (other != group && std::find(neighbours.begin(), neighbours.end(), other) == neighbours.end())
+				neighbours.push_back(other);
+		}
+	}
+}
+
+//error of moving from onto to, what both quadrics give in the position of to
+float MeshSimplifier::getCost(int from, int to)
+{
+	return (float)(evaluate(quadrics[from], positions[to]) + evaluate(quadrics[to], positions[to]));
+}
+
+void MeshSimplifier::pushCollapse(int from, int to)
+{
+	if (locked[from])
+		return;
+	sCollapse collapse;
+	collapse.cost = getCost(from, to);
+	collapse.from = from;
+	collapse.to = to;
+	queue.push(collapse);
+}
+
+bool MeshSimplifier::canCollapse(int from, int to)
+{
+	//the only neighbours in common must be the opposite corners of the triangles of the edge, or the surface folds
+	std::vector<int> from_neighbours;
+	std::vector<int> to_neighbours;
+	getNeighbours(from, from_neighbours);
+	getNeighbours(to, to_neighbours);
+	int common = 0;
+	for (int i = 0; i < from_neighbours.size(); ++i)
+		if (std::find(to_neighbours.begin(), to_neighbours.end(), from_neighbours[i]) != to_neighbours.end())
+			common++;
+
+	int shared = 0;
+	std::vector<int>& list = group_triangles[from];
+	for (int i = 0; i < list.size(); ++i) {
+		int t = list[i];
+		if (!triangle_alive[t])
+			continue;
+		int* groups = &triangle_groups[t * 3];
+		if (groups[0] == to || groups[1] == to || groups[2] == to) {
+			shared++;
+			continue;
+		}
+
+		//the triangles that stay must not flip or become too thin
+		Vector3 p[3];
+		for (int k = 0; k < 3; ++k)
+			p[k] = positions[groups[k]];
+		Vector3 old_normal = (p[1] - p[0]).cross(p[2] - p[0]);
+		for (int k = 0; k < 3; ++k)
+			if (groups[k] == from)
+				p[k] = positions[to];
+		Vector3 new_normal = (p[1] - p[0]).cross(p[2] - p[0]);
+		float old_length = old_normal.length();
+		float new_length = new_normal.length();
+		if (new_length <= 1e-12f || old_normal.dot(new_normal) < 0.25f * old_length * new_length)
+			return false;
+	}
+	return shared > 0 && common == shared;
+}
+
+void MeshSimplifier::collapse(int from, int to)
+{
+	//the vertex of the destination used next to the moved one (the destination can be in a seam, see the header)
+	unsigned int target_vertex = 0;
+	std::vector<int>& list = group_triangles[from];
+	for (int i = 0; i < list.size(); ++i) {
+		int t = list[i];
+		if (!triangle_alive[t])
+			continue;
+		for (int k = 0; k < 3; ++k)
+			if (triangle_groups[t * 3 + k] == to)
+				target_vertex = triangles[t * 3 + k];
+	}
+
+	std::vector<int>& to_list = group_triangles[to];
+	for (int i = 0; i < list.size(); ++i) {
+		int t = list[i];
+		if (!triangle_alive[t])
+			continue;
+		int* groups = &triangle_groups[t * 3];
+		if (groups[0] == to || groups[1] == to || groups[2] == to) {
+			triangle_alive[t] = false;
+			num_triangles--;
+			continue;
+		}
+		for (int k = 0; k < 3; ++k)
+			if (groups[k] == from) {
+				groups[k] = to;
+				triangles[t * 3 + k] = target_vertex;
+			}
+		to_list.push_back(t);
+	}
+	list.clear();
+	to_list.erase(std::remove_if(to_list.begin(), to_list.end(), [&](int t) { return !triangle_alive[t]; }), to_list.end());
+
+	sQuadric& q = quadrics[to];
+	for (int j = 0; j < 10; ++j)
+		q.a[j] += quadrics[from].a[j];
+	q.weight += quadrics[from].weight;
+	removed[from] = true;
+
+	//the edges of the destination changed (the old entries of the others are updated when they come out)
+	std::vector<int> neighbours;
+	getNeighbours(to, neighbours);
+	for (int i = 0; i < neighbours.size(); ++i) {
+		pushCollapse(to, neighbours[i]);
+		pushCollapse(neighbours[i], to);
+	}
+}
+
+int MeshSimplifier::simplify(int target_triangles)
+{
+	while (num_triangles > target_triangles && !queue.empty()) {
+		sCollapse c = queue.top();
+		queue.pop();
+		if (removed[c.from] || removed[c.to])
+			continue;
+		float cost = getCost(c.from, c.to);
+		if (cost > c.cost) {
+			c.cost = cost;
+			queue.push(c);
+			continue;
+		}
+		if (!canCollapse(c.from, c.to))
+			continue;
+
+		double weight = quadrics[c.from].weight + quadrics[c.to].weight;
+		if (weight > 0.0)
+			error = std::max(error, (float)sqrt(std::max(c.cost, 0.0f) / weight));
+		collapse(c.from, c.to);
+	}
+	return num_triangles;
+}
+
+void MeshSimplifier::getIndices(std::vector<unsigned int>& indices)
+{
+	indices.clear();
+	indices.reserve(num_triangles * 3);
+	for (int t = 0; t < triangle_alive.size(); ++t)
+		if (triangle_alive[t])
+			indices.insert(indices.end(), triangles.begin() + t * 3, triangles.begin() + t * 3 + 3);
+}
@@ -0,0 +1,66 @@
+/*	Quadric error simplification (Garland and Heckbert) with half edge collapses: a vertex only moves onto one of its
+	neighbours, so the triangles left always index the original vertices and keep their normals and uvs.
+	Vertices are grouped by position, the ones in borders, in attribute seams (several vertices in the same position)
+	or in non manifold edges never move. That keeps the silhouette and avoids cracks, but very fragmented meshes stop early.
+	The simplification can go on after reading the indices, so one instance gives all the levels of a LOD chain.
+*/
+
+#ifndef MESHSIMPLIFIER_H
+#define MESHSIMPLIFIER_H
+
+#include "framework.h"
+
+#include <queue>
+
+class MeshSimplifier
+{
+public:
+	//positions of the vertices and three indices per triangle
+	MeshSimplifier(const std::vector<Vector3>& positions, const std::vector<unsigned int>& indices);
+
+	//collapses edges until there are target_triangles or no collapse is possible, returns the triangles left
+	int simplify(int target_triangles);
+
+	int getNumTriangles() { return num_triangles; }
+	void getIndices(std::vector<unsigned int>& indices);
+
+	//biggest error of the collapses done, as a distance in the units of the positions
+	float getError() { return error; }
+
+private:
+	//symmetric 4x4 matrix, plus the area of the planes added (to turn the error in a mean distance)
+	struct sQuadric {
+		double a[10];
+		double weight;
+	};
+
+	//the cost can be old, it is computed again when it comes out of the queue and pushed back if it grew
+	struct sCollapse {
+		float cost;
+		int from; //position groups
+		int to;
+		bool operator < (const sCollapse& other) const { return cost > other.cost; } //cheapest first in the queue
+	};
+
+	std::vector<Vector3> positions; //per group
+	std::vector<int> group_vertex; //vertex of the group, only meaningful if it has one
+	std::vector<unsigned int> triangles; //vertex indices
+	std::vector<int> triangle_groups; //the same by position group
+	std::vector<bool> triangle_alive;
+	std::vector< std::vector<int> > group_triangles; //can hold dead triangles, they are skipped
+	std::vector<sQuadric> quadrics;
+	std::vector<bool> locked;
+	std::vector<bool> removed;
+	std::priority_queue<sCollapse> queue;
+	int num_triangles;
+	float error;
+
+	double evaluate(const sQuadric& q, const Vector3& p);
+	void getNeighbours(int group, std::vector<int>& neighbours);
+	float getCost(int from, int to);
+	void pushCollapse(int from, int to);
+	bool canCollapse(int from, int to);
+	void collapse(int from, int to);
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include "occlusionculling.h"
+#include "mesh.h"
+#include "utils.h"
+#include "task.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#include <xmmintrin.h>
+	#define OCCLUSION_SSE
+#endif
+
+OcclusionCulling::OcclusionCulling()
+{
+	width = 0;
+	height = 0;
+	tiles_x = 0;
+	tiles_y = 0;
+	num_triangles = 0;
+	raster_time = 0.0f;
+	setSize(256, 128);
+}
+
+void OcclusionCulling::setSize(int width, int height)
+{
+	tiles_x = std::max((width + TILE_WIDTH - 1) / TILE_WIDTH, 1);
+	tiles_y = std::max((height + TILE_HEIGHT - 1) / TILE_HEIGHT, 1);
+	this->width = tiles_x * TILE_WIDTH;
+	this->height = tiles_y * TILE_HEIGHT;
+	depth.assign(this->width * this->height, FLT_MAX);
+}
+
+int OcclusionCulling::getNumTriangles(Mesh* mesh)
+{
+	if (!mesh->interleaved.size() && !mesh->vertices.size())
+		return 0;
+	return (mesh->m_indices.size() ? mesh->m_indices.size() : mesh->getNumVertices()) / 3;
+}
+
+void OcclusionCulling::render(const Matrix44& viewprojection, const std::vector<sOccluder>& occluders, int num_workers)
+{
+	double start_time = getPreciseTime();
+
+	this->viewprojection = viewprojection;
+	std::fill(depth.begin(), depth.end(), FLT_MAX);
+
+	//every job transforms a range of occluders in its own list, merged in order so the result does not depend on the jobs
+	int setup_workers = (int)occluders.size() < num_workers * 2 ? 1 : num_workers;
+	if (worker_triangles.size() < setup_workers)
+		worker_triangles.resize(setup_workers);
+	for (int i = 0; i < worker_triangles.size(); ++i)
+		worker_triangles[i].clear();
+	parallelFor(occluders.size(), setup_workers, [&](int worker, int start, int end) {
+		for (int i = start; i < end; ++i)
+			setupTriangles(occluders[i], worker_triangles[worker]);
+	});
+
+	triangles.clear();
+	for (int i = 0; i < setup_workers; ++i)
+		triangles.insert(triangles.end(), worker_triangles[i].begin(), worker_triangles[i].end());
+	num_triangles = triangles.size();
+
+	if (num_triangles)
+		parallelFor(tiles_x * tiles_y, num_workers, [&](int worker, int start, int end) {
+			for (int tile = start; tile < end; ++tile)
+				rasterizeTile(tile);
+		});
+
+	raster_time = (float)(getPreciseTime() - start_time);
+}
+
+void OcclusionCulling::setupTriangles(const sOccluder& occluder, std::vector<sTriangle>& output)
+{
+	Mesh* mesh = occluder.mesh;
+	int num_vertices = mesh->interleaved.size() ? mesh->interleaved.size() : mesh->vertices.size();
+	if (!num_vertices)
+		return;
+
+	Matrix44 mvp = occluder.model * viewprojection;
+	std::vector<Vector4> clip(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		clip[i] = mvp * Vector4(mesh->interleaved.size() ? mesh->interleaved[i].vertex : mesh->vertices[i], 1.0f);
+
+	bool indexed = mesh->m_indices.size() > 0;
+	int num_indices = indexed ? mesh->m_indices.size() : num_vertices;
+	for (int i = 0; i + 2 < num_indices; i += 3) {
+		const Vector4* v[3];
+		bool behind = false;
+		for (int k = 0; k < 3; ++k) {
+			v[k] = &clip[indexed ? mesh->m_indices[i + k] : i + k];
+			if (v[k]->z < -v[k]->w)
+				behind = true;
+		}
+		//crossing the near plane, clipping it is not worth it for an occluder, just skip it
+		if (behind)
+			continue;
+
+		sTriangle tri;
+		float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+		for (int k = 0; k < 3; ++k) {
+			float inv_w = 1.0f / v[k]->w;
+			tri.x[k] = (v[k]->x * inv_w * 0.5f + 0.5f) * width;
+			tri.y[k] = (v[k]->y * inv_w * 0.5f + 0.5f) * height;
+			tri.z[k] = v[k]->z * inv_w;
+			min_x = std::min(min_x, tri.x[k]);
+			min_y = std::min(min_y, tri.y[k]);
+			max_x = std::max(max_x, tri.x[k]);
+			max_y = std::max(max_y, tri.y[k]);
+		}
+
+		//pixels whose center is inside the bounds of the triangle
+		if (max_x < 0.5f || max_y < 0.5f || min_x > width - 0.5f || min_y > height - 0.5f)
+			continue;
+		tri.min_x = std::max((int)ceil(std::max(min_x, 0.0f) - 0.5f), 0);
+		tri.min_y = std::max((int)ceil(std::max(min_y, 0.0f) - 0.5f), 0);
+		tri.max_x = std::min((int)floor(std::min(max_x, (float)width) - 0.5f), width - 1);
+		tri.max_y = std::min((int)floor(std::min(max_y, (float)height) - 0.5f), height - 1);
+		if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+			continue;
+		output.push_back(tri);
+	}
+}
+
+void OcclusionCulling::rasterizeTile(int tile)
+{
+	int tile_x = (tile % tiles_x) * TILE_WIDTH;
+	int tile_y = (tile / tiles_x) * TILE_HEIGHT;
+
+	for (int t = 0; t < triangles.size(); ++t) {
+		const sTriangle& tri = triangles[t];
+		int min_x = std::max(tri.min_x, tile_x);
+		int min_y = std::max(tri.min_y, tile_y);
+		int max_x = std::min(tri.max_x, tile_x + TILE_WIDTH - 1);
+		int max_y = std::min(tri.max_y, tile_y + TILE_HEIGHT - 1);
+		if (min_x > max_x || min_y > max_y)
+			continue;
+
+		const float* x = tri.x;
+		const float* y = tri.y;
+		const float* z = tri.z;
+		float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (fabs(area) < 1e-6f)
+			continue;
+
+		//edge functions a * x + b * y + c, positive inside whatever the winding (both faces occlude)
+		//conservative: moved half a pixel in, so at the center they tell if the corner of the pixel most outside is in
+		//and only the pixels the triangle covers completely are written
+		float sign = area > 0.0f ? 1.0f : -1.0f;
+		float a[3], b[3], c[3];
+		for (int k = 0; k < 3; ++k) {
+			int next = (k + 1) % 3;
+			a[k] = (y[k] - y[next]) * sign;
+			b[k] = (x[next] - x[k]) * sign;
+			c[k] = ((y[next] - y[k]) * x[k] - (x[next] - x[k]) * y[k]) * sign - 0.5f * (fabs(a[k]) + fabs(b[k]));
+		}
+
+		//plane of the depth in screen space, moved back to the farthest depth over the pixel around the center
+		float dzdx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+		float dzdy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+		float dz = z[0] - dzdx * x[0] - dzdy * y[0] + 0.5f * (fabs(dzdx) + fabs(dzdy));
+
+		//blocks of four pixels, tiles are a multiple of four wide so the blocks never leave the tile
+		int start_x = min_x & ~3;
+		for (int py = min_y; py <= max_y; ++py) {
+			float cy = py + 0.5f;
+			float* row = &depth[py * width];
+#ifdef OCCLUSION_SSE
+			__m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+			__m128 zero = _mm_setzero_ps();
+			for (int px = start_x; px <= max_x; px += 4) {
+				__m128 cx = _mm_add_ps(_mm_set1_ps((float)px), offsets);
+				__m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), cx), _mm_set1_ps(b[0] * cy + c[0])), zero);
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[1]), cx), _mm_set1_ps(b[1] * cy + c[1])), zero));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[2]), cx), _mm_set1_ps(b[2] * cy + c[2])), zero));
+				if (!_mm_movemask_ps(inside))
+					continue;
+				__m128 pixel_z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), cx), _mm_set1_ps(dzdy * cy + dz));
+				__m128 old_z = _mm_loadu_ps(row + px);
+				__m128 new_z = _mm_min_ps(old_z, pixel_z);
+				_mm_storeu_ps(row + px, _mm_or_ps(_mm_and_ps(inside, new_z), _mm_andnot_ps(inside, old_z)));
+			}
+#else
+			for (int px = start_x; px <= max_x; ++px) {
+				float cx = px + 0.5f;
+				if (a[0] * cx + b[0] * cy + c[0] < 0.0f || a[1] * cx + b[1] * cy + c[1] < 0.0f || a[2] * cx + b[2] * cy + c[2] < 0.0f)
+					continue;
+				float pixel_z = dzdx * cx + dzdy * cy + dz;
+				if (pixel_z < row[px])
+					row[px] = pixel_z;
+			}
+#endif
+		}
+	}
+}
+
+bool OcclusionCulling::testBox(const BoundingBox& box) const
+{
+	//screen rect and nearest depth of the corners
+	float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+	float min_z = FLT_MAX;
+	for (int i = 0; i < 8; ++i) {
+		Vector3 corner = box.center + box.halfsize * Vector3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f);
+		Vector4 p = viewprojection * Vector4(corner, 1.0f);
+		if (p.z < -p.w)
+			return true;
+		float inv_w = 1.0f / p.w;
+		min_x = std::min(min_x, p.x * inv_w);
+		min_y = std::min(min_y, p.y * inv_w);
+		max_x = std::max(max_x, p.x * inv_w);
+		max_y = std::max(max_y, p.y * inv_w);
+		min_z = std::min(min_z, p.z * inv_w);
+	}
+
+	//out of the screen, that is for the frustum culling to decide
+	if (max_x < -1.0f || max_y < -1.0f || min_x > 1.0f || min_y > 1.0f)
+		return true;
+
+	//every pixel the rect touches, not only the ones with the center inside
+	int x0 = std::max((int)floor((std::max(min_x, -1.0f) * 0.5f + 0.5f) * width), 0);
+	int y0 = std::max((int)floor((std::max(min_y, -1.0f) * 0.5f + 0.5f) * height), 0);
+	int x1 = std::min((int)floor((std::min(max_x, 1.0f) * 0.5f + 0.5f) * width), width - 1);
+	int y1 = std::min((int)floor((std::min(max_y, 1.0f) * 0.5f + 0.5f) * height), height - 1);
+
+	//visible as soon as one pixel is farther than the nearest point of the box
+	for (int py = y0; py <= y1; ++py) {
+		const float* row = &depth[py * width];
+#ifdef OCCLUSION_SSE
+		__m128 offsets = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+		__m128 first = _mm_set1_ps((float)x0);
+		__m128 last = _mm_set1_ps((float)x1);
+		__m128 nearest = _mm_set1_ps(min_z);
+		for (int px = x0 & ~3; px <= x1; px += 4) {
+			__m128 lanes = _mm_add_ps(_mm_set1_ps((float)px), offsets);
+			__m128 in_rect = _mm_and_ps(_mm_cmpge_ps(lanes, first), _mm_cmple_ps(lanes, last));
+			__m128 farther = _mm_cmpge_ps(_mm_loadu_ps(row + px), nearest);
+			if (_mm_movemask_ps(_mm_and_ps(in_rect, farther)))
+				return true;
+		}
+#else
+		for (int px = x0; px <= x1; ++px)
+			if (row[px] >= min_z)
+				return true;
+#endif
+	}
+	return false;
+}
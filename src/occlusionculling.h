@@ -0,0 +1,68 @@
+/*	Software occlusion culling: a few big occluder meshes are rasterized in the CPU into a small depth buffer, then the
+	bounding boxes of the render calls are tested against it and the ones completely behind are not drawn.
+	The buffer is split in tiles of TILE_WIDTH x TILE_HEIGHT pixels, every job rasterizes all the triangles touching its
+	tiles four pixels at a time (SSE when available), so the jobs never write the same pixels.
+	Depth is the NDC z of the camera (-1 near, 1 far), the buffer starts with FLT_MAX so empty pixels never occlude.
+	The rasterization is conservative: a triangle only writes the pixels it covers completely, with the farthest depth
+	of the triangle over the pixel, so a box seen through a pixel partly covered or behind a sloped occluder is kept.
+	It only needs the CPU copy of the meshes, nothing here touches GL.
+*/
+
+#ifndef OCCLUSIONCULLING_H
+#define OCCLUSIONCULLING_H
+
+#include "framework.h"
+
+class Mesh;
+
+class OcclusionCulling
+{
+public:
+	static const int TILE_WIDTH = 64;
+	static const int TILE_HEIGHT = 32;
+
+	struct sOccluder {
+		Mesh* mesh;
+		Matrix44 model;
+	};
+
+	int width; //multiple of TILE_WIDTH
+	int height; //multiple of TILE_HEIGHT
+	std::vector<float> depth; //row by row, the first one is the bottom of the screen
+
+	//last render
+	int num_triangles; //rasterized (after rejecting the ones behind the camera or out of the screen)
+	float raster_time; //ms
+
+	OcclusionCulling();
+
+	void setSize(int width, int height);
+
+	//clears the buffer and rasterizes the triangles of the occluders seen from viewprojection
+	void render(const Matrix44& viewprojection, const std::vector<sOccluder>& occluders, int num_workers = 1);
+
+	//false if the box is completely behind the occluders, boxes crossing the near plane are always visible
+	bool testBox(const BoundingBox& box) const;
+
+	//triangles of the mesh (from its CPU copy), 0 if it has no vertices in memory
+	static int getNumTriangles(Mesh* mesh);
+
+private:
+	struct sTriangle {
+		float x[3]; //pixels
+		float y[3];
+		float z[3]; //ndc
+		int min_x, min_y, max_x, max_y; //pixels touched, already clamped to the buffer
+	};
+
+	Matrix44 viewprojection;
+	int tiles_x;
+	int tiles_y;
+	std::vector< std::vector<sTriangle> > worker_triangles; //one list per job of the setup, merged in order
+	std::vector<sTriangle> triangles;
+
+	void setupTriangles(const sOccluder& occluder, std::vector<sTriangle>& output);
+	void rasterizeTile(int tile);
+};
+
+#endif
@@ -11,7 +11,9 @@
 #include "extra/hdre.h"
 
 #include "fbo.h"
+#include "glstate.h"
 #include "application.h"
+#include "task.h"
 
 #include <algorithm>    // Sorting algorithm
 
@@ -25,13 +27,11 @@ GTR::Renderer::Renderer() {
 	pipelineSpace = GAMMA;
 	dynamicRange = HDR;
 
-	gbuffers_fbo = NULL;
-	illumination_fbo = NULL;
-	ssao_fbo = NULL;
-	ssao_blur = NULL;
 	probes_texture = NULL;
 	irradiance_fbo = NULL;
-	volumetric_fbo = NULL;
+	deferred_gbuffers[0] = deferred_gbuffers[1] = deferred_gbuffers[2] = -1;
+	deferred_depth = -1;
+	deferred_ssao = -1;
 
 	reflection_fbo = new FBO();
 	reflection_fbo->create(Application::instance->window_width, Application::instance->window_height);
@@ -57,14 +57,8 @@ GTR::Renderer::Renderer() {
 	skybox = CubemapFromHDRE("data/pisa.hdre");
 
 	cloned_depth_texture = NULL;
-	decal_fbo = NULL;
 	cube.createCube();
-	postFX_textureA = NULL;
-	postFX_textureB = NULL;
-	postFX_textureC = NULL;
-	postFX_textureD = NULL;
 
-	blur = NULL;
 	directional = NULL;
 	deb_fac = 1.0;
 	minDist = 1.0;
@@ -74,6 +68,94 @@ GTR::Renderer::Renderer() {
 	contrast = 1.0;
 	threshold = 1.0;
 
+	parallel_gather = true;
+	num_gather_workers = getNumWorkers();
+	gather_time = 0.0;
+
+	use_render_cache = true;
+	cache_frame = 0;
+	num_cached_calls = -1;
+	num_dirty_entities = 0;
+	static_frames = 60;
+
+	shadow_atlas_size = 2048;
+	num_shadow_tiles = 0;
+
+	num_cascades = 4;
+	cascade_tile_size = 512;
+	cascade_distance = 1000.0;
+	cascade_lambda = 0.75;
+
+	use_shadow_cache = true;
+	num_shadowmaps_rendered = 0;
+	num_shadowmaps_cached = 0;
+	static_casters_version = 0;
+	static_calls_changed = false;
+	num_static_calls = 0;
+	render_calls_changed = true;
+	culling_scalar_time = 0.0;
+	culling_batch_time = 0.0;
+	culling_bvh_time = 0.0;
+	culling_mismatches = 0;
+	use_bvh = true;
+	cull_views_time = 0.0;
+	use_instancing = true;
+	min_instances = 2;
+	num_instanced_draws = 0;
+	use_multidraw = GeometryPool::isSupported();
+	multidraw_page = -1;
+	multidraw_first_command = 0;
+	multidraw_num_commands = -1;
+	num_multidraws = 0;
+	num_multidraw_commands = 0;
+	use_gpu_culling = false;
+	gpu_culling_compare = false;
+	gpu_culled_view = -1;
+	gpu_cull_visible = 0;
+	gpu_cull_occluded = 0;
+	gpu_cull_mismatches = 0;
+	use_occlusion_culling = false;
+	max_occluders = 32;
+	max_occluder_triangles = 5000;
+	min_occluder_size = 0.05f;
+	num_occluded_calls = 0;
+	occlusion_test_time = 0.0f;
+	occlusion_single_time = 0.0f;
+	occlusion_parallel_time = 0.0f;
+	use_depth_prepass = false;
+	use_lods = true;
+	lod_pixel_error = 1.0f;
+	lod_hysteresis = 0.75f;
+	memset(num_lod_calls, 0, sizeof(num_lod_calls));
+	use_meshlets = true;
+	meshlet_draw = false;
+	num_meshlets_drawn = 0;
+	num_meshlets_culled = 0;
+	use_impostors = false;
+	impostor_distance = 500.0f;
+	impostor_frames = 8;
+	impostor_size = 1024;
+	num_impostor_instances = 0;
+	num_impostor_draws = 0;
+	use_hlod = false;
+	hlod_built = false;
+	hlod_distance = 300.0f;
+	num_hlod_proxies = 0;
+	num_hlod_entities = 0;
+	depth_prepass_active = false;
+
+	camera_block.create(CAMERA_BLOCK, sizeof(sCameraBlock));
+	lights_block.create(LIGHTS_BLOCK, sizeof(sLightsBlock));
+	material_block.create(MATERIAL_BLOCK, sizeof(sMaterialBlock));
+	last_material_block = sMaterialBlock();
+	last_material_block.has_normal = -1; //so the first material is always uploaded
+	lights_block_cascaded_light = -1;
+	num_block_uploads = 0;
+	num_uniforms_sent = 0;
+	num_uniforms_skipped = 0;
+	num_state_calls = 0;
+	num_state_calls_avoided = 0;
+
 	loadProbes();
 
 	// MIRAAAAAAR
@@ -99,13 +181,17 @@ GTR::Renderer::Renderer() {
 	reflection_probes.push_back(probe);
 }
 
+GTR::Renderer::~Renderer() {
+	clearShadowCaches();
+}
+
 void GTR::Renderer::generateSkybox(Camera* camera) {
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj", false);
 	Shader* shader = Shader::Get("skybox");
 	Matrix44 model;
 	model.setTranslation(camera->eye.x, camera->eye.y, camera->eye.z);
-	glDisable(GL_CULL_FACE);
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
 
 	shader->enable();
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
@@ -115,8 +201,8 @@ void GTR::Renderer::generateSkybox(Camera* camera) {
 	mesh->render(GL_TRIANGLES);
 	shader->disable();
 
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
 }
 
 vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi) {
@@ -142,7 +228,7 @@ vector<Vector3> GTR::generateSpherePoints(int num, float radius, bool hemi) {
 	return points;
 }
 
-void GTR::Renderer::renderForward(Camera* camera, GTR::Scene* scene) {
+void GTR::Renderer::renderForward(Camera* camera, GTR::Scene* scene, int view) {
 	//set the clear color (the background color)
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
 
@@ -151,9 +237,33 @@ void GTR::Renderer::renderForward(Camera* camera, GTR::Scene* scene) {
 	checkGLErrors();
 
 	generateSkybox(camera);
+	uploadCameraBlock(camera);
+
+	if (lightRender == CLUSTERED)
+		light_clusters.build(camera, lights, parallel_gather ? num_gather_workers : 1);
+
+	//depth of the opaque calls first (not the masked ones, their depth depends on the alpha test)
+	if (use_depth_prepass) {
+		GLState::colorMask(false, false, false, false);
+		drawOpaqueCalls(view, ALL_CALLS, [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+			if (material->alpha_mode == eAlphaMode::NO_ALPHA)
+				renderDepthPrepass(models[0], mesh, material, models, num_instances);
+		});
+		GLState::colorMask(true, true, true, true);
+	}
 
-	for (vector<GTR::RenderCall>::iterator rc = render_calls.begin(); rc != render_calls.end(); ++rc) {
-		if (camera->testBoxInFrustum(rc->world_bounding.center, rc->world_bounding.halfsize))
+	//opaque calls grouped in instances, then the blended ones from back to front
+	depth_prepass_active = use_depth_prepass;
+	drawOpaqueCalls(view, ALL_CALLS, [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+		renderMeshWithMaterialAndLighting(models[0], mesh, material, camera, models, num_instances);
+	});
+	depth_prepass_active = false;
+	if (use_impostors)
+		renderImpostors(camera, false);
+	for (int i = 0; i < render_order.size(); ++i) {
+		int index = render_order[i];
+		RenderCall* rc = &render_calls[index];
+		if (isCallVisible(index, view) && rc->material->alpha_mode == GTR::eAlphaMode::BLEND)
 			renderMeshWithMaterialAndLighting(rc->model, rc->mesh, rc->material, camera);
 	}
 
@@ -164,66 +274,10 @@ void GTR::Renderer::renderForward(Camera* camera, GTR::Scene* scene) {
 		renderReflectionProbes(scene, camera);
 }
 
-void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene) {
-	//Render GBuffers
+void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene, int view) {
 	int width = Application::instance->window_width;
 	int height = Application::instance->window_height;
 
-	//Crear GBuffer si no existen
-	if (!gbuffers_fbo) {
-		gbuffers_fbo = new FBO();
-
-		//create 3 textures of 4 components
-		gbuffers_fbo->create(width, height,
-			3, 			//three textures
-			GL_RGBA, 		//four channels
-			GL_UNSIGNED_BYTE, //1 byte
-			true);		//add depth_texture
-	}
-	if (!illumination_fbo) {
-		illumination_fbo = new FBO();
-
-		illumination_fbo->create(width, height,
-			1,			//one texture
-			GL_RGB,			//three channels
-			GL_FLOAT,	//1 byte
-			true);		//add depth_texture
-	}
-	if (!ssao_fbo) {
-		ssao_fbo = new FBO();
-		ssao_fbo->create(width, height,
-			1,			//one texture
-			GL_RGB,			//three channels
-			GL_UNSIGNED_BYTE,	//1 byte
-			false);		//add depth_texture
-
-		ssao_blur = new Texture();
-		ssao_blur->create(width, height);
-	}
-	if (!decal_fbo) {
-		decal_fbo = new FBO();
-		decal_fbo->create(width, height,
-			3,			//one texture
-			GL_RGBA,			//three channels
-			GL_UNSIGNED_BYTE,	//1 byte
-			true);		//add depth_texture
-	}
-	if (!postFX_textureA) {
-		postFX_textureA = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-	}
-	if (!postFX_textureB) {
-		postFX_textureB = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-	}
-	if (!postFX_textureC) {
-		postFX_textureC = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-	}
-	if (!postFX_textureD) {
-		postFX_textureD = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-	}
-	if (!blur) {
-		blur = new Texture(width, height, GL_RGB, GL_FLOAT, false);
-	}
-
 	Mesh* quad = Mesh::getQuad();
 	Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", false);
 	Matrix44 inv_view = camera->view_matrix;
@@ -231,243 +285,342 @@ void GTR::Renderer::renderDeferred(Camera* camera, GTR::Scene* scene) {
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
 
-	gbuffers_fbo->bind();
-
-	//set the clear color (the background color)
-	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-
-	// Clear the color and the depth buffer
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	checkGLErrors();
-
-	//Renderizar cada objeto con un GBuffer shader
-	for (vector<GTR::RenderCall>::iterator rc = render_calls.begin(); rc != render_calls.end(); ++rc) {
-		if (camera->testBoxInFrustum(rc->world_bounding.center, rc->world_bounding.halfsize))
-			renderMeshWithMaterialToGBuffers(rc->model, rc->mesh, rc->material, camera);
-	}
+	//the targets of the frame are textures of the render graph, the ones not alive at the same time share the memory
+	RenderGraph& graph = render_graph;
+	graph.reset();
+	int gbuffers[3];
+	gbuffers[0] = graph.createTexture("albedo", width, height, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST);
+	gbuffers[1] = graph.createTexture("normal", width, height, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST);
+	gbuffers[2] = graph.createTexture("material", width, height, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST);
+	int depth = graph.createTexture("depth", width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST);
+	int decal_depth = graph.createTexture("decal depth", width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST);
+	int ssao = graph.createTexture("ssao", width, height, GL_RGB, GL_UNSIGNED_BYTE, GL_NEAREST);
+	int ssao_blurred = graph.createTexture("ssao blurred", width, height, GL_RGB, GL_UNSIGNED_BYTE, GL_NEAREST);
+	int illumination = graph.createTexture("illumination", width, height, GL_RGB, GL_FLOAT, GL_NEAREST);
+	int illumination_depth = graph.createTexture("illumination depth", width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST);
+	std::vector<int> gbuffer_colors(gbuffers, gbuffers + 3);
+
+	//what uploadLightToShaderDeferred gives to the shaders
+	for (int i = 0; i < 3; ++i)
+		deferred_gbuffers[i] = gbuffers[i];
+	deferred_depth = depth;
+	deferred_ssao = ssao_blurred;
+	std::vector<int> deferred_inputs = { gbuffers[0], gbuffers[1], gbuffers[2], depth, ssao_blurred };
+
+	graph.addPass("gbuffers", {}, { gbuffers[0], gbuffers[1], gbuffers[2], depth }, [&]() {
+		FBO* fbo = graph.getFBO(gbuffer_colors, depth);
+		fbo->bind();
+
+		//set the clear color (the background color)
+		glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+
+		// Clear the color and the depth buffer
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		checkGLErrors();
+
+		//Renderizar cada objeto con un GBuffer shader
+		uploadCameraBlock(camera);
+		auto draw_to_gbuffers = [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+			renderMeshWithMaterialToGBuffers(models[0], mesh, material, camera, models, num_instances);
+		};
+		drawOpaqueCalls(view, ALL_CALLS, draw_to_gbuffers);
+		if (use_impostors)
+			renderImpostors(camera, true);
+
+		//second pass of the GPU occlusion: what the pyramid of the last frame hid is tested against this depth,
+		//so the objects coming out from behind an occluder are not missing for a frame
+		if (gpu_culled_view != -1 && view == gpu_culled_view && gpu_culling.occlusion_culled) {
+			fbo->unbind();
+			gpu_culling.buildDepthPyramid(graph.getTexture(depth), camera->viewprojection_matrix);
+			gpu_culling.cullOccluded(geometry_pool);
+			fbo->bind();
+			drawOpaqueCalls(view, GPU_CULLED_CALLS, draw_to_gbuffers);
+		}
 
-	gbuffers_fbo->unbind();
+		fbo->unbind();
 
-	gbuffers_fbo->color_textures[0]->copyTo(decal_fbo->color_textures[0]);
-	gbuffers_fbo->color_textures[1]->copyTo(decal_fbo->color_textures[1]);
-	gbuffers_fbo->color_textures[2]->copyTo(decal_fbo->color_textures[2]);
+		//the occlusion of the next frame is tested against this depth
+		if (gpu_culled_view != -1 && view == gpu_culled_view && gpu_culling.use_occlusion)
+			gpu_culling.buildDepthPyramid(graph.getTexture(depth), camera->viewprojection_matrix);
+	});
 
-	decal_fbo->bind();
-	gbuffers_fbo->depth_texture->copyTo(NULL);
-	decal_fbo->unbind();
+	//the decals read the depth while the gbuffers (with the depth) are bound, so they read a copy (culled without decals)
+	graph.addPass("decal depth", { depth }, { decal_depth }, [&]() {
+		FBO* fbo = graph.getFBO(std::vector<int>(), decal_depth);
+		fbo->bind();
+		graph.getTexture(depth)->copyTo(NULL);
+		fbo->unbind();
+	});
 
 	if (decals.size() && show_decal) {
-		gbuffers_fbo->bind();
-
-		Shader* shader = Shader::Get("decal");
-		shader->enable();
-		shader->setUniform("u_depth_texture", decal_fbo->depth_texture, 6);
-		shader->setUniform("u_inverse_viewprojection", inv_vp);
-		shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-		glColorMask(true, true, true, false);
-
-		for (int i = 0; i < decals.size(); i++) {
-			DecalEntity* decal = decals[i];
-			shader->setUniform("u_model", decal->model);
-			Matrix44 inv_decal_model = decal->model;
-			inv_decal_model.inverse();
-			shader->setUniform("u_imodel", inv_decal_model);
-			Texture* decal_texture = Texture::Get(decal->texture.c_str());
-			if (!decal_texture) continue;
-			shader->setUniform("u_texture", decal_texture, 7);
-			cube.render(GL_TRIANGLES);
-		}
+		graph.addPass("decals", { gbuffers[0], gbuffers[1], gbuffers[2], depth, decal_depth }, gbuffer_colors, [&]() {
+			FBO* fbo = graph.getFBO(gbuffer_colors, depth);
+			fbo->bind();
+
+			Shader* shader = Shader::Get("decal");
+			shader->enable();
+			shader->setUniform("u_depth_texture", graph.getTexture(decal_depth), 6);
+			shader->setUniform("u_inverse_viewprojection", inv_vp);
+			shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+			shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+			GLState::colorMask(true, true, true, false);
+
+			for (int i = 0; i < decals.size(); i++) {
+				DecalEntity* decal = decals[i];
+				shader->setUniform("u_model", decal->model);
+				Matrix44 inv_decal_model = decal->model;
+				inv_decal_model.inverse();
+				shader->setUniform("u_imodel", inv_decal_model);
+				Texture* decal_texture = Texture::Get(decal->texture.c_str());
+				if (!decal_texture) continue;
+				shader->setUniform("u_texture", decal_texture, 7);
+				cube.render(GL_TRIANGLES);
+			}
 
-		glColorMask(true, true, true, true);
-		glDisable(GL_BLEND);
-		gbuffers_fbo->unbind();
+			GLState::colorMask(true, true, true, true);
+			GLState::disable(GL_BLEND);
+			fbo->unbind();
+		});
 	}
 
-	ssao_fbo->bind();
-
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
-
-	Shader* shader_ssao = Shader::Get("ssao");
-	shader_ssao->enable();
-	shader_ssao->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 1);
-	shader_ssao->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader_ssao->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-	shader_ssao->setUniform("u_inverse_viewprojection", inv_vp);
-	shader_ssao->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-	shader_ssao->setUniform3Array("u_points", (float*)&random_points[0], random_points.size());
-
-	quad->render(GL_TRIANGLES);
-
-	Shader* shader_blur = Shader::Get("ssao_blur");
-	shader_blur->enable();
-	shader_blur->setUniform("ssaoInput", ssao_fbo->color_textures[0], 1);
-	quad->render(GL_TRIANGLES);
-
-	ssao_fbo->unbind();
+	graph.addPass("ssao", { gbuffers[1], depth }, { ssao }, [&]() {
+		FBO* fbo = graph.getFBO({ ssao });
+		fbo->bind();
 
-	illumination_fbo->bind();
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::disable(GL_BLEND);
 
-	gbuffers_fbo->depth_texture->copyTo(NULL);
-	glClear(GL_COLOR_BUFFER_BIT);
+		Shader* shader_ssao = Shader::Get("ssao");
+		shader_ssao->enable();
+		shader_ssao->setUniform("u_gb1_texture", graph.getTexture(gbuffers[1]), 1);
+		shader_ssao->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		shader_ssao->setUniform("u_depth_texture", graph.getTexture(depth), 3);
+		shader_ssao->setUniform("u_inverse_viewprojection", inv_vp);
+		shader_ssao->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+		shader_ssao->setUniform3Array("u_points", (float*)&random_points[0], random_points.size());
 
-	glDisable(GL_DEPTH_TEST);
-
-	//we need a fullscreen quad
-	Shader* shader = Shader::Get("deferred");
+		quad->render(GL_TRIANGLES);
+		fbo->unbind();
+	});
+
+	//to its own texture, reading the one being written is undefined
+	graph.addPass("ssao blur", { ssao }, { ssao_blurred }, [&]() {
+		FBO* fbo = graph.getFBO({ ssao_blurred });
+		fbo->bind();
+		Shader* shader_blur = Shader::Get("ssao_blur");
+		shader_blur->enable();
+		shader_blur->setUniform("ssaoInput", graph.getTexture(ssao), 1);
+		quad->render(GL_TRIANGLES);
+		fbo->unbind();
+	});
+
+	graph.addPass("lighting", deferred_inputs, { illumination, illumination_depth }, [&]() {
+		FBO* fbo = graph.getFBO({ illumination }, illumination_depth);
+		fbo->bind();
+
+		graph.getTexture(depth)->copyTo(NULL);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		GLState::disable(GL_DEPTH_TEST);
+
+		Shader* shader = NULL;
+
+		if (lightRender == CLUSTERED) {
+			//all the lights in one fullscreen pass, every pixel only loops the lights of its cluster
+			light_clusters.build(camera, lights, parallel_gather ? num_gather_workers : 1);
+			shader = Shader::Get("deferred_clustered");
+			shader->enable();
+			shader->setUniform("u_ambient_light", scene->ambient_light);
+			uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+			uploadLightToShaderClustered(shader);
+			GLState::disable(GL_BLEND);
+			quad->render(GL_TRIANGLES);
+		}
+		else {
+			//we need a fullscreen quad
+			shader = Shader::Get("deferred");
 
-	shader->enable();
-	shader->setUniform("u_ambient_light", scene->ambient_light);
+			shader->enable();
+			shader->setUniform("u_ambient_light", scene->ambient_light);
 
-	uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+			uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
 
-	int num_lights = lights.size();
+			int num_lights = lights.size();
 
-	uploadLightToShaderMultipass(directional, shader);
+			uploadLightToShaderMultipass(directional, shader);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+			GLState::disable(GL_DEPTH_TEST);
+			GLState::disable(GL_BLEND);
 
-	quad->render(GL_TRIANGLES);
+			quad->render(GL_TRIANGLES);
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-	if (!num_lights) {
-		shader->setUniform("u_light_color", Vector3());
-		quad->render(GL_TRIANGLES);
-	}
-	else {
-		for (int i = 0; i < num_lights; ++i) {
-			LightEntity* light = lights[i];
+			if (!num_lights) {
+				shader->setUniform("u_light_color", Vector3());
+				quad->render(GL_TRIANGLES);
+			}
+			else {
+				for (int i = 0; i < num_lights; ++i) {
+					LightEntity* light = lights[i];
 
-			Matrix44 m;
-			Vector3 lightpos = light->model.getTranslation();
-			m.setTranslation(lightpos.x, lightpos.y, lightpos.z);
-			m.scale(light->max_distance, light->max_distance, light->max_distance);
+					Matrix44 m;
+					Vector3 lightpos = light->model.getTranslation();
+					m.setTranslation(lightpos.x, lightpos.y, lightpos.z);
+					m.scale(light->max_distance, light->max_distance, light->max_distance);
 
-			if (renderShape == GEOMETRY && light->light_type != DIRECTIONAL) {
-				shader = Shader::Get("sphere_deferred");
+					if (renderShape == GEOMETRY && light->light_type != DIRECTIONAL) {
+						shader = Shader::Get("sphere_deferred");
 
-				shader->enable();
+						shader->enable();
 
-				uploadLightToShaderMultipass(light, shader);
-				uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+						uploadLightToShaderMultipass(light, shader);
+						uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
 
-				shader->setUniform("u_model", m);
-				shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
+						shader->setUniform("u_model", m);
+						shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 
-				glEnable(GL_CULL_FACE);
+						GLState::enable(GL_CULL_FACE);
 
-				//render only the backfacing triangles of the sphere
-				glFrontFace(GL_CW);
+						//render only the backfacing triangles of the sphere
+						GLState::frontFace(GL_CW);
 
-				//and render the sphere
-				sphere->render(GL_TRIANGLES);
-			}
-			else if (renderShape == QUAD) {
-				glDisable(GL_CULL_FACE);
-				glFrontFace(GL_CCW);
+						//and render the sphere
+						sphere->render(GL_TRIANGLES);
+					}
+					else if (renderShape == QUAD) {
+						GLState::disable(GL_CULL_FACE);
+						GLState::frontFace(GL_CCW);
 
-				shader = Shader::Get("deferred");
+						shader = Shader::Get("deferred");
 
-				shader->enable();
+						shader->enable();
 
-				uploadLightToShaderMultipass(light, shader);
-				uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+						uploadLightToShaderMultipass(light, shader);
+						uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
 
-				//do the draw call that renders the mesh into the screen
-				quad->render(GL_TRIANGLES);
+						//do the draw call that renders the mesh into the screen
+						quad->render(GL_TRIANGLES);
+					}
+					shader->setUniform("u_ambient_light", Vector3());
+					shader->setUniform("u_emissive_factor", Vector3());
+				}
 			}
-			shader->setUniform("u_ambient_light", Vector3());
-			shader->setUniform("u_emissive_factor", Vector3());
 		}
-	}
 
-	glDisable(GL_CULL_FACE);
-	glFrontFace(GL_CCW);
+		GLState::disable(GL_CULL_FACE);
+		GLState::frontFace(GL_CCW);
+		fbo->unbind();
+	});
 
+	//added to the lighting (with the blending it left)
 	if (probes_texture && show_irradiance) {
-		shader = Shader::Get("irradiance");
-		shader->enable();
-		uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
-		shader->setUniform("u_inv_view_matrix", inv_view);
-		shader->setUniform("u_probes_texture", probes_texture, 5);
-		shader->setUniform("u_irr_start", start_irr);
-		shader->setUniform("u_irr_end", end_irr);
-		shader->setUniform("u_irr_dim", dim_irr);
-		shader->setUniform("u_irr_normal_distance", 0.1f);
-		shader->setUniform("u_irr_delta", delta);
-		shader->setUniform("u_num_probes", probes_texture->height);
-
-		quad->render(GL_TRIANGLES);
+		std::vector<int> reads = deferred_inputs;
+		reads.push_back(illumination);
+		graph.addPass("irradiance", reads, { illumination, illumination_depth }, [&]() {
+			FBO* fbo = graph.getFBO({ illumination }, illumination_depth);
+			fbo->bind();
+			Shader* shader = Shader::Get("irradiance");
+			shader->enable();
+			uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+			shader->setUniform("u_inv_view_matrix", inv_view);
+			shader->setUniform("u_probes_texture", probes_texture, 5);
+			shader->setUniform("u_irr_start", start_irr);
+			shader->setUniform("u_irr_end", end_irr);
+			shader->setUniform("u_irr_dim", dim_irr);
+			shader->setUniform("u_irr_normal_distance", 0.1f);
+			shader->setUniform("u_irr_delta", delta);
+			shader->setUniform("u_num_probes", probes_texture->height);
+
+			quad->render(GL_TRIANGLES);
+			fbo->unbind();
+		});
 	}
 
-	// To enable the z-buffer so the grid does not appear over the objects
-	glEnable(GL_DEPTH_TEST);
-
-	// Render alphanodes in forward mode
-	for (vector<GTR::RenderCall>::iterator rc = render_calls.begin(); rc != render_calls.end(); ++rc) {
-		if (camera->testBoxInFrustum(rc->world_bounding.center, rc->world_bounding.halfsize) && rc->material->alpha_mode == GTR::eAlphaMode::BLEND) {
-			renderMeshWithMaterialAndLighting(rc->model, rc->mesh, rc->material, camera);
+	// Render alphanodes in forward mode, tested against the depth of the opaque ones
+	graph.addPass("transparent", { illumination, illumination_depth }, { illumination, illumination_depth }, [&]() {
+		FBO* fbo = graph.getFBO({ illumination }, illumination_depth);
+		fbo->bind();
+		GLState::enable(GL_DEPTH_TEST);
+		for (int i = 0; i < render_order.size(); ++i) {
+			int index = render_order[i];
+			RenderCall* rc = &render_calls[index];
+			if (isCallVisible(index, view) && rc->material->alpha_mode == GTR::eAlphaMode::BLEND) {
+				renderMeshWithMaterialAndLighting(rc->model, rc->mesh, rc->material, camera);
+			}
 		}
-	}
-
-	illumination_fbo->unbind();
+		fbo->unbind();
+	});
 
-	applyfx(illumination_fbo->color_textures[0], gbuffers_fbo->depth_texture, camera);
+	applyfx(illumination, depth, camera);
 
 	if (show_volumetric) {
-		if (!volumetric_fbo) {
-			volumetric_fbo = new FBO();
-			volumetric_fbo->create(width, height, 1, GL_RGBA);
-		}
-
-		volumetric_fbo->bind();
-		shader = Shader::Get("volumetric");
-		shader->enable();
-		uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
-		uploadLightToShaderSinglepass(shader);
-		shader->setUniform("u_air_density", air_density * 0.001f);
-		quad->render(GL_TRIANGLES);
-		volumetric_fbo->unbind();
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		volumetric_fbo->color_textures[0]->toViewport();
+		int volumetric = graph.createTexture("volumetric", width, height, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST);
+		graph.addPass("volumetric", deferred_inputs, { volumetric }, [&, volumetric]() {
+			FBO* fbo = graph.getFBO({ volumetric });
+			fbo->bind();
+			Shader* shader = Shader::Get("volumetric");
+			shader->enable();
+			uploadLightToShaderDeferred(shader, inv_vp, width, height, camera);
+			uploadLightToShaderSinglepass(shader);
+			if (lights.size())
+				shader->setUniform("u_light_color", lights[0]->color * lights[0]->intensity);
+			shader->setUniform("u_air_density", air_density * 0.001f);
+			quad->render(GL_TRIANGLES);
+			fbo->unbind();
+		});
+		graph.addPass("volumetric composite", { volumetric }, {}, [&, volumetric]() {
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			graph.getTexture(volumetric)->toViewport();
+		}, true);
 	}
 
 	if (show_gbuffers) {
-		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[0]->toViewport();
-		glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[1]->toViewport();
-		glViewport(0, 0, width * 0.5, height * 0.5);
-		gbuffers_fbo->color_textures[2]->toViewport();
-		glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
-
-		Shader* shader = Shader::getDefaultShader("depth");
-		shader->enable();
-		shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
-
-		gbuffers_fbo->depth_texture->toViewport(shader);
-		glViewport(0, 0, width, height);
+		graph.addPass("show gbuffers", { gbuffers[0], gbuffers[1], gbuffers[2], depth }, {}, [&]() {
+			glViewport(0, height * 0.5, width * 0.5, height * 0.5);
+			graph.getTexture(gbuffers[0])->toViewport();
+			glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
+			graph.getTexture(gbuffers[1])->toViewport();
+			glViewport(0, 0, width * 0.5, height * 0.5);
+			graph.getTexture(gbuffers[2])->toViewport();
+			glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
+
+			Shader* shader = Shader::getDefaultShader("depth");
+			shader->enable();
+			shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
+
+			graph.getTexture(depth)->toViewport(shader);
+			glViewport(0, 0, width, height);
+		}, true);
 	}
 
 	if (show_ssao) {
-		ssao_fbo->color_textures[0]->toViewport();
+		graph.addPass("show ssao", { ssao_blurred }, {}, [&]() {
+			graph.getTexture(ssao_blurred)->toViewport();
+		}, true);
 	}
+
+	graph.execute();
 }
 
 void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 {
 	lights.clear();
-	render_calls.clear();
 	decals.clear();
+	prefab_entities.clear();
+	for (std::map<GTR::Prefab*, Impostor*>::iterator it = impostors.begin(); it != impostors.end(); ++it)
+		it->second->models.clear();
+
+	bakeImpostors();
+	if (use_hlod && !hlod_built)
+		buildHLOD(scene, camera);
+	bool hlod_changed = updateHLOD(camera);
 
 	//rendering entities
 	for (int i = 0; i < scene->entities.size(); ++i) {
@@ -488,9 +641,13 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 		if (ent->entity_type == PREFAB)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if (pent->prefab) {
-				renderPrefab(ent->model, pent->prefab, camera);
-			}
+			//the render cache does its own checks
+			if (!pent->prefab || (!use_render_cache && isInHLODProxy(pent)))
+				continue;
+			if (!use_render_cache && useImpostor(pent->prefab, pent->model, camera))
+				impostors[pent->prefab]->models.push_back(pent->model);
+			else
+				prefab_entities.push_back(pent);
 		}
 
 		//is a decal!
@@ -501,55 +658,782 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 		}
 	}
 
+	gatherRenderCalls(scene, camera);
+	addHLODCalls(camera);
+	if (hlod_changed)
+		render_calls_changed = true;
+
+	//the shadow caches only look at the static casters again when this version changes
+	int num_static = 0;
+	for (int i = 0; i < render_calls.size(); ++i)
+		num_static += render_calls[i].is_static ? 1 : 0;
+	if (static_calls_changed || hlod_changed || num_static != num_static_calls)
+		static_casters_version++;
+	num_static_calls = num_static;
+	static_calls_changed = false;
+	updateRenderBounds();
+	memset(num_lod_calls, 0, sizeof(num_lod_calls));
+	for (int i = 0; i < render_calls.size(); ++i)
+		num_lod_calls[render_calls[i].lod]++;
+	updateSceneBVH();
+
+	//every camera of the frame is culled in the same pass
+	cull_views.clear();
+	int camera_view = addCullView(camera);
+
+	Camera flipped_camera;
+	int flipped_view = -1;
+	bool render_reflections = pipeline == FORWARD && show_reflections;
+	if (render_reflections) {
+		flipped_camera.lookAt(camera->eye * Vector3(1, -1, 1), camera->center * Vector3(1, -1, 1), Vector3(0, -1, 0));
+		flipped_camera.setPerspective(camera->fov, camera->aspect, camera->near_plane, camera->far_plane);
+		flipped_view = addCullView(&flipped_camera);
+	}
+
+	allocateShadowTiles(camera);
+	std::vector<int> shadow_views(lights.size() * MAX_SHADOW_CASCADES, -1);
+	for (int i = 0; i < lights.size(); i++) {
+		LightEntity* light = lights[i];
+		if (!light->shadowmap)
+			continue;
+		setupShadowCamera(light, camera);
+		if (!light->num_cascades)
+			shadow_views[i * MAX_SHADOW_CASCADES] = addCullView(light->light_camera);
+		for (int j = 0; j < light->num_cascades; ++j)
+			shadow_views[i * MAX_SHADOW_CASCADES + j] = addCullView(light->cascade_cameras[j]);
+	}
+
+	cullViews();
+	if (use_occlusion_culling)
+		cullOcclusion(camera, camera_view);
+	else
+		num_occluded_calls = 0;
+
+	//rendercalls (sorted before the shadowmaps, they are drawn in render_order too so the instances come grouped)
+	sortRenderCalls(camera);
+	num_instanced_draws = 0;
+	num_meshlets_drawn = 0;
+	num_meshlets_culled = 0;
+	num_block_uploads = UniformBuffer::num_uploads;
+	UniformBuffer::num_uploads = 0;
+	num_uniforms_sent = Shader::num_uniforms_sent;
+	num_uniforms_skipped = Shader::num_uniforms_skipped;
+	Shader::num_uniforms_sent = 0;
+	Shader::num_uniforms_skipped = 0;
+	num_state_calls = GLState::num_calls;
+	num_state_calls_avoided = GLState::num_avoided;
+	GLState::num_calls = 0;
+	GLState::num_avoided = 0;
+	num_impostor_instances = 0;
+	num_impostor_draws = 0;
+	num_multidraws = geometry_pool.num_multidraws;
+	num_multidraw_commands = geometry_pool.num_commands;
+	geometry_pool.num_multidraws = 0;
+	geometry_pool.num_commands = 0;
+
+	//the GPU culls the pooled calls of the main view, the CPU only groups them (once, whatever the view)
+	gpu_culled_view = -1;
+	bool gpu_culling_enabled = use_gpu_culling && use_multidraw && GPUCulling::isSupported();
+	if (gpu_culling_enabled)
+		buildGPUBatches();
+
 	//shadowmaps
+	num_shadowmaps_rendered = 0;
+	num_shadowmaps_cached = 0;
+	for (std::map<Camera*, sShadowCache>::iterator it = shadow_caches.begin(); it != shadow_caches.end(); ++it)
+		it->second.used = false;
 	for (int i = 0; i < lights.size(); i++) {
 		LightEntity* light = lights[i];
-		if (light->cast_shadows)
-			generateShadowmap(light);
+		if (!light->shadowmap)
+			continue;
+		if (!light->num_cascades)
+			generateShadowmap(light->light_camera, light->shadowmap_region, shadow_views[i * MAX_SHADOW_CASCADES]);
+		for (int j = 0; j < light->num_cascades; ++j)
+			generateShadowmap(light->cascade_cameras[j], light->cascade_regions[j], shadow_views[i * MAX_SHADOW_CASCADES + j]);
+	}
+	//lights hidden, removed or with less cascades, their cameras could be deleted and the address given to another one
+	for (std::map<Camera*, sShadowCache>::iterator it = shadow_caches.begin(); it != shadow_caches.end();) {
+		if (it->second.used) {
+			++it;
+			continue;
+		}
+		delete it->second.static_fbo;
+		it = shadow_caches.erase(it);
+	}
+	uploadLightsBlock();
+
+	//after the reflections, that draw from the same pool buffers
+	if (render_reflections) {
+		reflection_fbo->bind();
+		flipped_camera.enable();
+		is_rendering_reflections = true;
+		renderForward(&flipped_camera, scene, flipped_view);
+		is_rendering_reflections = false;
+		reflection_fbo->unbind();
+		camera->enable();
+	}
+
+	if (gpu_culling_enabled) {
+		gpu_culling.cull(camera, geometry_pool);
+		gpu_culled_view = camera_view;
+		if (gpu_culling_compare)
+			compareGPUCulling(camera_view);
 	}
 
-	//rendercalls
-	sort(render_calls.begin(), render_calls.end(), std::greater<RenderCall>());
 	// Forward
 	if (pipeline == FORWARD) {
-		if (show_reflections) {
-			reflection_fbo->bind();
-			Camera flipped_camera;
-			flipped_camera.lookAt(camera->eye * Vector3(1, -1, 1), camera->center * Vector3(1, -1, 1), Vector3(0, -1, 0));
-			flipped_camera.setPerspective(camera->fov, camera->aspect, camera->near_plane, camera->far_plane);
-			flipped_camera.enable();
-			is_rendering_reflections = true;
-			renderForward(&flipped_camera, scene);
-			is_rendering_reflections = false;
-			reflection_fbo->unbind();
-			camera->enable();
+		GPUTimer& timer = forward_timers[use_depth_prepass ? 1 : 0];
+		timer.begin();
+		renderForward(camera, scene, camera_view);
+		timer.end();
+
+		//an empty frame of the graph gives back the textures of the deferred targets
+		if (render_graph.pool.size()) {
+			render_graph.reset();
+			render_graph.execute();
 		}
-		renderForward(camera, scene);
 	}
 	// Deferred
 	else if (pipeline == DEFERRED)
-		renderDeferred(camera, scene);
+		renderDeferred(camera, scene, camera_view);
 
 	if (probes_texture && show_probes_texture)
 		probes_texture->toViewport();
 }
 
+//distance used to sort the render calls
+static void updateDistanceToCamera(RenderCall& rc, Camera* camera)
+{
+	rc.distance_to_camera = rc.model.getTranslation().distance(camera->eye);
+}
+
+//packs the render call state so sorting by the key groups calls sharing state
+//opaque: [0][shader 2][material 16][mesh 16][depth 29] -> front to back inside the same material and mesh
+//blend:  [1][inverted depth 31][material 16][mesh 16] -> back to front
+static uint64 computeSortKey(const RenderCall& rc, float far_plane)
+{
+	Material* material = rc.material;
+	//in double, a float cannot hold the 29 and 31 bit limits and rounds them up to the next power of two
+	double depth = std::max(0.0, std::min((double)rc.distance_to_camera / far_plane, 1.0));
+	uint64 material_id = material->m_Id & 0xFFFF;
+	uint64 mesh_id = rc.mesh->m_Id & 0xFFFF;
+
+	if (material->alpha_mode == eAlphaMode::BLEND) {
+		uint64 inv_depth = std::min<uint64>((uint64)((1.0 - depth) * 0x7FFFFFFF), 0x7FFFFFFF);
+		return (1ULL << 63) | ((inv_depth & 0x7FFFFFFF) << 32) | (material_id << 16) | mesh_id;
+	}
+
+	//the shader variant depends on the alpha test and the culling
+	uint64 shader = (material->alpha_mode == eAlphaMode::MASK ? 1 : 0) | (material->two_sided ? 2 : 0);
+	uint64 quantized_depth = std::min<uint64>((uint64)(depth * 0x1FFFFFFF), 0x1FFFFFFF);
+	return ((shader & 0x3) << 61) | (material_id << 45) | (mesh_id << 29) | (quantized_depth & 0x1FFFFFFF);
+}
+
+void Renderer::sortRenderCalls(Camera* camera)
+{
+	int num = render_calls.size();
+	sort_items.resize(num);
+	for (int i = 0; i < num; ++i) {
+		RenderCall& rc = render_calls[i];
+		rc.sort_key = computeSortKey(rc, camera->far_plane);
+		sort_items[i].key = rc.sort_key;
+		sort_items[i].index = i;
+	}
+
+	radixSort(sort_items, sort_temp);
+
+	render_order.resize(num);
+	for (int i = 0; i < num; ++i)
+		render_order[i] = sort_items[i].index;
+}
+
+void Renderer::drawOpaqueCalls(int view, eCallFilter filter, std::function<void(Mesh* mesh, Material* material, const Matrix44* models, int num_instances)> draw)
+{
+	//the pooled calls of the GPU culled view come from the commands written by the compute shader, the rest go below
+	bool gpu_culled = view != -1 && view == gpu_culled_view;
+	if (gpu_culled) {
+		assert(filter == ALL_CALLS || filter == GPU_CULLED_CALLS);
+		for (int i = 0; i < gpu_batches.size(); ++i) {
+			sGPUBatch& batch = gpu_batches[i];
+			multidraw_page = batch.page;
+			multidraw_first_command = batch.first_command;
+			multidraw_num_commands = batch.num_commands;
+			draw(batch.mesh, batch.material, &gpu_culling.objects[batch.first_object].model, batch.num_objects);
+		}
+		multidraw_page = -1;
+		multidraw_first_command = 0;
+		multidraw_num_commands = -1;
+	}
+	if (filter == GPU_CULLED_CALLS)
+		return;
+
+	for (int i = 0; i < render_order.size();) {
+		RenderCall& first = render_calls[render_order[i]];
+		//the blended calls are at the end of render_order
+		if (first.material->alpha_mode == eAlphaMode::BLEND)
+			break;
+
+		//the sort key puts the calls with the same material together, their meshes go in one multidraw if they share a page
+		int page = use_multidraw ? geometry_pool.getPage(first.mesh) : -1;
+		if (page != -1) {
+			int end = i + 1;
+			while (end < render_order.size() && render_calls[render_order[end]].material == first.material && geometry_pool.getPage(render_calls[render_order[end]].mesh) == page)
+				end++;
+			if (gpu_culled) {
+				i = end;
+				continue;
+			}
+
+			multidraw_commands.clear();
+			instance_models.clear();
+			Mesh* last_mesh = NULL;
+			for (int j = i; j < end; ++j) {
+				int index = render_order[j];
+				RenderCall& rc = render_calls[index];
+				if (!isCallVisible(index, view) || (filter == STATIC_CALLS && !rc.is_static) || (filter == DYNAMIC_CALLS && rc.is_static))
+					continue;
+				//a call with meshlets gives a command per range of the visible ones, all with its model alone
+				if (cullMeshlets(rc, view)) {
+					if (!meshlet_counts.size())
+						continue;
+					for (int k = 0; k < meshlet_counts.size(); ++k) {
+						geometry_pool.addCommand(rc.mesh, instance_models.size(), 1, multidraw_commands);
+						GeometryPool::sDrawCommand& command = multidraw_commands.back();
+						command.first_index += meshlet_firsts[k];
+						command.count = meshlet_counts[k];
+					}
+					instance_models.push_back(rc.model);
+					last_mesh = NULL;
+					continue;
+				}
+				if (rc.mesh != last_mesh)
+					geometry_pool.addCommand(rc.mesh, instance_models.size(), 0, multidraw_commands);
+				multidraw_commands.back().instance_count++;
+				instance_models.push_back(rc.model);
+				last_mesh = rc.mesh;
+			}
+			i = end;
+			if (!instance_models.size())
+				continue;
+
+			geometry_pool.upload(multidraw_commands, instance_models);
+			multidraw_page = page;
+			draw(first.mesh, first.material, &instance_models[0], instance_models.size());
+			multidraw_page = -1;
+			continue;
+		}
+
+		//the sort key puts the calls with the same material and mesh together
+		int end = i + 1;
+		if (use_instancing)
+			while (end < render_order.size() && render_calls[render_order[end]].mesh == first.mesh && render_calls[render_order[end]].material == first.material)
+				end++;
+
+		instance_models.clear();
+		instance_calls.clear();
+		for (int j = i; j < end; ++j) {
+			int index = render_order[j];
+			RenderCall& rc = render_calls[index];
+			if (!isCallVisible(index, view) || (filter == STATIC_CALLS && !rc.is_static) || (filter == DYNAMIC_CALLS && rc.is_static))
+				continue;
+			instance_models.push_back(rc.model);
+			instance_calls.push_back(index);
+		}
+		i = end;
+
+		if (instance_models.size() > 1 && instance_models.size() >= min_instances) {
+			draw(first.mesh, first.material, &instance_models[0], instance_models.size());
+			num_instanced_draws++;
+			continue;
+		}
+		for (int j = 0; j < instance_models.size(); ++j) {
+			if (cullMeshlets(render_calls[instance_calls[j]], view)) {
+				if (!meshlet_counts.size())
+					continue;
+				meshlet_draw = true;
+			}
+			draw(first.mesh, first.material, &instance_models[j], 0);
+			meshlet_draw = false;
+		}
+	}
+}
+
+bool Renderer::cullMeshlets(RenderCall& rc, int view)
+{
+	Mesh* mesh = rc.mesh;
+	if (!use_meshlets || view < 0 || !mesh->meshlets.size())
+		return false;
+	Camera* camera = cull_views[view];
+	Matrix44 model = rc.model;
+
+	//the facing is tested in the space of the mesh, where the cones are (the side of a plane where a point is does not
+	//change with the transform), but a mirrored model swaps the faces that GL culls and two sided materials cull none
+	Vector3 right = model.rightVector();
+	Vector3 top = model.topVector();
+	Vector3 front = model.frontVector();
+	bool test_facing = !rc.material->two_sided && right.cross(top).dot(front) > 0.0f;
+	float scale = sqrt(std::max(right.dot(right), std::max(top.dot(top), front.dot(front))));
+	Matrix44 inverse_model = model;
+	inverse_model.inverse();
+	bool orthographic = camera->type == Camera::ORTHOGRAPHIC;
+	Vector3 eye = inverse_model * camera->eye;
+	Vector3 view_direction = inverse_model.rotateVector(camera->center - camera->eye);
+	view_direction.normalize();
+
+	meshlet_firsts.clear();
+	meshlet_counts.clear();
+	for (int i = 0; i < mesh->meshlets.size(); ++i) {
+		sMeshlet& meshlet = mesh->meshlets[i];
+		bool visible = camera->testSphereInFrustum(model * meshlet.center, meshlet.radius * scale) != CLIP_OUTSIDE;
+		//all the triangles face away when the camera is behind the plane of every one of them, the cone of the normals
+		//around the sphere is enough to know it (the same test than meshoptimizer)
+		if (visible && test_facing) {
+			if (orthographic)
+				visible = view_direction.dot(meshlet.cone_axis) < meshlet.cone_cutoff;
+			else {
+				Vector3 to_center = meshlet.center - eye;
+				visible = to_center.dot(meshlet.cone_axis) < meshlet.cone_cutoff * to_center.length() + meshlet.radius;
+			}
+		}
+		if (!visible) {
+			num_meshlets_culled++;
+			continue;
+		}
+		num_meshlets_drawn++;
+		if (meshlet_counts.size() && meshlet_firsts.back() + meshlet_counts.back() == meshlet.first_index)
+			meshlet_counts.back() += meshlet.num_indices;
+		else {
+			meshlet_firsts.push_back(meshlet.first_index);
+			meshlet_counts.push_back(meshlet.num_indices);
+		}
+	}
+	return true;
+}
+
+void Renderer::buildGPUBatches()
+{
+	gpu_batches.clear();
+	gpu_object_calls.clear();
+	gpu_culling.objects.clear();
+	gpu_culling.commands.clear();
+
+	//same groups than drawOpaqueCalls with multidraw, but with all the calls (the GPU decides which ones are visible)
+	for (int i = 0; i < render_order.size();) {
+		RenderCall& first = render_calls[render_order[i]];
+		if (first.material->alpha_mode == eAlphaMode::BLEND)
+			break;
+
+		int page = geometry_pool.getPage(first.mesh);
+		int end = i + 1;
+		if (page == -1) {
+			i = end;
+			continue;
+		}
+		while (end < render_order.size() && render_calls[render_order[end]].material == first.material && geometry_pool.getPage(render_calls[render_order[end]].mesh) == page)
+			end++;
+
+		sGPUBatch batch;
+		batch.material = first.material;
+		batch.mesh = first.mesh;
+		batch.page = page;
+		batch.first_command = gpu_culling.commands.size();
+		batch.first_object = gpu_culling.objects.size();
+
+		//every command has room for all the calls of its mesh, they are consecutive in render_order
+		Mesh* last_mesh = NULL;
+		for (int j = i; j < end; ++j) {
+			int index = render_order[j];
+			RenderCall& rc = render_calls[index];
+			if (rc.mesh != last_mesh)
+				geometry_pool.addCommand(rc.mesh, gpu_culling.objects.size(), 0, gpu_culling.commands);
+			last_mesh = rc.mesh;
+
+			GPUCulling::sObject object;
+			const BoundingBox& box = rc.world_bounding;
+			object.model = rc.model;
+			object.center.set(box.center.x, box.center.y, box.center.z, (float)(gpu_culling.commands.size() - 1));
+			object.halfsize.set(box.halfsize.x, box.halfsize.y, box.halfsize.z, 0.0f);
+			gpu_culling.objects.push_back(object);
+			gpu_object_calls.push_back(index);
+		}
+		batch.num_commands = gpu_culling.commands.size() - batch.first_command;
+		batch.num_objects = gpu_culling.objects.size() - batch.first_object;
+		gpu_batches.push_back(batch);
+		i = end;
+	}
+
+	gpu_culling.upload();
+}
+
+void Renderer::compareGPUCulling(int view)
+{
+	gpu_culling.readVisibility();
+	gpu_cull_visible = 0;
+	gpu_cull_occluded = 0;
+	gpu_cull_mismatches = 0;
+	for (int i = 0; i < gpu_object_calls.size(); ++i) {
+		uint32 flags = gpu_culling.visibility[i];
+		if (flags & GPUCulling::VISIBLE)
+			gpu_cull_visible++;
+		else if (flags & GPUCulling::IN_FRUSTUM)
+			gpu_cull_occluded++;
+		//only the frustum can be compared, the calls hidden by the CPU occlusion culling were in it
+		int call = gpu_object_calls[i];
+		bool cpu_visible = isCallVisible(call, view) || (use_occlusion_culling && occluded_calls[call]);
+		if (((flags & GPUCulling::IN_FRUSTUM) != 0) != cpu_visible)
+			gpu_cull_mismatches++;
+	}
+}
+
+void Renderer::cullOcclusion(Camera* camera, int view)
+{
+	int num_workers = parallel_gather ? num_gather_workers : 1;
+	occluded_calls.assign(render_calls.size(), 0);
+	num_occluded_calls = 0;
+	if (view < 0)
+		return;
+
+	//the opaque calls of the view that look bigger, if their mesh is cheap enough to rasterize
+	std::vector< std::pair<float, int> > candidates;
+	for (int i = 0; i < render_calls.size(); ++i) {
+		RenderCall& rc = render_calls[i];
+		if (!isCallVisible(i, view) || rc.material->alpha_mode != eAlphaMode::NO_ALPHA)
+			continue;
+		int num_triangles = OcclusionCulling::getNumTriangles(rc.mesh);
+		if (!num_triangles || num_triangles > max_occluder_triangles)
+			continue;
+		float distance = std::max(rc.world_bounding.center.distance(camera->eye), 0.001f);
+		float size = rc.world_bounding.halfsize.length() / distance;
+		if (size >= min_occluder_size)
+			candidates.push_back(std::make_pair(-size, i));
+	}
+	int num_occluders = std::min((int)candidates.size(), max_occluders);
+	std::partial_sort(candidates.begin(), candidates.begin() + num_occluders, candidates.end());
+
+	occluders.resize(num_occluders);
+	for (int i = 0; i < num_occluders; ++i) {
+		RenderCall& rc = render_calls[candidates[i].second];
+		occluders[i].mesh = rc.mesh;
+		occluders[i].model = rc.model;
+		occluded_calls[candidates[i].second] = -1; //marks the occluders while testing, they cannot hide themselves
+	}
+	occlusion_culling.render(camera->viewprojection_matrix, occluders, num_workers);
+
+	//every call has its own word of view_visibility and entry of occluded_calls, so the jobs never share them
+	double start_time = getPreciseTime();
+	uint32 view_bit = 1u << view;
+	std::vector<int> worker_occluded(std::max(num_workers, 1), 0);
+	if (num_occluders)
+		parallelFor(render_calls.size(), num_workers, [&](int worker, int start, int end) {
+			for (int i = start; i < end; ++i) {
+				if (!(view_visibility[i] & view_bit) || occluded_calls[i])
+					continue;
+				if (occlusion_culling.testBox(render_calls[i].world_bounding))
+					continue;
+				view_visibility[i] &= ~view_bit;
+				occluded_calls[i] = 1;
+				worker_occluded[worker]++;
+			}
+		});
+	for (int i = 0; i < num_occluders; ++i)
+		occluded_calls[candidates[i].second] = 0;
+	for (int i = 0; i < worker_occluded.size(); ++i)
+		num_occluded_calls += worker_occluded[i];
+	occlusion_test_time = (float)(getPreciseTime() - start_time);
+}
+
+void Renderer::benchmarkOcclusion(Camera* camera, int iterations)
+{
+	double start_time = getPreciseTime();
+	for (int it = 0; it < iterations; ++it)
+		occlusion_culling.render(camera->viewprojection_matrix, occluders, 1);
+	occlusion_single_time = (float)((getPreciseTime() - start_time) / iterations);
+
+	start_time = getPreciseTime();
+	for (int it = 0; it < iterations; ++it)
+		occlusion_culling.render(camera->viewprojection_matrix, occluders, num_gather_workers);
+	occlusion_parallel_time = (float)((getPreciseTime() - start_time) / iterations);
+}
+
+void Renderer::updateRenderBounds()
+{
+	if (!render_calls_changed && render_bounds.size == render_calls.size())
+		return;
+
+	render_bounds.resize(render_calls.size());
+	for (int i = 0; i < render_calls.size(); ++i)
+		render_bounds.set(i, render_calls[i].world_bounding);
+}
+
+void Renderer::benchmarkCulling(Camera* camera, int iterations)
+{
+	int num = render_calls.size();
+	std::vector<uint32> scalar_mask;
+	std::vector<uint32> batch_mask;
+
+	double start_time = getPreciseTime();
+	for (int it = 0; it < iterations; ++it) {
+		scalar_mask.assign((num + 31) / 32, 0);
+		for (int i = 0; i < num; ++i) {
+			RenderCall& rc = render_calls[i];
+			if (camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
+				scalar_mask[i >> 5] |= 1u << (i & 31);
+		}
+	}
+	culling_scalar_time = (float)((getPreciseTime() - start_time) / iterations);
+
+	start_time = getPreciseTime();
+	for (int it = 0; it < iterations; ++it)
+		camera->testBoxesInFrustum(render_bounds, batch_mask);
+	culling_batch_time = (float)((getPreciseTime() - start_time) / iterations);
+
+	std::vector<uint32> bvh_mask;
+	start_time = getPreciseTime();
+	for (int it = 0; it < iterations; ++it)
+		scene_bvh.cull(camera, bvh_mask);
+	culling_bvh_time = (float)((getPreciseTime() - start_time) / iterations);
+
+	//all must agree
+	culling_mismatches = 0;
+	for (int i = 0; i < num; ++i) {
+		bool visible = testMaskBit(scalar_mask, i);
+		if (visible != testMaskBit(batch_mask, i) || visible != testMaskBit(bvh_mask, i))
+			culling_mismatches++;
+	}
+}
+
+void Renderer::updateSceneBVH()
+{
+	//maintained even when not in use so it is ready when enabled
+	if (scene_bvh.items.size() != render_calls.size())
+		scene_bvh.build(render_bounds);
+	else if (render_calls_changed)
+		scene_bvh.refit(render_bounds);
+}
+
+int Renderer::addCullView(Camera* camera)
+{
+	if (cull_views.size() >= 32)
+		return -1;
+	cull_views.push_back(camera);
+	return cull_views.size() - 1;
+}
+
+void Renderer::cullViews()
+{
+	double start_time = getPreciseTime();
+	if (use_bvh)
+		scene_bvh.cullViews(cull_views.data(), cull_views.size(), view_visibility);
+	else
+		Camera::testBoxesInFrusta(render_bounds, &cull_views[0], cull_views.size(), view_visibility);
+	cull_views_time = (float)(getPreciseTime() - start_time);
+}
+
+//fills render_calls with the nodes of every prefab entity
+void Renderer::gatherRenderCalls(GTR::Scene* scene, Camera* camera)
+{
+	double start_time = getPreciseTime();
+
+	if (use_render_cache) {
+		int num_calls = num_cached_calls; //the HLOD proxies added after them are checked apart
+		updateRenderCache(scene, camera);
+		render_calls_changed = num_dirty_entities > 0 || num_calls != render_calls.size();
+		gather_time = (float)(getPreciseTime() - start_time);
+		return;
+	}
+
+	render_calls.clear();
+	render_calls_changed = true;
+	num_cached_calls = -1;
+
+	int num_entities = prefab_entities.size();
+	int num_workers = parallel_gather ? num_gather_workers : 1;
+	//not worth launching threads for a handful of prefabs
+	if (num_entities < num_workers * 4)
+		num_workers = 1;
+
+	if (num_workers <= 1) {
+		for (int i = 0; i < num_entities; ++i)
+			renderPrefab(prefab_entities[i]->model, prefab_entities[i]->prefab, camera, render_calls);
+	}
+	else {
+		if (worker_calls.size() < num_workers)
+			worker_calls.resize(num_workers);
+
+		//every worker gathers a contiguous range of entities in its own buffer
+		parallelFor(num_entities, num_workers, [&](int worker, int start, int end) {
+			std::vector<RenderCall>& calls = worker_calls[worker];
+			calls.clear();
+			for (int i = start; i < end; ++i)
+				renderPrefab(prefab_entities[i]->model, prefab_entities[i]->prefab, camera, calls);
+		});
+
+		//merge in worker order so the result is the same as the serial one
+		size_t total = 0;
+		for (int i = 0; i < num_workers; ++i)
+			total += worker_calls[i].size();
+		render_calls.reserve(total);
+		for (int i = 0; i < num_workers; ++i)
+			render_calls.insert(render_calls.end(), worker_calls[i].begin(), worker_calls[i].end());
+	}
+
+	gather_time = (float)(getPreciseTime() - start_time);
+}
+
+//compares the nodes with the snapshot (updating it), returns true if something changed
+static bool updateNodeSnapshot(GTR::Node* node, sPrefabRenderCache& cache, int& index)
+{
+	bool changed = false;
+	if (index >= cache.node_models.size()) {
+		cache.node_models.push_back(node->model);
+		cache.node_visible.push_back(node->visible);
+		changed = true;
+	}
+	else if (cache.node_visible[index] != (char)node->visible || memcmp(&cache.node_models[index], &node->model, sizeof(Matrix44)) != 0) {
+		cache.node_models[index] = node->model;
+		cache.node_visible[index] = node->visible;
+		changed = true;
+	}
+	index++;
+
+	for (int i = 0; i < node->children.size(); ++i)
+		changed |= updateNodeSnapshot(node->children[i], cache, index);
+	return changed;
+}
+
+int Renderer::updatePrefabCache(GTR::Prefab* prefab)
+{
+	sPrefabRenderCache& cache = prefab_caches[prefab];
+	if (cache.checked_frame == cache_frame)
+		return cache.revision;
+	cache.checked_frame = cache_frame;
+
+	int num_nodes = 0;
+	bool changed = updateNodeSnapshot(&prefab->root, cache, num_nodes);
+	if (num_nodes != cache.node_models.size()) {
+		cache.node_models.resize(num_nodes);
+		cache.node_visible.resize(num_nodes);
+		changed = true;
+	}
+	if (changed)
+		cache.revision++;
+	return cache.revision;
+}
+
+void Renderer::updateRenderCache(GTR::Scene* scene, Camera* camera)
+{
+	cache_frame++;
+
+	int num_entities = scene->entities.size();
+	bool resized = entity_caches.size() != num_entities;
+	if (resized)
+		entity_caches.resize(num_entities);
+
+	//find which entities changed since last frame
+	dirty_entities.clear();
+	for (int i = 0; i < num_entities; ++i) {
+		BaseEntity* ent = scene->entities[i];
+		sEntityRenderCache& cache = entity_caches[i];
+		GTR::Prefab* prefab = ent->entity_type == PREFAB ? ((GTR::PrefabEntity*)ent)->prefab : NULL;
+		//a hidden entity does not need its nodes checked, it is dirty anyway when shown again
+		int revision = prefab && ent->visible ? updatePrefabCache(prefab) : 0;
+		bool hlod = prefab && isInHLODProxy(ent);
+		bool impostor = prefab && ent->visible && !hlod && useImpostor(prefab, ent->model, camera);
+
+		if (cache.entity == ent && cache.prefab == prefab && cache.visible == ent->visible && cache.prefab_revision == revision &&
+			cache.impostor == impostor && cache.hlod == hlod && memcmp(&cache.model, &ent->model, sizeof(Matrix44)) == 0)
+			continue;
+
+		cache.entity = ent;
+		cache.prefab = prefab;
+		cache.visible = ent->visible;
+		cache.prefab_revision = revision;
+		cache.impostor = impostor;
+		cache.hlod = hlod;
+		cache.model = ent->model;
+		cache.changed_frame = cache_frame;
+		dirty_entities.push_back(i);
+	}
+	num_dirty_entities = dirty_entities.size();
+
+	//the prefabs of the entities deleted or hidden
+	for (std::map<GTR::Prefab*, sPrefabRenderCache>::iterator it = prefab_caches.begin(); it != prefab_caches.end();) {
+		if (it->second.checked_frame == cache_frame)
+			++it;
+		else
+			it = prefab_caches.erase(it);
+	}
+
+	//regather only the dirty ones, every entity has its own buffer so they can go in parallel
+	int num_workers = parallel_gather ? num_gather_workers : 1;
+	if (num_dirty_entities < num_workers * 4)
+		num_workers = 1;
+	parallelFor(num_dirty_entities, num_workers, [&](int worker, int start, int end) {
+		for (int i = start; i < end; ++i) {
+			sEntityRenderCache& cache = entity_caches[dirty_entities[i]];
+			cache.calls.clear();
+			if (cache.prefab && cache.visible && !cache.impostor && !cache.hlod)
+				renderPrefab(cache.model, cache.prefab, camera, cache.calls);
+			else
+				std::vector<RenderCall>().swap(cache.calls); //hidden or drawn by a proxy, nothing is kept
+		}
+	});
+
+	//static entities only need the camera dependant info refreshed
+	//with no entity gathered again the calls are in the same place than last frame, they are updated there
+	bool same_calls = num_dirty_entities == 0 && !resized && num_cached_calls != -1 && render_calls.size() >= num_cached_calls;
+	if (same_calls)
+		render_calls.resize(num_cached_calls); //without the ones added after the cache (the HLOD proxies)
+	else
+		render_calls.clear();
+	int index = 0;
+	for (int i = 0; i < num_entities; ++i) {
+		sEntityRenderCache& cache = entity_caches[i];
+		bool is_static = cache_frame - cache.changed_frame > static_frames;
+		if (cache.impostor)
+			impostors[cache.prefab]->models.push_back(cache.model);
+		if (is_static != cache.is_static)
+			static_calls_changed = true;
+		cache.is_static = is_static;
+		for (int j = 0; j < cache.calls.size(); ++j) {
+			//the level stays in the cache, so the hysteresis knows where it comes from
+			int lod = cache.calls[j].lod;
+			selectLOD(cache.calls[j], camera);
+			if (is_static && cache.calls[j].lod != lod)
+				static_calls_changed = true;
+			if (!same_calls)
+				render_calls.push_back(cache.calls[j]);
+			RenderCall& rc = render_calls[index++];
+			rc.mesh = cache.calls[j].mesh;
+			rc.lod = cache.calls[j].lod;
+			rc.is_static = is_static;
+			updateDistanceToCamera(rc, camera);
+		}
+	}
+	num_cached_calls = render_calls.size();
+}
+
 //renders all the prefab
 void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+{
+	renderPrefab(model, prefab, camera, render_calls);
+}
+
+void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall>& calls)
 {
 	assert(prefab && "PREFAB IS NULL");
 	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+	renderNode(model, &prefab->root, camera, calls);
 }
 
 //renders a node of the prefab and its children
-void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+void Renderer::renderNode(const Matrix44& parent_model, GTR::Node* node, Camera* camera, std::vector<RenderCall>& calls)
 {
 	if (!node->visible)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	//compute global matrix (without storing it in the node, prefabs are shared between entities)
+	Matrix44 node_model = node->model * parent_model;
 
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
@@ -558,24 +1442,297 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
 
 		RenderCall rc;
-		Vector3 nodepos = node_model.getTranslation();
 		rc.material = node->material;
 		rc.model = node_model;
 		rc.mesh = node->mesh;
+		rc.full_mesh = node->mesh;
 		rc.world_bounding = world_bounding;
-		rc.distance_to_camera = nodepos.distance(camera->eye);
-		if (node->material->alpha_mode == GTR::eAlphaMode::BLEND)
-			rc.distance_to_camera += INFINITE;
-		render_calls.push_back(rc);
+		selectLOD(rc, camera);
+		updateDistanceToCamera(rc, camera);
+		calls.push_back(rc);
 	}
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+		renderNode(node_model, node->children[i], camera, calls);
+}
+
+//the coarsest level whose error stays under lod_pixel_error, going finer as soon as the current one is over the limit
+//but coarser only when the next one is clearly under it, so the calls near a limit do not switch every frame
+void Renderer::selectLOD(RenderCall& rc, Camera* camera)
+{
+	Mesh* mesh = rc.full_mesh ? rc.full_mesh : rc.mesh;
+	int num_levels = use_lods ? mesh->lods.size() : 0;
+	int level = std::min(rc.lod, num_levels);
+	if (num_levels) {
+		//the errors are in mesh units, the growth of the bounds tells the scale of the model
+		float mesh_size = mesh->box.halfsize.length();
+		float scale = mesh_size > 0.0f ? rc.world_bounding.halfsize.length() / mesh_size : 1.0f;
+		float pixels = camera->getProjectedScale(rc.world_bounding.center, scale);
+		while (level > 0 && mesh->getLODError(level) * pixels > lod_pixel_error)
+			level--;
+		while (level < num_levels && mesh->getLODError(level + 1) * pixels <= lod_pixel_error * lod_hysteresis)
+			level++;
+	}
+	rc.lod = level;
+	rc.mesh = mesh->getLOD(level);
+}
+
+bool Renderer::useImpostor(GTR::Prefab* prefab, const Matrix44& model, Camera* camera)
+{
+	if (!use_impostors)
+		return false;
+	BoundingBox world_bounding = transformBoundingBox(model, prefab->bounding);
+	if (world_bounding.center.distance(camera->eye) < impostor_distance)
+		return false;
+	if (impostors.find(prefab) != impostors.end())
+		return true;
+	if (std::find(impostors_to_bake.begin(), impostors_to_bake.end(), prefab) == impostors_to_bake.end())
+		impostors_to_bake.push_back(prefab);
+	return false;
+}
+
+void Renderer::bakeImpostors()
+{
+	for (int i = 0; i < impostors_to_bake.size(); ++i)
+		getImpostor(impostors_to_bake[i]);
+	impostors_to_bake.clear();
+}
+
+//every frame renders the calls of the prefab (in the space of its entity, with the full meshes) to the gbuffers of the atlas
+Impostor* Renderer::getImpostor(GTR::Prefab* prefab)
+{
+	std::map<GTR::Prefab*, Impostor*>::iterator it = impostors.find(prefab);
+	if (it != impostors.end())
+		return it->second;
+
+	Impostor* impostor = new Impostor();
+	impostor->create(prefab->bounding, impostor_frames, impostor_size);
+	impostors[prefab] = impostor;
+
+	Camera camera;
+	impostor->setupFrameCamera(0, 0, &camera);
+	std::vector<RenderCall> calls;
+	renderPrefab(Matrix44(), prefab, &camera, calls);
+
+	impostor->bind();
+	for (int y = 0; y < impostor->frames; ++y)
+		for (int x = 0; x < impostor->frames; ++x) {
+			impostor->setupFrameCamera(x, y, &camera);
+			impostor->setFrame(x, y);
+			bakeCalls(calls, &camera);
+		}
+	impostor->unbind();
+	return impostor;
+}
+
+void Renderer::bakeCalls(const std::vector<RenderCall>& calls, Camera* camera)
+{
+	ePipelineSpace space = pipelineSpace;
+	pipelineSpace = LINEAR;
+	uploadCameraBlock(camera);
+	pipelineSpace = space;
+
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::depthMask(true);
+	for (int i = 0; i < calls.size(); ++i)
+		renderMeshWithMaterialToGBuffers(calls[i].model, calls[i].full_mesh, calls[i].material, camera);
+}
+
+void Renderer::renderImpostors(Camera* camera, bool to_gbuffers)
+{
+	Shader* shader = NULL;
+	Mesh* quad = Mesh::getQuad();
+	for (std::map<GTR::Prefab*, Impostor*>::iterator it = impostors.begin(); it != impostors.end(); ++it) {
+		Impostor* impostor = it->second;
+		instance_models.clear();
+		for (int i = 0; i < impostor->models.size(); ++i) {
+			BoundingBox world_bounding = transformBoundingBox(impostor->models[i], impostor->bounding);
+			if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) != CLIP_OUTSIDE)
+				instance_models.push_back(impostor->models[i]);
+		}
+		if (!instance_models.size())
+			continue;
+
+		if (!shader) {
+			shader = Shader::Get(to_gbuffers ? "impostor_gbuffers" : "impostor");
+			if (!shader)
+				return;
+			shader->enable();
+			if (!to_gbuffers) {
+				shader->setUniform(UNIFORM_ID("u_ambient_light"), GTR::Scene::instance->ambient_light);
+				uploadLightToShaderSinglepass(shader);
+			}
+			//the quads face the camera, the depth comes from the atlas
+			GLState::disable(GL_CULL_FACE);
+			GLState::disable(GL_BLEND);
+			GLState::enable(GL_DEPTH_TEST);
+			GLState::depthFunc(GL_LESS);
+			GLState::depthMask(true);
+		}
+
+		shader->setUniform(UNIFORM_ID("u_impostor_center"), impostor->center);
+		shader->setUniform(UNIFORM_ID("u_impostor_radius"), impostor->radius);
+		shader->setUniform(UNIFORM_ID("u_impostor_frames"), (float)impostor->frames);
+		shader->setUniform(UNIFORM_ID("u_albedo_texture"), impostor->fbo->color_textures[0], 0);
+		shader->setUniform(UNIFORM_ID("u_normal_texture"), impostor->fbo->color_textures[1], 1);
+		shader->setUniform(UNIFORM_ID("u_material_texture"), impostor->fbo->color_textures[2], 2);
+		shader->setUniform(UNIFORM_ID("u_depth_texture"), impostor->fbo->depth_texture, 3);
+		quad->renderInstanced(GL_TRIANGLES, &instance_models[0], instance_models.size());
+		num_impostor_draws++;
+		num_impostor_instances += instance_models.size();
+	}
+}
+
+void Renderer::buildHLOD(GTR::Scene* scene, Camera* camera)
+{
+	hlod.clear();
+	hlod_entities.clear();
+	hlod_models.clear();
+	hlod_entity_clusters.clear();
+	hlod_built = true;
+
+	//the opaque calls of every static entity, with the full meshes (the blended ones are lost in the proxies)
+	std::vector<BoundingBox> bounds;
+	std::vector< std::vector<RenderCall> > entity_calls;
+	std::vector< std::vector<HLOD::sPart> > parts;
+	for (int i = 0; i < scene->entities.size(); ++i) {
+		BaseEntity* ent = scene->entities[i];
+		if (ent->entity_type != PREFAB || !ent->visible || !((GTR::PrefabEntity*)ent)->prefab)
+			continue;
+		if (use_render_cache && (i >= entity_caches.size() || cache_frame - entity_caches[i].changed_frame <= static_frames))
+			continue;
+		GTR::Prefab* prefab = ((GTR::PrefabEntity*)ent)->prefab;
+
+		std::vector<RenderCall> calls;
+		renderPrefab(ent->model, prefab, camera, calls);
+		calls.erase(std::remove_if(calls.begin(), calls.end(), [](const RenderCall& rc) { return rc.material->alpha_mode == eAlphaMode::BLEND; }), calls.end());
+		if (!calls.size())
+			continue;
+
+		parts.push_back(std::vector<HLOD::sPart>(calls.size()));
+		for (int j = 0; j < calls.size(); ++j) {
+			parts.back()[j].mesh = calls[j].full_mesh;
+			parts.back()[j].model = calls[j].model;
+		}
+		entity_calls.push_back(calls);
+		bounds.push_back(transformBoundingBox(ent->model, prefab->bounding));
+		hlod_entities.push_back(ent);
+		hlod_models.push_back(ent->model);
+	}
+	hlod.build(bounds, parts, parallel_gather ? num_gather_workers : 1);
+
+	//the atlas of every cluster from the six axes
+	Camera axis_camera;
+	std::vector<RenderCall> calls;
+	for (int c = 0; c < hlod.clusters.size(); ++c) {
+		HLOD::sCluster& cluster = hlod.clusters[c];
+		calls.clear();
+		for (int i = 0; i < cluster.entities.size(); ++i) {
+			int entity = cluster.entities[i];
+			calls.insert(calls.end(), entity_calls[entity].begin(), entity_calls[entity].end());
+			if (cluster.level == 0) //the merged clusters are found from the parent of the cell
+				hlod_entity_clusters[hlod_entities[entity]] = c;
+		}
+		hlod.bind(cluster);
+		for (int axis = 0; axis < 6; ++axis) {
+			hlod.setupAxisCamera(cluster, axis, &axis_camera);
+			hlod.setTile(axis);
+			bakeCalls(calls, &axis_camera);
+		}
+		hlod.unbind(cluster);
+	}
+	hlod_active.assign(hlod.clusters.size(), 0);
+
+	std::cout << " + HLOD: " << hlod.clusters.size() << " clusters of " << hlod_entities.size() << " entities, " << hlod.num_source_triangles
+		<< " triangles in " << hlod.num_triangles << " (" << hlod.build_time << " ms)" << std::endl;
+}
+
+bool Renderer::updateHLOD(Camera* camera)
+{
+	std::vector<char> active(hlod.clusters.size(), 0);
+	for (int c = 0; c < hlod.clusters.size(); ++c) {
+		HLOD::sCluster& cluster = hlod.clusters[c];
+		if (cluster.level == 0) {
+			active[c] = use_hlod && cluster.bounding.center.distance(camera->eye) > hlod_distance;
+			//once an entity moves or is hidden the proxy is wrong, until it is built again
+			for (int i = 0; active[c] && i < cluster.entities.size(); ++i) {
+				int entity = cluster.entities[i];
+				active[c] = hlod_entities[entity]->visible && memcmp(&hlod_entities[entity]->model, &hlod_models[entity], sizeof(Matrix44)) == 0;
+			}
+			continue;
+		}
+
+		//the children come before, the merged proxy replaces them only when all of them are drawn as proxies
+		bool children_active = true;
+		for (int i = 0; i < cluster.children.size(); ++i)
+			children_active = children_active && active[cluster.children[i]];
+		if (!children_active)
+			continue;
+		//same rule than selectLOD, it only moves to the coarser level once the error is under the hysteresis of the limit
+		float pixels = camera->getProjectedScale(cluster.center, cluster.error);
+		active[c] = pixels <= (hlod_active[c] ? lod_pixel_error : lod_pixel_error * lod_hysteresis);
+		if (active[c])
+			for (int i = 0; i < cluster.children.size(); ++i)
+				active[cluster.children[i]] = 0;
+	}
+
+	bool changed = active != hlod_active;
+	hlod_active = active;
+	num_hlod_proxies = 0;
+	num_hlod_entities = 0;
+	for (int c = 0; c < hlod.clusters.size(); ++c)
+		if (hlod_active[c]) {
+			num_hlod_proxies++;
+			num_hlod_entities += hlod.clusters[c].entities.size();
+		}
+	return changed;
+}
+
+bool Renderer::isInHLODProxy(GTR::BaseEntity* entity)
+{
+	std::map<GTR::BaseEntity*, int>::iterator it = hlod_entity_clusters.find(entity);
+	if (it == hlod_entity_clusters.end())
+		return false;
+	//the cell or any of the merged clusters above it
+	for (int c = it->second; c != -1; c = hlod.clusters[c].parent)
+		if (hlod_active[c])
+			return true;
+	return false;
+}
+
+void Renderer::addHLODCalls(Camera* camera)
+{
+	for (int c = 0; c < hlod.clusters.size(); ++c) {
+		if (!hlod_active[c])
+			continue;
+		HLOD::sCluster& cluster = hlod.clusters[c];
+		RenderCall rc;
+		rc.material = cluster.material;
+		rc.mesh = cluster.mesh;
+		rc.full_mesh = cluster.mesh;
+		rc.model.setTranslation(cluster.center.x, cluster.center.y, cluster.center.z);
+		rc.world_bounding = transformBoundingBox(rc.model, cluster.mesh->box);
+		rc.is_static = true;
+		updateDistanceToCamera(rc, camera);
+		render_calls.push_back(rc);
+	}
+}
+
+void Renderer::drawMesh(Mesh* mesh, const Matrix44* instance_models, int num_instances)
+{
+	if (multidraw_page != -1)
+		geometry_pool.draw(multidraw_page, multidraw_first_command, multidraw_num_commands);
+	else if (meshlet_draw)
+		mesh->renderRanges(GL_TRIANGLES, &meshlet_firsts[0], &meshlet_counts[0], meshlet_counts.size());
+	else if (num_instances)
+		mesh->renderInstanced(GL_TRIANGLES, instance_models, num_instances);
+	else
+		mesh->render(GL_TRIANGLES);
 }
 
 //renders a mesh given its transform and material
-void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera) {
+void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models, int num_instances) {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
@@ -590,23 +1747,23 @@ void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh*
 
 	//select the blending
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND) {
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else {
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		glDisable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+		GLState::disable(GL_BLEND);
 	}
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//chose a shader
-	shader = Shader::Get("gbuffers");
+	shader = Shader::Get(num_instances ? "gbuffers_instanced" : "gbuffers");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -617,22 +1774,18 @@ void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh*
 
 	uploadUniformsAndTextures(shader, material, camera, model);
 
-	//Gamma mode
-	shader->setUniform("gamma_mode", (int)pipelineSpace);
-
 	//do the draw call that renders the mesh into the screen
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, instance_models, num_instances);
 
-	//disable shader
-	shader->disable();
+	//the shader stays enabled, the next draw with it does not need to bind it again
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
 }
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models, int num_instances)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -645,24 +1798,25 @@ void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mes
 
 	//select the blending
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND) {
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else {
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-		glDisable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
+		GLState::disable(GL_BLEND);
 	}
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//chose a shader
-	if (lightRender == MULTIPASS) shader = Shader::Get("multilight");
-	else shader = Shader::Get("singlelight");
+	if (lightRender == MULTIPASS) shader = Shader::Get(num_instances ? "multilight_instanced" : "multilight");
+	else if (lightRender == CLUSTERED) shader = Shader::Get(num_instances ? "clustered_instanced" : "clustered");
+	else shader = Shader::Get(num_instances ? "singlelight_instanced" : "singlelight");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -674,44 +1828,53 @@ void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mes
 	uploadUniformsAndTextures(shader, material, camera, model);
 
 	//Light
-	shader->setUniform("u_ambient_light", scene->ambient_light);
-	glDepthFunc(GL_LEQUAL);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	shader->setUniform(UNIFORM_ID("u_ambient_light"), scene->ambient_light);
+	//after the pre-pass only the fragments of the visible surface pass, and the depth is already there
+	bool after_prepass = depth_prepass_active && material->alpha_mode == eAlphaMode::NO_ALPHA;
+	GLState::depthFunc(after_prepass ? GL_EQUAL : GL_LEQUAL);
+	GLState::depthMask(!after_prepass);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
 	int num_lights = lights.size();
 
+	// Clustered, the shader only loops the lights of the cluster of every pixel
+	if (lightRender == CLUSTERED) {
+		uploadLightToShaderClustered(shader);
+		drawMesh(mesh, instance_models, num_instances);
+	}
+
 	// Multilight
-	if (!num_lights) {
-		shader->setUniform("u_light_color", Vector3());
-		mesh->render(GL_TRIANGLES);
+	else if (!num_lights) {
+		shader->setUniform(UNIFORM_ID("u_light_color"), Vector3());
+		drawMesh(mesh, instance_models, num_instances);
 	}
 	else if (lightRender == MULTIPASS) {
 		for (int i = 0; i < num_lights; ++i) {
 			if (i == 0) {
-				glDisable(GL_BLEND);
+				GLState::disable(GL_BLEND);
 				if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 				{
-					glEnable(GL_BLEND);
-					glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+					GLState::enable(GL_BLEND);
+					GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 				}
 				else {
-					glDisable(GL_BLEND);
+					GLState::disable(GL_BLEND);
 				}
 			}
 			else {
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+				GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-				glEnable(GL_BLEND);
+				GLState::enable(GL_BLEND);
 			}
 			LightEntity* light = lights[i];
 
 			uploadLightToShaderMultipass(light, shader);
 
 			//do the draw call that renders the mesh into the screen
-			mesh->render(GL_TRIANGLES);
+			drawMesh(mesh, instance_models, num_instances);
 
-			shader->setUniform("u_ambient_light", Vector3());
-			shader->setUniform("u_emissive_factor", Vector3());
+			shader->setUniform(UNIFORM_ID("u_ambient_light"), Vector3());
+			shader->setUniform(UNIFORM_ID("u_emissive_factor"), Vector3());
 		}
 	}
 
@@ -720,18 +1883,18 @@ void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mes
 		uploadLightToShaderSinglepass(shader);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh, instance_models, num_instances);
 
-		shader->setUniform("u_ambient_light", Vector3());
-		shader->setUniform("u_emissive_factor", Vector3());
+		shader->setUniform(UNIFORM_ID("u_ambient_light"), Vector3());
+		shader->setUniform(UNIFORM_ID("u_emissive_factor"), Vector3());
 	}
 
-	//disable shader
-	shader->disable();
+	//the shader stays enabled, the next draw with it does not need to bind it again
 
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
-	glDepthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+	GLState::depthMask(true);
 }
 
 Texture* GTR::CubemapFromHDRE(const char* filename)
@@ -761,7 +1924,34 @@ Texture* GTR::CubemapFromHDRE(const char* filename)
 	return texture;
 }
 
-void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+//only the depth, the shading pass comes later with GL_EQUAL (see use_depth_prepass)
+void Renderer::renderDepthPrepass(const Matrix44 model, Mesh* mesh, GTR::Material* material, const Matrix44* instance_models, int num_instances)
+{
+	if (!mesh || !mesh->getNumVertices() || !material)
+		return;
+
+	//the same faces than the shading pass
+	if (material->two_sided)
+		GLState::disable(GL_CULL_FACE);
+	else
+		GLState::enable(GL_CULL_FACE);
+
+	Shader* shader = Shader::Get(num_instances ? "depth_prepass_instanced" : "depth_prepass");
+	if (!shader)
+		return;
+	shader->enable();
+
+	//the camera is in its block
+	shader->setUniform(UNIFORM_ID("u_model"), model);
+
+	GLState::depthFunc(GL_LESS);
+	GLState::depthMask(true);
+	GLState::disable(GL_BLEND);
+
+	drawMesh(mesh, instance_models, num_instances);
+}
+
+void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models, int num_instances)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -774,13 +1964,13 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//chose a shader
-	shader = Shader::Get("flat");
+	shader = Shader::Get(num_instances ? "flat_instanced" : "flat");
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -789,52 +1979,107 @@ void Renderer::renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* m
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_model", model);
-
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	//upload uniforms, the camera is in its block
+	shader->setUniform(UNIFORM_ID("u_model"), model);
 
-	glDepthFunc(GL_LESS);
-	glDisable(GL_BLEND);
+	GLState::depthFunc(GL_LESS);
+	GLState::disable(GL_BLEND);
 
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, instance_models, num_instances);
 
-	//disable shader
-	shader->disable();
+	//the shader stays enabled, the next draw with it does not need to bind it again
 }
 
-void GTR::Renderer::generateShadowmap(LightEntity* light) {
-	if (!light->cast_shadows) {
-		if (light->fbo) {
-			delete light->fbo;
-			light->fbo = NULL;
-			light->shadowmap = NULL;
+void GTR::Renderer::allocateShadowTiles(Camera* camera) {
+	//the new atlas has none of the tiles of the caches
+	if (shadow_atlas.size != shadow_atlas_size) {
+		shadow_atlas.create(shadow_atlas_size);
+		clearShadowCaches();
+	}
+	shadow_atlas.reset();
+
+	//tile wanted by every shadowed light, halving it while the light covers less than half of it
+	//the index of a request is light * MAX_SHADOW_CASCADES + cascade
+	std::vector<sSortItem> requests;
+	for (int i = 0; i < lights.size(); i++) {
+		LightEntity* light = lights[i];
+		light->shadowmap = NULL;
+		light->num_cascades = 0;
+		if (!light->cast_shadows)
+			continue;
+
+		//cascades always cover the screen, they all get the same tile
+		if (light->light_type == eLightType::DIRECTIONAL && num_cascades > 0) {
+			sSortItem request;
+			request.key = cascade_tile_size;
+			for (int j = 0; j < num_cascades && j < MAX_SHADOW_CASCADES; ++j) {
+				request.index = i * MAX_SHADOW_CASCADES + j;
+				requests.push_back(request);
+			}
+			continue;
 		}
-		return;
+
+		float coverage = 1.0;
+		if (light->light_type != eLightType::DIRECTIONAL) {
+			Vector3 pos = light->model.getTranslation();
+			float radius = light->max_distance;
+			if (camera->testSphereInFrustum(pos, radius) == CLIP_OUTSIDE)
+				continue;
+			float distance = camera->eye.distance(pos);
+			if (distance > radius)
+				coverage = radius / (distance * tan(camera->fov * 0.5 * DEG2RAD));
+		}
+		coverage = clamp(coverage * light->shadow_importance, 0.0f, 1.0f);
+
+		float wanted = coverage * shadow_atlas.max_tile;
+		if (wanted < shadow_atlas.min_tile * 0.5) //too small to notice its shadows
+			continue;
+		int tile_size = shadow_atlas.max_tile;
+		while (tile_size > shadow_atlas.min_tile && tile_size * 0.5 >= wanted)
+			tile_size /= 2;
+
+		sSortItem request;
+		request.key = tile_size;
+		request.index = i * MAX_SHADOW_CASCADES;
+		requests.push_back(request);
+	}
+
+	//the atlas packs them biggest first, the ones that do not fit get smaller tiles or none
+	//(the sort is stable so the cascades of a light keep their order, and only the last ones can miss a tile)
+	std::stable_sort(requests.begin(), requests.end(), [](const sSortItem& a, const sSortItem& b) { return a.key > b.key; });
+	num_shadow_tiles = 0;
+	for (int i = 0; i < requests.size(); ++i) {
+		LightEntity* light = lights[requests[i].index / MAX_SHADOW_CASCADES];
+		int cascade = requests[i].index % MAX_SHADOW_CASCADES;
+		bool cascaded = light->light_type == eLightType::DIRECTIONAL && num_cascades > 0;
+		int tile_size = (int)requests[i].key;
+		if (cascaded && cascade != light->num_cascades) //a previous cascade did not fit
+			continue;
+		if (!shadow_atlas.allocate(tile_size, cascaded ? light->cascade_regions[cascade] : light->shadowmap_region))
+			continue;
+		if (cascaded)
+			light->num_cascades++;
+		light->shadowmap = shadow_atlas.depth_texture;
+		num_shadow_tiles++;
 	}
+}
 
-	if (!light->fbo) {
-		light->fbo = new FBO();
-		light->fbo->setDepthOnly(1024, 1024);
-		light->shadowmap = light->fbo->depth_texture;
+void GTR::Renderer::setupShadowCamera(LightEntity* light, Camera* view_camera) {
+	if (light->num_cascades) {
+		setupShadowCascades(light, view_camera);
+		return;
 	}
 
 	if (!light->light_camera)
 		light->light_camera = new Camera();
 
-	light->fbo->bind();
-
 	Camera* light_camera = light->light_camera;
-	Camera* view_camera = Camera::current;
 
 	float aspect = 1.0;
 
 	if (light->light_type == eLightType::SPOT) {
 		light_camera->setPerspective(light->cone_angle * 2, aspect, 0.1, light->max_distance);
 		light_camera->lookAt(light->model.getTranslation(), light->model * Vector3(0, 0, -1), light->model.rotateVector(Vector3(0, 1, 0)));
-		light_camera->enable();
 	}
 	else if (light->light_type == eLightType::DIRECTIONAL) {
 		//setup view
@@ -847,7 +2092,7 @@ void GTR::Renderer::generateShadowmap(LightEntity* light) {
 
 		//compute texel size in world units, where frustum size is the distance from left to right in the camera
 		float frustum_size = view_camera->left - view_camera->right;
-		float grid = frustum_size / (float)light->fbo->depth_texture->width;
+		float grid = frustum_size / (light->shadowmap_region.z * shadow_atlas.size);
 
 		//snap camera X,Y to that size in camera space assuming	the frustum is square, otherwise compute gridxand gridy
 		light_camera->view_matrix.M[3][0] = round(light_camera->view_matrix.M[3][0] / grid) * grid;
@@ -857,116 +2102,309 @@ void GTR::Renderer::generateShadowmap(LightEntity* light) {
 		//update viewproj matrix (be sure no one changes it)
 		light_camera->viewprojection_matrix = light_camera->view_matrix * light_camera->projection_matrix;
 
-		light_camera->enable();
+		//the frustum planes come from the snapped matrix
+		light_camera->extractFrustum();
 	}
+}
+
+//FNV-1a over what changes the depth written by a caster
+static const uint64 FNV_OFFSET = 14695981039346656037ULL;
+
+static uint64 hashBytes(uint64 hash, const void* data, int size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (int i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
 
-	glClear(GL_DEPTH_BUFFER_BIT);
+static uint64 hashCaster(uint64 hash, const RenderCall& rc)
+{
+	int ids[3] = { rc.mesh->m_Id, rc.material->m_Id, rc.material->two_sided };
+	float cutoff = rc.material->alpha_mode == eAlphaMode::MASK ? rc.material->alpha_cutoff : 0;
+	hash = hashBytes(hash, ids, sizeof(ids));
+	hash = hashBytes(hash, &cutoff, sizeof(cutoff));
+	return hashBytes(hash, rc.model.m, sizeof(rc.model.m));
+}
 
+//one ortographic camera per slice of the view frustum, each one fitted to the bounding sphere of its slice
+//(the sphere does not change when the view rotates, so the shadows do not shimmer)
+void GTR::Renderer::setupShadowCascades(LightEntity* light, Camera* view_camera) {
+	//corners of the view frustum in the near and far planes
+	Matrix44 inv_viewprojection = view_camera->viewprojection_matrix;
+	inv_viewprojection.inverse();
+	Vector3 near_corners[4];
+	Vector3 far_corners[4];
+	for (int i = 0; i < 4; ++i) {
+		float x = (i & 1) ? 1.0 : -1.0;
+		float y = (i & 2) ? 1.0 : -1.0;
+		Vector4 n = inv_viewprojection * Vector4(x, y, -1.0, 1.0);
+		Vector4 f = inv_viewprojection * Vector4(x, y, 1.0, 1.0);
+		near_corners[i].set(n.x / n.w, n.y / n.w, n.z / n.w);
+		far_corners[i].set(f.x / f.w, f.y / f.w, f.z / f.w);
+	}
+
+	//split distances, mixing uniform and logarithmic
+	float near_plane = view_camera->near_plane;
+	float far_plane = view_camera->far_plane;
+	float shadow_distance = min(far_plane, cascade_distance);
+	float splits[MAX_SHADOW_CASCADES + 1];
+	splits[0] = near_plane;
+	for (int i = 1; i <= light->num_cascades; ++i) {
+		float t = i / (float)light->num_cascades;
+		float log_split = near_plane * pow(shadow_distance / near_plane, t);
+		float uniform_split = near_plane + (shadow_distance - near_plane) * t;
+		splits[i] = cascade_lambda * log_split + (1.0 - cascade_lambda) * uniform_split;
+	}
+
+	Vector3 light_dir = light->model.rotateVector(Vector3(0, 0, 1));
+	light_dir.normalize();
+	Vector3 up = fabs(light_dir.y) > 0.99 ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+
+	for (int i = 0; i < light->num_cascades; ++i) {
+		if (!light->cascade_cameras[i])
+			light->cascade_cameras[i] = new Camera();
+		Camera* cascade_camera = light->cascade_cameras[i];
+
+		//the depth of the view grows linearly along the edges of the frustum
+		Vector3 corners[8];
+		Vector3 center;
+		for (int j = 0; j < 4; ++j) {
+			Vector3 edge = far_corners[j] - near_corners[j];
+			corners[j] = near_corners[j] + edge * ((splits[i] - near_plane) / (far_plane - near_plane));
+			corners[j + 4] = near_corners[j] + edge * ((splits[i + 1] - near_plane) / (far_plane - near_plane));
+			center = center + corners[j] + corners[j + 4];
+		}
+		center = center * (1.0 / 8.0);
+		float radius = 0.0;
+		for (int j = 0; j < 8; ++j)
+			radius = max(radius, (float)corners[j].distance(center));
+		radius = ceil(radius * 16.0) / 16.0;
+
+		//casters between the light and the slice must be inside too, so the camera starts half the light range away
+		float depth_range = light->max_distance;
+		cascade_camera->lookAt(center - light_dir * (depth_range * 0.5), center, up);
+		cascade_camera->setOrthographic(-radius, radius, -radius, radius, 0.1, depth_range);
+
+		//snap to the texels of its tile so the shadow edges do not swim when the view moves
+		float grid = (radius * 2.0) / (light->cascade_regions[i].z * shadow_atlas.size);
+		cascade_camera->view_matrix.M[3][0] = round(cascade_camera->view_matrix.M[3][0] / grid) * grid;
+		cascade_camera->view_matrix.M[3][1] = round(cascade_camera->view_matrix.M[3][1] / grid) * grid;
+		cascade_camera->viewprojection_matrix = cascade_camera->view_matrix * cascade_camera->projection_matrix;
+		cascade_camera->extractFrustum();
+	}
+}
+
+void GTR::Renderer::clearShadowCaches() {
+	for (std::map<Camera*, sShadowCache>::iterator it = shadow_caches.begin(); it != shadow_caches.end(); ++it)
+		delete it->second.static_fbo;
+	shadow_caches.clear();
+}
+
+void GTR::Renderer::generateShadowmap(Camera* light_camera, const Vector4& region, int view) {
+	Camera* view_camera = Camera::current;
+
+	//identify the dynamic casters seen by the light, the static ones only change with static_casters_version
+	uint64 dynamic_hash = FNV_OFFSET;
 	for (int i = 0; i < render_calls.size(); i++) {
 		RenderCall& rc = render_calls[i];
-		if (rc.material->alpha_mode == eAlphaMode::BLEND)
+		if (rc.is_static || rc.material->alpha_mode == eAlphaMode::BLEND || !isCallVisible(i, view))
 			continue;
-		if (light_camera->testBoxInFrustum(rc.world_bounding.center, rc.world_bounding.halfsize))
-			renderFlatMesh(rc.model, rc.mesh, rc.material, light_camera);
+		dynamic_hash = hashCaster(dynamic_hash, rc);
+	}
+
+	sShadowCache& cache = shadow_caches[light_camera];
+	cache.used = true;
+	bool light_changed = !cache.valid || memcmp(&cache.region, &region, sizeof(Vector4)) != 0 ||
+		memcmp(&cache.viewprojection, &light_camera->viewprojection_matrix, sizeof(Matrix44)) != 0;
+	bool static_changed = light_changed || cache.static_version != static_casters_version;
+	bool dynamic_changed = cache.dynamic_hash != dynamic_hash;
+
+	if (use_shadow_cache && !static_changed && !dynamic_changed) {
+		num_shadowmaps_cached++;
+		return;
+	}
+	num_shadowmaps_rendered++;
+	uploadCameraBlock(light_camera);
+
+	//the camera is not enabled, it would rebuild the view matrix and undo the texel snapping
+	if (!use_shadow_cache) {
+		cache.valid = false;
+		shadow_atlas.bindTile(region);
+		drawOpaqueCalls(view, ALL_CALLS, [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+			renderFlatMesh(models[0], mesh, material, light_camera, models, num_instances);
+		});
+		shadow_atlas.unbind();
+		view_camera->enable();
+		return;
+	}
+
+	//static casters go to their own map, only redrawn when the light or the static casters change
+	if (static_changed) {
+		int x, y, width, height;
+		shadow_atlas.getTileRect(region, x, y, width, height);
+		if (cache.static_fbo && (cache.static_fbo->depth_texture->width != width || cache.static_fbo->depth_texture->height != height)) {
+			delete cache.static_fbo;
+			cache.static_fbo = NULL;
+		}
+		if (!cache.static_fbo) {
+			cache.static_fbo = new FBO();
+			cache.static_fbo->setDepthOnly(width, height);
+		}
+
+		cache.static_fbo->bind();
+		GLState::enable(GL_DEPTH_TEST);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		drawOpaqueCalls(view, STATIC_CALLS, [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+			renderFlatMesh(models[0], mesh, material, light_camera, models, num_instances);
+		});
+		cache.static_fbo->unbind();
 	}
 
-	light->fbo->unbind();
+	//composite: start from the static depth and add the dynamic casters
+	shadow_atlas.bindTile(region);
+	cache.static_fbo->depth_texture->copyTo(NULL);
+	GLState::enable(GL_DEPTH_TEST);
+	drawOpaqueCalls(view, DYNAMIC_CALLS, [&](Mesh* mesh, Material* material, const Matrix44* models, int num_instances) {
+		renderFlatMesh(models[0], mesh, material, light_camera, models, num_instances);
+	});
+	shadow_atlas.unbind();
 	view_camera->enable();
+
+	cache.valid = true;
+	cache.region = region;
+	cache.viewprojection = light_camera->viewprojection_matrix;
+	cache.static_version = static_casters_version;
+	cache.dynamic_hash = dynamic_hash;
 }
 
 // Shader Multipass
 void GTR::Renderer::uploadLightToShaderMultipass(LightEntity* light, Shader* shader) {
-	shader->setUniform("u_light_color", light->color * light->intensity);
-	shader->setUniform("u_light_position", light->model * Vector3());
-	shader->setUniform("u_light_max_distance", light->max_distance);
-	shader->setUniform("u_light_type", (int)light->light_type);
+	shader->setUniform(UNIFORM_ID("u_light_color"), light->color * light->intensity);
+	shader->setUniform(UNIFORM_ID("u_light_position"), light->model * Vector3());
+	shader->setUniform(UNIFORM_ID("u_light_max_distance"), light->max_distance);
+	shader->setUniform(UNIFORM_ID("u_light_type"), (int)light->light_type);
 
-	shader->setUniform("u_light_direction", light->model.rotateVector(Vector3(0, 0, -1)));
+	shader->setUniform(UNIFORM_ID("u_light_direction"), light->model.rotateVector(Vector3(0, 0, -1)));
 
-	shader->setUniform("u_light_exp", light->cone_exp);
-	shader->setUniform("u_light_cosine_cutoff", (float)cos(light->cone_angle * DEG2RAD));
+	shader->setUniform(UNIFORM_ID("u_light_exp"), light->cone_exp);
+	shader->setUniform(UNIFORM_ID("u_light_cosine_cutoff"), (float)cos(light->cone_angle * DEG2RAD));
 
 	if (light->shadowmap && light->cast_shadows) {
-		shader->setUniform("u_light_cast_shadows_ml", light->cast_shadows);
-		shader->setUniform("u_light_shadowmap_ml", light->shadowmap, 8);
-		shader->setUniform("u_shadow_viewproj_ml", light->light_camera->viewprojection_matrix);
-		shader->setUniform("u_light_shadowbias_ml", light->shadow_bias);
+		shader->setUniform(UNIFORM_ID("u_light_cast_shadows_ml"), light->cast_shadows);
+		shader->setUniform(UNIFORM_ID("u_shadow_atlas"), light->shadowmap, 8);
+		if (!light->num_cascades) {
+			shader->setUniform(UNIFORM_ID("u_shadow_tile_ml"), light->shadowmap_region);
+			shader->setUniform(UNIFORM_ID("u_shadow_viewproj_ml"), light->light_camera->viewprojection_matrix);
+		}
+		shader->setUniform(UNIFORM_ID("u_light_shadowbias_ml"), light->shadow_bias);
 	}
 	else {
-		shader->setUniform("u_light_cast_shadows_ml", 0);
+		shader->setUniform(UNIFORM_ID("u_light_cast_shadows_ml"), 0);
 	}
+	uploadShadowCascades(light, shader);
 }
 
-// Shader Singlepass
+//sets the cascades of this light, or disables them if it does not have (the shaders keep them between lights)
+void GTR::Renderer::uploadShadowCascades(LightEntity* light, Shader* shader, int light_index) {
+	int cascades = light && light->shadowmap ? light->num_cascades : 0;
+	shader->setUniform(UNIFORM_ID("u_shadow_num_cascades"), cascades);
+	shader->setUniform(UNIFORM_ID("u_shadow_cascade_light"), light_index);
+	if (!cascades)
+		return;
+
+	Matrix44 viewprojections[MAX_SHADOW_CASCADES];
+	for (int i = 0; i < cascades; ++i)
+		viewprojections[i] = light->cascade_cameras[i]->viewprojection_matrix;
+	shader->setMatrix44Array(UNIFORM_ID("u_shadow_cascade_viewproj"), viewprojections, cascades);
+	shader->setUniform4Array(UNIFORM_ID("u_shadow_cascade_tile"), (float*)light->cascade_regions, cascades);
+}
+
+// Shader Singlepass, the lights are in their block (see uploadLightsBlock), only the shadowmaps are bound here
 void GTR::Renderer::uploadLightToShaderSinglepass(Shader* shader) {
-	const int MAX_LIGHTS = 5;
-	Vector3 light_position[MAX_LIGHTS];
-	Vector3 light_color[MAX_LIGHTS];
-	int light_type[MAX_LIGHTS];
-	float light_max_distance[MAX_LIGHTS];
-	Vector3 light_direction[MAX_LIGHTS];
-	float light_exp[MAX_LIGHTS];
-	float light_cosine_cutoff[MAX_LIGHTS];
-
-	int light_cast_shadows[MAX_LIGHTS];
-	Matrix44 shadow_viewproj[MAX_LIGHTS];
-	float light_shadowbias[MAX_LIGHTS];
-	Matrix44 empty;
+	if (shadow_atlas.depth_texture)
+		shader->setUniform(UNIFORM_ID("u_shadow_atlas"), shadow_atlas.depth_texture, 11);
+	int cascaded_light = lights_block_cascaded_light;
+	uploadShadowCascades(cascaded_light != -1 ? lights[cascaded_light] : NULL, shader, cascaded_light);
+}
 
-	int num_lights = lights.size();
-	int num_shadowmaps = 0;
+void GTR::Renderer::uploadCameraBlock(Camera* camera) {
+	sCameraBlock block = sCameraBlock();
+	block.viewprojection = camera->viewprojection_matrix;
+	block.camera_position = camera->eye;
+	block.time = getTime();
+	block.gamma_mode = (int)pipelineSpace;
+	camera_block.upload(&block);
+}
 
-	for (int i = 0; i < MAX_LIGHTS; ++i) {
-		if (i < num_lights) {
-			LightEntity* light = lights[i];
+void GTR::Renderer::uploadLightsBlock() {
+	sLightsBlock block = sLightsBlock(); //value-initialized, the shaders never read the slots of the unused lights
+	block.num_lights = std::min((int)lights.size(), MAX_BLOCK_LIGHTS);
+	lights_block_cascaded_light = -1; //only one light can use cascades
 
-			light_position[i] = light->model * Vector3();
-			light_color[i] = light->color * light->intensity;
-			light_type[i] = light->light_type;
-			light_max_distance[i] = light->max_distance;
-			light_direction[i] = light->model.rotateVector(Vector3(0, 0, -1));
-			light_exp[i] = light->cone_exp;
-			light_cosine_cutoff[i] = cos(light->cone_angle * DEG2RAD);
-
-			light_cast_shadows[i] = (int)light->cast_shadows;
-			if (light->cast_shadows && light->light_camera) {
-				shadow_viewproj[i] = light->light_camera->viewprojection_matrix;
-				light_shadowbias[i] = light->shadow_bias;
-
-				if (light->light_type == SPOT)
-					shader->setUniform("u_light_shadowmap[0]", light->shadowmap, 11);
-				else if (light->light_type == DIRECTIONAL)
-					shader->setUniform("u_light_shadowmap[3]", light->shadowmap, 12);
-			}
-			else {
-				shadow_viewproj[i] = empty;
-				light_shadowbias[i] = NULL;
-			}
+	for (int i = 0; i < block.num_lights; ++i) {
+		LightEntity* light = lights[i];
+		Vector3 position = light->model * Vector3();
+		Vector3 color = light->color * light->intensity;
+		Vector3 direction = light->model.rotateVector(Vector3(0, 0, -1));
+		block.position[i].set(position.x, position.y, position.z, light->max_distance);
+		block.color[i].set(color.x, color.y, color.z, (float)light->light_type);
+		block.direction[i].set(direction.x, direction.y, direction.z, cos(light->cone_angle * DEG2RAD));
+
+		bool cast_shadows = light->cast_shadows && light->shadowmap;
+		if (cast_shadows && light->num_cascades) {
+			if (lights_block_cascaded_light == -1) //the uniforms only fit one
+				lights_block_cascaded_light = i;
+			else
+				cast_shadows = false;
+		}
+		block.params[i].set(light->cone_exp, cast_shadows ? 1.0f : 0.0f, light->shadow_bias, 0.0f);
+
+		//cascades have their own uniforms, see uploadShadowCascades
+		if (cast_shadows && !light->num_cascades) {
+			block.shadow_tile[i] = light->shadowmap_region;
+			block.shadow_viewproj[i] = light->light_camera->viewprojection_matrix;
 		}
 	}
 
-	shader->setUniform3Array("u_light_color", (float*)&light_color, num_lights);
-	shader->setUniform3Array("u_light_position", (float*)&light_position, num_lights);
-	shader->setUniform3Array("u_light_direction", (float*)&light_direction, num_lights);
-	shader->setUniform("u_num_lights", num_lights);
+	lights_block.upload(&block);
+}
+
+//consecutive draws of the same material (or an identical one) keep the block uploaded
+void GTR::Renderer::uploadMaterialBlock(GTR::Material* material) {
+	GTR::Scene* scene = GTR::Scene::instance;
+	sMaterialBlock block = sMaterialBlock();
+	block.color = material->color;
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	block.alpha_cutoff = material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0;
+	if (scene->occlussion) {
+		block.metallic_factor = material->metallic_factor;
+		block.roughness_factor = material->roughness_factor;
+	}
+	block.has_normal = scene->normal && material->normal_texture.texture ? 1 : 0;
 
-	shader->setUniform1Array("u_light_max_distance", (float*)&light_max_distance, num_lights);
-	shader->setUniform1Array("u_light_type", (int*)&light_type, num_lights);
-	shader->setUniform1Array("u_light_exp", (float*)&light_exp, num_lights);
-	shader->setUniform1Array("u_light_cosine_cutoff", (float*)&light_cosine_cutoff, num_lights);
+	if (memcmp(&block, &last_material_block, sizeof(block)) == 0)
+		return;
+	material_block.upload(&block);
+	last_material_block = block;
+}
 
-	shader->setUniform1Array("u_light_cast_shadows", (int*)&light_cast_shadows, num_lights);
-	shader->setMatrix44Array("u_shadow_viewproj", shadow_viewproj, num_lights);
-	shader->setUniform1Array("u_light_shadowbias", (float*)&light_shadowbias, num_lights);
+// Shader Clustered
+void GTR::Renderer::uploadLightToShaderClustered(Shader* shader) {
+	light_clusters.upload(shader, 12);
+	if (shadow_atlas.depth_texture)
+		shader->setUniform(UNIFORM_ID("u_shadow_atlas"), shadow_atlas.depth_texture, 11);
+	int cascaded_light = light_clusters.cascaded_light;
+	uploadShadowCascades(cascaded_light != -1 ? light_clusters.lights[cascaded_light] : NULL, shader, cascaded_light);
 }
 
 // Shader Deferred
 void GTR::Renderer::uploadLightToShaderDeferred(Shader* shader, Matrix44 inv_vp, int width, int height, Camera* camera) {
-	shader->setUniform("u_gb0_texture", gbuffers_fbo->color_textures[0], 0);
-	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 1);
-	shader->setUniform("u_gb2_texture", gbuffers_fbo->color_textures[2], 2);
-	shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 3);
-	shader->setUniform("u_ssao_texture", ssao_fbo->color_textures[0], 4);
+	shader->setUniform("u_gb0_texture", render_graph.getTexture(deferred_gbuffers[0]), 0);
+	shader->setUniform("u_gb1_texture", render_graph.getTexture(deferred_gbuffers[1]), 1);
+	shader->setUniform("u_gb2_texture", render_graph.getTexture(deferred_gbuffers[2]), 2);
+	shader->setUniform("u_depth_texture", render_graph.getTexture(deferred_depth), 3);
+	shader->setUniform("u_ssao_texture", render_graph.getTexture(deferred_ssao), 4);
 
 	shader->setUniform("u_inverse_viewprojection", inv_vp);
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
@@ -988,14 +2426,9 @@ void GTR::Renderer::uploadUniformsAndTextures(Shader* shader, GTR::Material* mat
 	if (texture == NULL)
 		texture = Texture::getWhiteTexture(); //a 1x1 white texture
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
-	float t = getTime();
-	shader->setUniform("u_time", t);
-
-	shader->setUniform("u_color", material->color);
+	//upload uniforms, the camera and the factors of the material go in their blocks
+	shader->setUniform(UNIFORM_ID("u_model"), model);
+	uploadMaterialBlock(material);
 
 	//Textures
 	texture = material->color_texture.texture;
@@ -1006,38 +2439,30 @@ void GTR::Renderer::uploadUniformsAndTextures(Shader* shader, GTR::Material* mat
 	if (scene->occlussion) {
 		occlusion_texture = material->occlusion_texture.texture;
 		metallic_texture = material->metallic_roughness_texture.texture;
-		shader->setUniform("u_metallic_factor", material->metallic_factor);
-		shader->setUniform("u_roughness_factor", material->roughness_factor);
 	}
 	if (scene->normal)
 		normal_texture = material->normal_texture.texture;
 
 	if (texture)
-		shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(UNIFORM_ID("u_texture"), texture, 0);
 	if (emissive_texture) {
-		shader->setUniform("u_emissive_texture", emissive_texture, 1);
-		shader->setUniform("u_emissive_factor", emissive_factor);
+		shader->setUniform(UNIFORM_ID("u_emissive_texture"), emissive_texture, 1);
+		shader->setUniform(UNIFORM_ID("u_emissive_factor"), emissive_factor);
 	}
 	else {
-		shader->setUniform("u_emissive_factor", emissive_factor);
+		shader->setUniform(UNIFORM_ID("u_emissive_factor"), emissive_factor);
 	}
 	if (occlusion_texture)
-		shader->setUniform("u_occlusion_texture", occlusion_texture, 2);
+		shader->setUniform(UNIFORM_ID("u_occlusion_texture"), occlusion_texture, 2);
 	else
-		shader->setUniform("u_occlusion_texture", Texture::getWhiteTexture(), 2);
+		shader->setUniform(UNIFORM_ID("u_occlusion_texture"), Texture::getWhiteTexture(), 2);
 	if (metallic_texture)
-		shader->setUniform("u_metallic_texture", metallic_texture, 3);
+		shader->setUniform(UNIFORM_ID("u_metallic_texture"), metallic_texture, 3);
 	else
-		shader->setUniform("u_metallic_texture", Texture::getWhiteTexture(), 3);
-
-	if (normal_texture) {
-		shader->setUniform("has_normal", 1);
-		shader->setUniform("u_normal_texture", normal_texture, 4);
-	}
-	else shader->setUniform("has_normal", 0);
+		shader->setUniform(UNIFORM_ID("u_metallic_texture"), Texture::getWhiteTexture(), 3);
 
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	if (normal_texture)
+		shader->setUniform(UNIFORM_ID("u_normal_texture"), normal_texture, 4);
 
 	if (!is_rendering_reflections && reflection_probes.size() > 0) {
 		sReflectionProbe* rprobe = reflection_probes[0];
@@ -1049,14 +2474,14 @@ void GTR::Renderer::uploadUniformsAndTextures(Shader* shader, GTR::Material* mat
 			}
 		}
 		if (!rprobe->cubemap)
-			shader->setUniform("is_reflection", 0);
+			shader->setUniform(UNIFORM_ID("is_reflection"), 0);
 		else {
-			shader->setUniform("is_reflection", show_reflections);
-			shader->setUniform("u_reflection_texture", rprobe->cubemap, 10);
+			shader->setUniform(UNIFORM_ID("is_reflection"), show_reflections);
+			shader->setUniform(UNIFORM_ID("u_reflection_texture"), rprobe->cubemap, 10);
 		}
 	}
 	else {
-		shader->setUniform("is_reflection", 0);
+		shader->setUniform(UNIFORM_ID("is_reflection"), 0);
 	}
 }
 
@@ -1188,9 +2613,9 @@ void GTR::Renderer::renderProbe(Vector3 pos, float size, float* coeffs) {
 	Shader* shader = Shader::Get("probe");
 	Mesh* mesh = Mesh::Get("data/meshes/sphere.obj", false);
 
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
 
 	Matrix44 model;
 	model.setTranslation(pos.x, pos.y, pos.z);
@@ -1207,28 +2632,37 @@ void GTR::Renderer::renderProbe(Vector3 pos, float size, float* coeffs) {
 
 void GTR::Renderer::captureProbe(sProbe& probe, GTR::Scene* scene) {
 	FloatImage images[6]; //here we will store the six views
-	Camera camera;
+	Camera cameras[6];
 
 	if (irradiance_fbo == NULL) {
 		irradiance_fbo = new FBO();
 		irradiance_fbo->create(64, 64, 1, GL_RGB, GL_FLOAT);
 	}
-	//set the fov to 90 and the aspect to 1
-	camera.setPerspective(90, 1, 0.1, 1000);
 
-	for (int i = 0; i < 6; ++i) //for every cubemap face
+	//the six faces are culled together
+	cull_views.clear();
+	for (int i = 0; i < 6; ++i)
 	{
+		//set the fov to 90 and the aspect to 1
+		cameras[i].setPerspective(90, 1, 0.1, 1000);
+
 		//compute camera orientation using defined vectors
 		Vector3 eye = probe.pos;
 		Vector3 front = cubemapFaceNormals[i][2];
 		Vector3 center = probe.pos + front;
 		Vector3 up = cubemapFaceNormals[i][1];
-		camera.lookAt(eye, center, up);
-		camera.enable();
+		cameras[i].lookAt(eye, center, up);
+		addCullView(&cameras[i]);
+	}
+	cullViews();
+
+	for (int i = 0; i < 6; ++i) //for every cubemap face
+	{
+		cameras[i].enable();
 
 		//render the scene from this point of view
 		irradiance_fbo->bind();
-		renderForward(&camera, scene);
+		renderForward(&cameras[i], scene, i);
 		irradiance_fbo->unbind();
 
 		//read the pixels back and store in a FloatImage
@@ -1246,8 +2680,8 @@ void GTR::Renderer::renderReflectionProbes(GTR::Scene* scene, Camera* camera) {
 	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
 	shader->setUniform("u_camera_position", camera->eye);
 	Matrix44 model;
-	glEnable(GL_CULL_FACE);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
 	for (int i = 0; i < reflection_probes.size(); i++) {
 		sReflectionProbe* probe = reflection_probes[i];
 		if (!probe->cubemap)
@@ -1273,128 +2707,155 @@ void GTR::Renderer::updateReflectionProbes(GTR::Scene* scene) {
 }
 
 void GTR::Renderer::captureReflectionProbe(GTR::Scene* scene, Texture* tex, Vector3 pos) {
-	Camera camera;
+	Camera cameras[6];
 
+	//the six faces are culled together
+	cull_views.clear();
 	for (int i = 0; i < 6; i++) {
-		reflection_probe_fbo->setTexture(tex, i);
-		camera.setPerspective(90, 1, 0.1, 1000);
+		cameras[i].setPerspective(90, 1, 0.1, 1000);
 		Vector3 eye = pos;
 		Vector3 center = pos + cubemapFaceNormals[i][2];
 		Vector3 up = cubemapFaceNormals[i][1];
-		camera.lookAt(eye, center, up);
-		camera.enable();
+		cameras[i].lookAt(eye, center, up);
+		addCullView(&cameras[i]);
+	}
+	cullViews();
+
+	for (int i = 0; i < 6; i++) {
+		reflection_probe_fbo->setTexture(tex, i);
+		cameras[i].enable();
 		reflection_probe_fbo->bind();
 		is_rendering_reflections = true;
-		renderForward(&camera, scene);
+		renderForward(&cameras[i], scene, i);
 		is_rendering_reflections = false;
 		reflection_probe_fbo->unbind();
 	}
-	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	GLState::enable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 	tex->generateMipmaps();
 }
 
-void GTR::Renderer::applyfx(Texture* color, Texture* depth, Camera* camera) {
-	Texture* current_texture = color;
+void GTR::Renderer::applyfx(int color, int depth, Camera* camera) {
+	int current = color;
 	int width = Application::instance->window_width;
 	int height = Application::instance->window_height;
 	Matrix44 inv_vp = camera->viewprojection_matrix;
 	inv_vp.inverse();
 
+	//every step writes a new texture, the graph makes them go back and forth between two of the pool
+	//(the passes run after this returns, they capture everything by value)
+
 	//Depth of Field
 	if (show_DoF) {
 		//Blur
-		FBO* blur_fbo;
-		Shader* blur_shader;
-		for (int i = 0; i < 16; i++) {
-			blur_fbo = Texture::getGlobalFBO(postFX_textureA);
-			blur_fbo->bind();
-			blur_shader = Shader::Get("blurredof");
-			blur_shader->enable();
-			blur_shader->setUniform("u_offset", vec2(pow(1.0f, i) / current_texture->width, 0.0) * deb_fac);
-			blur_shader->setUniform("u_intensity", 1.0f);
-			current_texture->toViewport(blur_shader);
-			blur_shader->disable();
-			blur_fbo->unbind();
-
-			blur_fbo = Texture::getGlobalFBO(blur);
-			blur_fbo->bind();
-			blur_shader = Shader::Get("blurredof");
-			blur_shader->enable();
-			blur_shader->setUniform("u_offset", vec2(0.0, pow(1.0f, i) / current_texture->height) * deb_fac);
-			blur_shader->setUniform("u_intensity", 1.0f);
-			postFX_textureA->toViewport(blur_shader);
-			blur_shader->disable();
-			blur_fbo->unbind();
-			current_texture = blur;
-		}
-		current_texture = color;
+		int blur_horizontal = render_graph.createTexture("dof blur horizontal", width, height, GL_RGB, GL_FLOAT);
+		int blur = render_graph.createTexture("dof blur", width, height, GL_RGB, GL_FLOAT);
+		render_graph.addPass("dof blur", { color }, { blur_horizontal, blur }, [=]() {
+			Texture* current_texture = render_graph.getTexture(color);
+			Texture* horizontal_texture = render_graph.getTexture(blur_horizontal);
+			Texture* blur_texture = render_graph.getTexture(blur);
+			FBO* blur_fbo;
+			Shader* blur_shader;
+			for (int i = 0; i < 16; i++) {
+				blur_fbo = Texture::getGlobalFBO(horizontal_texture);
+				blur_fbo->bind();
+				blur_shader = Shader::Get("blurredof");
+				blur_shader->enable();
+				blur_shader->setUniform("u_offset", vec2(pow(1.0f, i) / current_texture->width, 0.0) * deb_fac);
+				blur_shader->setUniform("u_intensity", 1.0f);
+				current_texture->toViewport(blur_shader);
+				blur_shader->disable();
+				blur_fbo->unbind();
+
+				blur_fbo = Texture::getGlobalFBO(blur_texture);
+				blur_fbo->bind();
+				blur_shader = Shader::Get("blurredof");
+				blur_shader->enable();
+				blur_shader->setUniform("u_offset", vec2(0.0, pow(1.0f, i) / current_texture->height) * deb_fac);
+				blur_shader->setUniform("u_intensity", 1.0f);
+				horizontal_texture->toViewport(blur_shader);
+				blur_shader->disable();
+				blur_fbo->unbind();
+				current_texture = blur_texture;
+			}
+		});
 
 		//Depth of Field
-		FBO* dof_fbo = Texture::getGlobalFBO(postFX_textureA);
-		dof_fbo->bind();
-		Shader* dof_shader = Shader::Get("depth_of_field");
-		dof_shader->enable();
-		dof_shader->setUniform("u_outoffocus_texture", blur, 2);
-		dof_shader->setUniform("u_depth_texture", depth, 3);
-		dof_shader->setUniform("u_inverse_viewprojection", inv_vp);
-		dof_shader->setUniform("minDistance", minDist);
-		dof_shader->setUniform("maxDistance", maxDist);
-		current_texture->toViewport(dof_shader);
-		dof_shader->disable();
-		dof_fbo->unbind();
-		current_texture = postFX_textureA;
-		swap(postFX_textureA, postFX_textureB);
+		int dof = render_graph.createTexture("dof", width, height, GL_RGB, GL_FLOAT);
+		render_graph.addPass("dof", { current, blur, depth }, { dof }, [=]() {
+			FBO* dof_fbo = render_graph.getFBO({ dof });
+			dof_fbo->bind();
+			Shader* dof_shader = Shader::Get("depth_of_field");
+			dof_shader->enable();
+			dof_shader->setUniform("u_outoffocus_texture", render_graph.getTexture(blur), 2);
+			dof_shader->setUniform("u_depth_texture", render_graph.getTexture(depth), 3);
+			dof_shader->setUniform("u_inverse_viewprojection", inv_vp);
+			dof_shader->setUniform("minDistance", minDist);
+			dof_shader->setUniform("maxDistance", maxDist);
+			render_graph.getTexture(current)->toViewport(dof_shader);
+			dof_shader->disable();
+			dof_fbo->unbind();
+		});
+		current = dof;
 	}
 
 	//Chromatic aberration and lens distortion
 	if (show_chrab_lensdist) {
-		FBO* ch_fbo = Texture::getGlobalFBO(postFX_textureA);
-		ch_fbo->bind();
-		Shader* ch_shader = Shader::Get("chrlen");
-		ch_shader->enable();
-		ch_shader->setUniform("resolution", Vector2((float)width, (float)height));
-		current_texture->toViewport(ch_shader);
-		ch_shader->disable();
-		ch_fbo->unbind();
-		current_texture = postFX_textureA;
-		swap(postFX_textureA, postFX_textureB);
+		int chromatic = render_graph.createTexture("chromatic aberration", width, height, GL_RGB, GL_FLOAT);
+		render_graph.addPass("chromatic aberration", { current }, { chromatic }, [=]() {
+			FBO* ch_fbo = render_graph.getFBO({ chromatic });
+			ch_fbo->bind();
+			Shader* ch_shader = Shader::Get("chrlen");
+			ch_shader->enable();
+			ch_shader->setUniform("resolution", Vector2((float)width, (float)height));
+			render_graph.getTexture(current)->toViewport(ch_shader);
+			ch_shader->disable();
+			ch_fbo->unbind();
+		});
+		current = chromatic;
 	}
 
 	//Motion blur
 	if (show_motblur) {
-		FBO* mot_fbo = Texture::getGlobalFBO(postFX_textureA);
-		mot_fbo->bind();
-		Shader* mot_shader = Shader::Get("motionblur");
-		mot_shader->enable();
-		mot_shader->setUniform("u_depth_texture", depth, 1);
-		mot_shader->setUniform("u_inverse_viewprojection", inv_vp);
-		mot_shader->setUniform("u_viewprojection_old", viewproj_old);
-		current_texture->toViewport(mot_shader);
-		mot_shader->disable();
-		mot_fbo->unbind();
-		current_texture = postFX_textureA;
-		swap(postFX_textureA, postFX_textureB);
+		int motion_blur = render_graph.createTexture("motion blur", width, height, GL_RGB, GL_FLOAT);
+		Matrix44 viewprojection_old = viewproj_old;
+		render_graph.addPass("motion blur", { current, depth }, { motion_blur }, [=]() {
+			FBO* mot_fbo = render_graph.getFBO({ motion_blur });
+			mot_fbo->bind();
+			Shader* mot_shader = Shader::Get("motionblur");
+			mot_shader->enable();
+			mot_shader->setUniform("u_depth_texture", render_graph.getTexture(depth), 1);
+			mot_shader->setUniform("u_inverse_viewprojection", inv_vp);
+			mot_shader->setUniform("u_viewprojection_old", viewprojection_old);
+			render_graph.getTexture(current)->toViewport(mot_shader);
+			mot_shader->disable();
+			mot_fbo->unbind();
+		});
+		current = motion_blur;
 		viewproj_old = camera->viewprojection_matrix;
 	}
 
 	//Antialiasing
 	if (show_antial) {
-		FBO* al_fbo = Texture::getGlobalFBO(postFX_textureA);
-		al_fbo->bind();
-		Shader* al_shader = Shader::Get("antialiasing");
-		al_shader->enable();
-		al_shader->setUniform("u_viewportSize", Vector2((float)width, (float)height));
-		al_shader->setUniform("u_iViewportSize", Vector2(1.0 / (float)width, 1.0 / (float)height));
-		current_texture->toViewport(al_shader);
-		al_shader->disable();
-		al_fbo->unbind();
-		current_texture = postFX_textureA;
-		swap(postFX_textureA, postFX_textureB);
+		int antialiasing = render_graph.createTexture("antialiasing", width, height, GL_RGB, GL_FLOAT);
+		render_graph.addPass("antialiasing", { current }, { antialiasing }, [=]() {
+			FBO* al_fbo = render_graph.getFBO({ antialiasing });
+			al_fbo->bind();
+			Shader* al_shader = Shader::Get("antialiasing");
+			al_shader->enable();
+			al_shader->setUniform("u_viewportSize", Vector2((float)width, (float)height));
+			al_shader->setUniform("u_iViewportSize", Vector2(1.0 / (float)width, 1.0 / (float)height));
+			render_graph.getTexture(current)->toViewport(al_shader);
+			al_shader->disable();
+			al_fbo->unbind();
+		});
+		current = antialiasing;
 	}
 
 	//Tonemapper
-	glDisable(GL_BLEND);
-	Shader* shader_tm = Shader::Get("tonemapper");
-	shader_tm->enable();
-	current_texture->toViewport(shader_tm);
+	render_graph.addPass("tonemapper", { current }, {}, [=]() {
+		GLState::disable(GL_BLEND);
+		Shader* shader_tm = Shader::Get("tonemapper");
+		shader_tm->enable();
+		render_graph.getTexture(current)->toViewport(shader_tm);
+	}, true);
 }
\ No newline at end of file
@@ -2,6 +2,19 @@
 #include "prefab.h"
 #include "sphericalharmonics.h"
 #include "mesh.h"
+#include "utils.h"
+#include "bvh.h"
+#include "shadowatlas.h"
+#include "lightclusters.h"
+#include "uniformbuffer.h"
+#include "geometrypool.h"
+#include "gpuculling.h"
+#include "occlusionculling.h"
+#include "impostor.h"
+#include "hlod.h"
+#include "rendergraph.h"
+
+#include <functional>
 
 //forward declarations
 class Camera;
@@ -40,26 +53,61 @@ namespace GTR {
 	public:
 
 		Material* material;
-		Mesh* mesh;
+		Mesh* mesh; //the LOD of full_mesh drawn this frame
+		Mesh* full_mesh = NULL; //the one of the node
+		int lod = 0; //level of mesh, kept by the render cache between frames (see Renderer::selectLOD)
 		Matrix44 model;
 
 		BoundingBox world_bounding;
 		float distance_to_camera = 0.0;
+		uint64 sort_key = 0; //blend bit, shader, material, mesh and depth packed (see computeSortKey)
+		bool is_static = false; //its entity has not changed for a while (see Renderer::static_frames)
+	};
+
+	//render calls of one entity, kept between frames and only rebuilt when the entity or its prefab changes
+	struct sEntityRenderCache {
+		BaseEntity* entity = NULL;
+		Prefab* prefab = NULL;
+		Matrix44 model;
+		bool visible = false;
+		int prefab_revision = -1;
+		int changed_frame = -1; //last cache_frame in which it was gathered
+		bool impostor = false; //far enough to be drawn with the impostor of its prefab, it has no calls
+		bool hlod = false; //replaced by the proxy of its cluster, it has no calls either
+		bool is_static = false; //last frame, a change is a change of the static casters
+		std::vector<RenderCall> calls;
+	};
+
+	//shadowmap of the static casters of a light, the dynamic ones are drawn over a copy of it
+	//the static casters are identified by Renderer::static_casters_version and the dynamic ones by a hash of the ones
+	//seen last time, so the light is only redrawn when they change
+	struct sShadowCache {
+		FBO* static_fbo = NULL;
+		Vector4 region; //tile of the atlas the cache was made for
+		Matrix44 viewprojection;
+		uint64 static_version = 0;
+		uint64 dynamic_hash = 0;
+		bool valid = false;
+		bool used = false; //this frame, the ones of the lights gone are freed
+	};
 
-		bool operator > (const RenderCall& str) const
-		{
-			if (material->alpha_mode == eAlphaMode::BLEND)
-				if (str.material->alpha_mode == eAlphaMode::BLEND)
-					return (distance_to_camera > str.distance_to_camera);
-				else
-					return false;
-			else
-				if (str.material->alpha_mode == eAlphaMode::BLEND)
-					return true;
-				else
-					return (distance_to_camera > str.distance_to_camera);
-		}
+	//calls sharing material and page of the geometry pool, drawn with one multidraw of the commands written by the GPU culling
+	struct sGPUBatch {
+		Material* material;
+		Mesh* mesh; //of the first call
+		int page;
+		int first_command;
+		int num_commands;
+		int first_object;
+		int num_objects;
+	};
 
+	//snapshot of the nodes of a prefab (in depth-first order) used to detect changes in them
+	struct sPrefabRenderCache {
+		std::vector<Matrix44> node_models;
+		std::vector<char> node_visible;
+		int revision = 0;
+		int checked_frame = -1;
 	};
 
 	// This class is in charge of rendering anything in our system.
@@ -72,7 +120,15 @@ namespace GTR {
 
 		enum eLightRender {
 			SINGLEPASS,
-			MULTIPASS
+			MULTIPASS,
+			CLUSTERED
+		};
+
+		enum eCallFilter {
+			ALL_CALLS,
+			STATIC_CALLS,
+			DYNAMIC_CALLS,
+			GPU_CULLED_CALLS //only the ones of the commands written by the GPU culling
 		};
 
 		enum ePipeline {
@@ -95,6 +151,170 @@ namespace GTR {
 		std::vector<GTR::LightEntity*> lights;
 		std::vector<GTR::DecalEntity*> decals;
 		std::vector<RenderCall> render_calls;
+		std::vector<int> render_order; //indices of render_calls sorted by their sort_key
+		std::vector<sSortItem> sort_items;
+		std::vector<sSortItem> sort_temp;
+		bool render_calls_changed; //true if the calls (or their bounds) changed this frame
+
+		//batch culling
+		BoundingBoxArray render_bounds; //world_bounding of every render call as structure of arrays
+		float culling_scalar_time;
+		float culling_batch_time;
+		float culling_bvh_time;
+		int culling_mismatches;
+
+		//hierarchical culling, the tree is rebuilt when calls are added or removed and refitted when they move
+		BVH scene_bvh;
+		bool use_bvh;
+
+		//multi-view culling, every camera used in a pass registers a view and all of them are culled together
+		std::vector<Camera*> cull_views;
+		std::vector<uint32> view_visibility; //one word per render call with a bit per view that sees it
+		float cull_views_time;
+
+		//parallel gathering of the render calls
+		bool parallel_gather;
+		int num_gather_workers;
+		float gather_time; //ms spent building render_calls last frame
+		std::vector<GTR::PrefabEntity*> prefab_entities;
+		std::vector< std::vector<RenderCall> > worker_calls; //one buffer per worker, merged in order
+
+		//retained render calls (only dirty entities are gathered again)
+		bool use_render_cache;
+		int cache_frame;
+		int num_dirty_entities;
+		std::vector<sEntityRenderCache> entity_caches; //one per scene entity, same order
+		std::map<GTR::Prefab*, sPrefabRenderCache> prefab_caches; //of the visible entities, the rest are removed
+		std::vector<int> dirty_entities;
+		int num_cached_calls; //at the start of render_calls, -1 if they were not filled from the cache
+		int static_frames; //frames without changes before the calls of an entity are considered static
+
+		//all the shadowmaps live in tiles of one atlas, sized by how much of the screen every light covers
+		ShadowAtlas shadow_atlas;
+		int shadow_atlas_size;
+		int num_shadow_tiles; //lights (or cascades) that got a tile this frame
+
+		//cascaded shadowmaps of the directional light
+		int num_cascades; //0 uses a single shadowmap sized by the area_size of the light
+		int cascade_tile_size;
+		float cascade_distance; //the last cascade ends here (or in the camera far plane if closer)
+		float cascade_lambda; //0 splits the distance in equal parts, 1 logarithmically
+
+		//cached shadowmaps
+		bool use_shadow_cache;
+		std::map<Camera*, sShadowCache> shadow_caches; //by light (or cascade) camera
+		uint64 static_casters_version; //increased when the static calls change
+		bool static_calls_changed; //by the render cache this frame
+		int num_static_calls; //last frame
+		int num_shadowmaps_rendered; //this frame
+		int num_shadowmaps_cached;
+
+		//automatic instancing, the opaque calls sharing mesh and material are drawn with a single instanced draw
+		bool use_instancing;
+		int min_instances; //smaller groups are drawn one by one
+		int num_instanced_draws; //this frame
+		std::vector<Matrix44> instance_models; //models of the group being drawn
+
+		//level of detail of the meshes, chosen per call by the error of every level projected in the screen
+		bool use_lods;
+		float lod_pixel_error; //biggest error allowed, in the units of Camera::getProjectedScale
+		float lod_hysteresis; //a call only moves to a coarser level when its error is under this fraction of the limit
+		int num_lod_calls[Mesh::MAX_LODS + 1]; //calls using every level last frame
+
+		//the meshlets of the full meshes out of the frustum of a view or facing away from its camera are not drawn, a call
+		//gives only the ranges of indices of the visible ones (one glMultiDrawElements, or a command each with multidraw)
+		//only for the calls drawn alone or in a multidraw, the instanced groups are drawn whole
+		bool use_meshlets;
+		bool meshlet_draw; //drawMesh draws the ranges below instead of the whole mesh
+		std::vector<int> meshlet_firsts; //ranges of the call being drawn, in indices
+		std::vector<int> meshlet_counts;
+		std::vector<int> instance_calls; //render calls of instance_models
+		int num_meshlets_drawn; //this frame, in all the views
+		int num_meshlets_culled;
+
+		//far prefab entities give no render calls, they are drawn with the octahedral impostor of their prefab instead
+		//(baked before the gather of the frame after it is first needed), one instanced quad draw per prefab
+		//off by default: impostors do not cast shadows, the far entities would lose theirs
+		bool use_impostors;
+		float impostor_distance; //from the camera to the center of the bounds of the entity
+		int impostor_frames; //per side of the atlas, used when baking
+		int impostor_size; //of the atlas in pixels
+		std::map<GTR::Prefab*, Impostor*> impostors;
+		std::vector<GTR::Prefab*> impostors_to_bake; //asked for while gathering, see bakeImpostors
+		int num_impostor_instances; //drawn last frame
+		int num_impostor_draws;
+
+		//static prefab entities clustered in cells with a merged and simplified proxy each (see HLOD), built when enabled
+		//beyond hlod_distance the cluster is one render call of its proxy instead of the calls of its entities
+		//further, the merged proxy of every level replaces its children once its error projected is under lod_pixel_error
+		HLOD hlod;
+		bool use_hlod;
+		bool hlod_built;
+		float hlod_distance; //from the camera to the center of the bounds of the cluster
+		std::vector<GTR::BaseEntity*> hlod_entities; //in the order given to the build
+		std::vector<Matrix44> hlod_models; //of the entities when built, a cluster with one of them moved is not used
+		std::map<GTR::BaseEntity*, int> hlod_entity_clusters; //to the cluster of the first level
+		std::vector<char> hlod_active; //per cluster, drawn with its proxy this frame
+		int num_hlod_proxies; //last frame
+		int num_hlod_entities; //replaced by them
+
+		//static meshes sub-allocated in the pages of the pool, the opaque calls of a material whose meshes share a page
+		//are drawn with one glMultiDrawElementsIndirect (only with GL 4.3, otherwise the path above is used)
+		GeometryPool geometry_pool;
+		bool use_multidraw;
+		int multidraw_page; //page of the batch being drawn, -1 when drawing meshes one by one
+		int multidraw_first_command; //range of the commands of the batch, num -1 for all the uploaded ones
+		int multidraw_num_commands;
+		std::vector<GeometryPool::sDrawCommand> multidraw_commands;
+		int num_multidraws; //last frame
+		int num_multidraw_commands;
+
+		//optional GPU driven culling of the main view (needs multidraw): the pooled opaque calls are culled by a compute shader
+		//against the frustum and the depth pyramid of the last frame (built from the gbuffers, so deferred only)
+		GPUCulling gpu_culling;
+		bool use_gpu_culling;
+		bool gpu_culling_compare; //reads back the visible set and compares it with the CPU culling of the view (stalls)
+		int gpu_culled_view; //view drawn from the GPU batches this frame, -1 if none
+		std::vector<sGPUBatch> gpu_batches;
+		std::vector<int> gpu_object_calls; //render call of every object of gpu_culling
+		int gpu_cull_visible; //last comparison
+		int gpu_cull_occluded;
+		int gpu_cull_mismatches; //objects where the GPU frustum test and the CPU culling disagree
+
+		//software occlusion culling of the main view: the biggest opaque calls on screen are rasterized in the CPU
+		//and the calls completely hidden behind them lose the bit of the view in view_visibility
+		OcclusionCulling occlusion_culling;
+		bool use_occlusion_culling;
+		int max_occluders;
+		int max_occluder_triangles; //bigger meshes are never occluders
+		float min_occluder_size; //radius of the bounds over their distance to the camera
+		std::vector<OcclusionCulling::sOccluder> occluders; //of the last frame
+		std::vector<char> occluded_calls; //one per render call, hidden in the main view this frame
+		int num_occluded_calls; //last frame
+		float occlusion_test_time; //ms
+		float occlusion_single_time; //benchmark, ms to rasterize the occluders with one job and with all the workers
+		float occlusion_parallel_time;
+
+		//forward only: the opaque calls without alpha mask write their depth first with a position only shader, then they
+		//are shaded with GL_EQUAL so the lighting shaders run once per pixel (per light in multipass) instead of per fragment
+		bool use_depth_prepass;
+		bool depth_prepass_active; //the calls being shaded had the pre-pass
+		GPUTimer forward_timers[2]; //GPU time of the forward pass of the main view, without and with the pre-pass
+
+		//lights binned in the froxels of the camera, rebuilt for every camera rendered in CLUSTERED mode
+		LightClusters light_clusters;
+
+		//std140 blocks read by the shaders of the materials, only uploaded when what they hold changes
+		UniformBuffer camera_block; //per camera rendered
+		UniformBuffer lights_block; //singlepass lights, per frame
+		UniformBuffer material_block;
+		sMaterialBlock last_material_block; //content of material_block, consecutive draws of a material skip the upload
+		int lights_block_cascaded_light; //singlepass index of the light using cascades, -1 if none
+		int num_block_uploads; //last frame
+		long num_uniforms_sent; //last frame, see Shader::use_uniform_cache
+		long num_uniforms_skipped;
+		long num_state_calls; //last frame, see GLState
+		long num_state_calls_avoided;
 
 		LightEntity* directional;
 		eLightRender lightRender;
@@ -103,26 +323,21 @@ namespace GTR {
 		ePipelineSpace pipelineSpace;
 		eDynamicRange dynamicRange;
 
-		FBO* gbuffers_fbo;
-		FBO* illumination_fbo;
-		FBO* ssao_fbo;
 		FBO* irradiance_fbo;
 		FBO* reflection_fbo;
 		FBO* reflection_probe_fbo;
-		FBO* decal_fbo;
-		FBO* volumetric_fbo;
 
-		Texture* ssao_blur;
+		//the passes of renderDeferred and the textures they use, declared every frame (see RenderGraph)
+		RenderGraph render_graph;
+		int deferred_gbuffers[3]; //resources of the frame given to the shaders by uploadLightToShaderDeferred
+		int deferred_depth;
+		int deferred_ssao;
+
 		Texture* probes_texture;
-		Texture* postFX_textureA;
-		Texture* postFX_textureB;
-		Texture* postFX_textureC;
-		Texture* postFX_textureD;
 		Texture* blurred_texture;
 
 		Texture* skybox;
 		Texture* cloned_depth_texture;
-		Texture* blur;
 
 		bool multilight;
 		bool show_gbuffers;
@@ -160,32 +375,110 @@ namespace GTR {
 		float threshold;
 
 		Renderer();
+		~Renderer();
 
 		//add here your functions
 
 		//renders diferent types
-		void renderForward(Camera* camera, GTR::Scene* scene);
-		void renderDeferred(Camera* camera, GTR::Scene* scene);
+		//view is the index returned by addCullView for this camera
+		void renderForward(Camera* camera, GTR::Scene* scene, int view);
+		void renderDeferred(Camera* camera, GTR::Scene* scene, int view);
 
 		//renders several elements of the scene
 		void renderScene(GTR::Scene* scene, Camera* camera);
 
+		//builds the render_calls from the prefab entities (in parallel if enabled)
+		void gatherRenderCalls(GTR::Scene* scene, Camera* camera);
+
+		//updates the retained render calls, regathering only the entities that changed since last frame
+		void updateRenderCache(GTR::Scene* scene, Camera* camera);
+		int updatePrefabCache(GTR::Prefab* prefab); //returns the revision of the prefab nodes
+
+		//picks the LOD of the call for this camera and sets its mesh (thread safe, only touches the call)
+		void selectLOD(RenderCall& rc, Camera* camera);
+
+		//true if the entity is far enough to be drawn with the impostor of its prefab, if it is not baked yet it is
+		//queued for bakeImpostors and the entity keeps its render calls this frame
+		bool useImpostor(GTR::Prefab* prefab, const Matrix44& model, Camera* camera);
+		//bakes the queued impostors, before the gather so no fbo or camera changes in the middle of it
+		void bakeImpostors();
+		//returns the impostor of the prefab, baking it the first time
+		Impostor* getImpostor(GTR::Prefab* prefab);
+		//draws the calls (with their full meshes) to the bound fbo with the gbuffers shader, the colors stay as in the
+		//textures because the shaders reading the atlas convert them like gbuffers.fs
+		void bakeCalls(const std::vector<RenderCall>& calls, Camera* camera);
+		//draws the far entities of the frame inside the frustum of the camera, into the gbuffers or lit with the singlepass lights
+		void renderImpostors(Camera* camera, bool to_gbuffers);
+
+		//clusters the static prefab entities (the render cache has not seen them change for static_frames) and bakes their proxies
+		void buildHLOD(GTR::Scene* scene, Camera* camera);
+		//decides which clusters use their proxy for this camera, returns true if any changed
+		bool updateHLOD(Camera* camera);
+		//true if the entity is replaced by the proxy of its cluster this frame
+		bool isInHLODProxy(GTR::BaseEntity* entity);
+		//adds the calls of the proxies in use to render_calls
+		void addHLODCalls(Camera* camera);
+
+		//computes the sort keys of the render calls and fills render_order
+		void sortRenderCalls(Camera* camera);
+
+		//copies the bounds of the render calls to render_bounds (only if they changed)
+		void updateRenderBounds();
+		//keeps scene_bvh in sync with render_bounds
+		void updateSceneBVH();
+		//registers a camera to be culled in the next cullViews, returns its view index (-1 if there are too many views)
+		int addCullView(Camera* camera);
+		//fills view_visibility for all the registered views at once (walking the BVH or testing all the bounds)
+		void cullViews();
+		//walks the opaque calls of render_order visible in the view, grouping the consecutive ones that share mesh and material
+		//draw gets the models of a group (num_instances > 0) or of a single call (num_instances 0, draw it without instancing)
+		//with multidraw the groups are the calls sharing the material and a page of the pool, draw gets the models of all of them
+		void drawOpaqueCalls(int view, eCallFilter filter, std::function<void(Mesh* mesh, GTR::Material* material, const Matrix44* models, int num_instances)> draw);
+		//a view of -1 was not culled, so everything is visible
+		bool isCallVisible(int index, int view) { return view < 0 || (view_visibility[index] >> view) & 1; }
+		//fills meshlet_firsts and meshlet_counts with the meshlets of the call visible in the view (merging the contiguous ones)
+		//false if the call has to be drawn whole (no meshlets or a view of -1)
+		bool cullMeshlets(RenderCall& rc, int view);
+		//groups the pooled opaque calls of render_order like drawOpaqueCalls and uploads them to gpu_culling
+		void buildGPUBatches();
+		//compares the flags written by the last GPU cull with the CPU culling of the view
+		void compareGPUCulling(int view);
+		//chooses the occluders of the camera, rasterizes them and clears the view bit of the calls they hide
+		void cullOcclusion(Camera* camera, int view);
+		//rasterizes the occluders of the last frame with one job and with all the workers
+		void benchmarkOcclusion(Camera* camera, int iterations = 20);
+		//compares the time of the scalar culling against the batch and the BVH ones, using this camera
+		void benchmarkCulling(Camera* camera, int iterations = 100);
+
 		//to render a whole prefab (with all its nodes)
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall>& calls);
 
-		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//to render one node from the prefab and its children (it doesnt modify the node so it can be called from several threads)
+		void renderNode(const Matrix44& parent_model, GTR::Node* node, Camera* camera, std::vector<RenderCall>& calls);
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
-		void renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//with instance_models the mesh is drawn once per model using the _instanced version of the shader
+		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models = NULL, int num_instances = 0);
+		void renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models = NULL, int num_instances = 0);
 
 		void uploadLightToShaderMultipass(LightEntity* light, Shader* shader);
 		void uploadLightToShaderSinglepass(Shader* shader);
+		void uploadLightToShaderClustered(Shader* shader);
 		void uploadLightToShaderDeferred(Shader* shader, Matrix44 inv_vp, int width, int height, Camera* camera);
 
-		void generateShadowmap(LightEntity* light);
-		void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void uploadCameraBlock(Camera* camera);
+		void uploadLightsBlock();
+		void uploadMaterialBlock(GTR::Material* material);
+
+		void allocateShadowTiles(Camera* camera); //gives a tile of the atlas to the shadowed lights that need it
+		void setupShadowCamera(LightEntity* light, Camera* view_camera); //places the light camera, call it before culling
+		void setupShadowCascades(LightEntity* light, Camera* view_camera);
+		void generateShadowmap(Camera* light_camera, const Vector4& region, int view); //renders one tile of the atlas
+		void clearShadowCaches(); //frees their fbos, every light is rendered again
+		void uploadShadowCascades(LightEntity* light, Shader* shader, int light_index = -1);
+		void renderDepthPrepass(const Matrix44 model, Mesh* mesh, GTR::Material* material, const Matrix44* instance_models = NULL, int num_instances = 0);
+		void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instance_models = NULL, int num_instances = 0);
 		void showShadowmap(LightEntity* light);
 
 		void generateSkybox(Camera* camera);
@@ -202,7 +495,10 @@ namespace GTR {
 		void captureReflectionProbe(GTR::Scene* scene, Texture* tex, Vector3 pos);
 
 		void uploadUniformsAndTextures(Shader* shader, GTR::Material* material, Camera* camera, const Matrix44 model);
-		void applyfx(Texture* color, Texture* depth, Camera* camera);
+		//instanced if there are instance models (the shader must be the _instanced version), the multidraw batch if there is one
+		void drawMesh(Mesh* mesh, const Matrix44* instance_models, int num_instances);
+		//adds the passes of the enabled effects to render_graph, reading the resources color and depth, the last one tonemaps to the screen
+		void applyfx(int color, int depth, Camera* camera);
 	};
 
 	vector<Vector3> generateSpherePoints(int num, float radius, bool hemi);
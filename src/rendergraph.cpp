@@ -0,0 +1,231 @@
+#include "rendergraph.h"
+#include "texture.h"
+#include "fbo.h"
+#include "glstate.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+RenderGraph::RenderGraph()
+{
+	num_culled_passes = 0;
+	transient_bytes = 0;
+	peak_bytes = 0;
+	pool_bytes = 0;
+}
+
+RenderGraph::~RenderGraph()
+{
+	for (std::map<std::vector<unsigned int>, FBO*>::iterator it = fbos.begin(); it != fbos.end(); ++it)
+		delete it->second;
+	for (int i = 0; i < pool.size(); ++i)
+		delete pool[i].texture;
+}
+
+void RenderGraph::reset()
+{
+	resources.clear();
+	passes.clear();
+}
+
+int RenderGraph::createTexture(const char* name, int width, int height, unsigned int format, unsigned int type, unsigned int filter)
+{
+	sResource resource;
+	resource.name = name;
+	resource.desc.width = width;
+	resource.desc.height = height;
+	resource.desc.format = format;
+	resource.desc.type = type;
+	resource.filter = filter;
+	resource.texture = NULL;
+	resource.first_pass = -1;
+	resource.last_pass = -1;
+	resources.push_back(resource);
+	return resources.size() - 1;
+}
+
+void RenderGraph::addPass(const char* name, const std::vector<int>& reads, const std::vector<int>& writes, std::function<void()> execute, bool output)
+{
+	sPass pass;
+	pass.name = name;
+	pass.reads = reads;
+	pass.writes = writes;
+	pass.execute = execute;
+	pass.output = output;
+	pass.culled = false;
+	passes.push_back(pass);
+}
+
+uint64 RenderGraph::getTextureBytes(const sTextureDesc& desc)
+{
+	int channels = desc.format == GL_RGBA ? 4 : desc.format == GL_RGB ? 3 : 1;
+	int channel_bytes = desc.type == GL_UNSIGNED_BYTE ? 1 : desc.type == GL_HALF_FLOAT ? 2 : 4;
+	return (uint64)desc.width * desc.height * channels * channel_bytes;
+}
+
+void RenderGraph::compile()
+{
+	//from the last pass back, a pass is kept if it draws to the screen or writes something read by a kept one
+	std::vector<char> needed(resources.size(), 0);
+	num_culled_passes = 0;
+	for (int p = passes.size() - 1; p >= 0; --p) {
+		sPass& pass = passes[p];
+		bool used = pass.output;
+		for (int i = 0; i < pass.writes.size(); ++i)
+			if (needed[pass.writes[i]])
+				used = true;
+		pass.culled = !used;
+		if (pass.culled) {
+			num_culled_passes++;
+			continue;
+		}
+		for (int i = 0; i < pass.reads.size(); ++i)
+			needed[pass.reads[i]] = 1;
+	}
+
+	for (int r = 0; r < resources.size(); ++r)
+		resources[r].first_pass = resources[r].last_pass = -1;
+	for (int p = 0; p < passes.size(); ++p) {
+		sPass& pass = passes[p];
+		if (pass.culled)
+			continue;
+		for (int k = 0; k < 2; ++k) {
+			const std::vector<int>& used = k ? pass.writes : pass.reads;
+			for (int i = 0; i < used.size(); ++i) {
+				sResource& resource = resources[used[i]];
+				if (resource.first_pass == -1)
+					resource.first_pass = p;
+				resource.last_pass = p;
+			}
+		}
+	}
+
+	transient_bytes = 0;
+	peak_bytes = 0;
+	for (int r = 0; r < resources.size(); ++r)
+		if (resources[r].first_pass != -1)
+			transient_bytes += getTextureBytes(resources[r].desc);
+	for (int p = 0; p < passes.size(); ++p) {
+		uint64 alive = 0;
+		for (int r = 0; r < resources.size(); ++r)
+			if (resources[r].first_pass != -1 && resources[r].first_pass <= p && resources[r].last_pass >= p)
+				alive += getTextureBytes(resources[r].desc);
+		peak_bytes = std::max(peak_bytes, alive);
+	}
+}
+
+void RenderGraph::execute()
+{
+	compile();
+
+	for (int i = 0; i < pool.size(); ++i) {
+		pool[i].in_use = false;
+		pool[i].used = false;
+	}
+
+	for (int p = 0; p < passes.size(); ++p) {
+		sPass& pass = passes[p];
+		if (pass.culled)
+			continue;
+		for (int r = 0; r < resources.size(); ++r)
+			if (resources[r].first_pass == p)
+				resources[r].texture = acquire(resources[r]);
+		pass.execute();
+		//what is not used after this pass goes back to the pool, the next passes can take it
+		for (int r = 0; r < resources.size(); ++r)
+			if (resources[r].last_pass == p) {
+				release(resources[r].texture);
+				resources[r].texture = NULL;
+			}
+	}
+
+	freeUnused();
+	pool_bytes = 0;
+	for (int i = 0; i < pool.size(); ++i)
+		pool_bytes += getTextureBytes(pool[i].desc);
+}
+
+Texture* RenderGraph::acquire(const sResource& resource)
+{
+	Texture* texture = NULL;
+	for (int i = 0; i < pool.size() && !texture; ++i)
+		if (!pool[i].in_use && memcmp(&pool[i].desc, &resource.desc, sizeof(sTextureDesc)) == 0) {
+			pool[i].in_use = true;
+			pool[i].used = true;
+			texture = pool[i].texture;
+		}
+
+	if (!texture) {
+		const sTextureDesc& desc = resource.desc;
+		sPooledTexture pooled;
+		pooled.texture = texture = new Texture(desc.width, desc.height, desc.format, desc.type, false);
+		pooled.desc = desc;
+		pooled.in_use = true;
+		pooled.used = true;
+		pool.push_back(pooled);
+	}
+
+	//the filter is not part of the description, the same texture can be shared by resources with different ones
+	GLState::bindTexture(texture->texture_type, texture->texture_id);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, resource.filter);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, resource.filter);
+	GLState::bindTexture(texture->texture_type, 0);
+	return texture;
+}
+
+void RenderGraph::release(Texture* texture)
+{
+	for (int i = 0; i < pool.size(); ++i)
+		if (pool[i].texture == texture)
+			pool[i].in_use = false;
+}
+
+void RenderGraph::freeUnused()
+{
+	bool freed = false;
+	for (int i = 0; i < pool.size();) {
+		if (pool[i].used) {
+			++i;
+			continue;
+		}
+		delete pool[i].texture;
+		pool.erase(pool.begin() + i);
+		freed = true;
+	}
+
+	//the ids of the deleted textures can be given to new ones, the fbos are created again
+	if (freed) {
+		for (std::map<std::vector<unsigned int>, FBO*>::iterator it = fbos.begin(); it != fbos.end(); ++it)
+			delete it->second;
+		fbos.clear();
+	}
+}
+
+Texture* RenderGraph::getTexture(int resource)
+{
+	assert(resources[resource].texture && "the texture is not alive in this pass");
+	return resources[resource].texture;
+}
+
+FBO* RenderGraph::getFBO(const std::vector<int>& colors, int depth)
+{
+	if (colors.size() == 1 && depth == -1)
+		return Texture::getGlobalFBO(getTexture(colors[0]));
+
+	std::vector<Texture*> textures;
+	std::vector<unsigned int> key;
+	for (int i = 0; i < colors.size(); ++i) {
+		textures.push_back(getTexture(colors[i]));
+		key.push_back(textures.back()->texture_id);
+	}
+	Texture* depth_texture = depth != -1 ? getTexture(depth) : NULL;
+	key.push_back(depth_texture ? depth_texture->texture_id : 0);
+
+	FBO*& fbo = fbos[key];
+	if (!fbo) {
+		fbo = new FBO();
+		fbo->setTextures(textures, depth_texture);
+	}
+	return fbo;
+}
@@ -0,0 +1,97 @@
+/*	Frame graph of a pipeline: every pass declares the textures it reads and writes and the graph is rebuilt every frame.
+	Before executing, the passes that do not lead to an output pass (the ones drawing to the screen) are culled, and the
+	textures of the frame (transient, they only live between their first and last use) are taken from a pool: two with
+	the same size and format whose lifetimes do not overlap get the same texture, so the memory of the frame is the one
+	of the textures alive at the same time instead of the sum of all of them.
+	A pass that writes a texture also read by the passes before it (blending on it) keeps them, it does not replace it.
+	Pool textures not used in a frame are freed at its end (also when the size of the window changes).
+*/
+
+#ifndef RENDERGRAPH_H
+#define RENDERGRAPH_H
+
+#include "includes.h"
+#include "framework.h"
+
+#include <functional>
+#include <map>
+
+class FBO;
+class Texture;
+
+class RenderGraph
+{
+public:
+	struct sTextureDesc {
+		int width;
+		int height;
+		unsigned int format; //GL_RGB, GL_RGBA or GL_DEPTH_COMPONENT
+		unsigned int type;
+	};
+
+	struct sResource {
+		const char* name;
+		sTextureDesc desc;
+		unsigned int filter; //set when the texture is taken from the pool
+		Texture* texture; //only while the graph is executed
+		int first_pass; //compiled lifetime, -1 if no pass uses it
+		int last_pass;
+	};
+
+	struct sPass {
+		const char* name;
+		std::vector<int> reads;
+		std::vector<int> writes;
+		std::function<void()> execute;
+		bool output; //draws to the screen, never culled
+		bool culled;
+	};
+
+	struct sPooledTexture {
+		Texture* texture;
+		sTextureDesc desc;
+		bool in_use;
+		bool used; //this frame
+	};
+
+	std::vector<sResource> resources;
+	std::vector<sPass> passes;
+	std::vector<sPooledTexture> pool;
+
+	//last frame
+	int num_culled_passes;
+	uint64 transient_bytes; //all the textures of the frame, as if every one had its own
+	uint64 peak_bytes; //of the textures alive at the same time
+	uint64 pool_bytes; //allocated in the pool
+
+	RenderGraph();
+	~RenderGraph();
+
+	//starts a new frame, the textures of the pool are kept
+	void reset();
+
+	//returns the handle of a transient texture, it has no content until a pass writes it
+	int createTexture(const char* name, int width, int height, unsigned int format, unsigned int type, unsigned int filter = GL_LINEAR);
+	//execute is called in the order the passes were added, with the textures of the reads and writes ready
+	void addPass(const char* name, const std::vector<int>& reads, const std::vector<int>& writes, std::function<void()> execute, bool output = false);
+
+	//culls the passes, computes the lifetimes and runs the passes left, taking and returning the pool textures on the way
+	void execute();
+
+	//only valid from the passes that read or write the resource
+	Texture* getTexture(int resource);
+	//fbo with those textures attached (a single color texture uses the global fbo of Texture)
+	FBO* getFBO(const std::vector<int>& colors, int depth = -1);
+
+	static uint64 getTextureBytes(const sTextureDesc& desc);
+
+private:
+	std::map<std::vector<unsigned int>, FBO*> fbos; //by the ids of the attached textures, the depth last
+
+	void compile();
+	Texture* acquire(const sResource& resource);
+	void release(Texture* texture);
+	void freeUnused();
+};
+
+#endif
@@ -187,11 +187,14 @@ GTR::LightEntity::LightEntity()
 	area_size = 0;
 	target.set(0, 0, 0);
 	shadow_bias = 0.01;
+	shadow_importance = 1.0;
 	cast_shadows = false;
 
-	fbo = NULL;
 	shadowmap = NULL;
 	light_camera = NULL;
+	num_cascades = 0;
+	for (int i = 0; i < MAX_SHADOW_CASCADES; ++i)
+		cascade_cameras[i] = NULL;
 }
 
 void GTR::LightEntity::renderInMenu()
@@ -210,6 +213,7 @@ void GTR::LightEntity::renderInMenu()
 	ImGui::DragFloat("Cone angle", &cone_angle, 0.1);
 	ImGui::DragFloat("Cone exp", &cone_exp, 0.1);
 	ImGui::DragFloat("Shadow bias", &shadow_bias, 0.01);
+	ImGui::DragFloat("Shadow importance", &shadow_importance, 0.1, 0.0, 10.0);
 	ImGui::Checkbox("Cast shadows", &cast_shadows);
 
 }
@@ -222,6 +226,7 @@ void GTR::LightEntity::configure(cJSON* json)
 	cone_angle = readJSONNumber(json, "cone_angle", cone_angle);
 	cone_exp = readJSONNumber(json, "cone_exp", cone_exp);
 	shadow_bias = readJSONNumber(json, "shadow_bias", shadow_bias);
+	shadow_importance = readJSONNumber(json, "shadow_importance", shadow_importance);
 	area_size = readJSONNumber(json, "area_size", area_size);
 	target = readJSONVector3(json, "target", target);
 	cast_shadows = readJSONBool(json, "cast_shadows", false);
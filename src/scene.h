@@ -28,6 +28,8 @@ namespace GTR {
 		DIRECTIONAL = 2
 	};
 
+	const int MAX_SHADOW_CASCADES = 4; //keep in sync with MAX_CASCADES in the shaders
+
 	class Scene;
 	class Prefab;
 
@@ -72,12 +74,18 @@ namespace GTR {
 		Vector3 target;
 		bool cast_shadows;
 		float shadow_bias;
+		float shadow_importance; //scales the screen coverage used to choose its tile in the shadow atlas
 
-		FBO* fbo;
-		Texture* shadowmap;
+		Texture* shadowmap; //the shadow atlas if it got a tile this frame, NULL otherwise
+		Vector4 shadowmap_region; //tile in the atlas, offset (xy) and size (zw) in uvs
 
 		Camera* light_camera;
 
+		//directional lights can split their shadowmap in cascades fitted to the view (then light_camera is not used)
+		int num_cascades; //cascades with a tile this frame, 0 if it uses a single shadowmap
+		Camera* cascade_cameras[MAX_SHADOW_CASCADES];
+		Vector4 cascade_regions[MAX_SHADOW_CASCADES];
+
 		LightEntity();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
@@ -8,6 +8,8 @@
 #include <locale>
 
 #include "texture.h"
+#include "uniformbuffer.h"
+#include "glstate.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -56,15 +58,20 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+bool Shader::use_uniform_cache = true;
+long Shader::num_uniforms_sent = 0;
+long Shader::num_uniforms_skipped = 0;
+const char* Shader::attribute_names[NUM_VERTEX_ATTRIBUTES] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights", "u_model" };
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
-	program = vs = fs = 0;
+	program = vs = fs = cs = 0;
 	compiled = false;
 	from_atlas = false;
-
+	uniform_table_mask = 0;
+	readAttributeLocations();
 }
 
 Shader::~Shader()
@@ -228,6 +235,36 @@ bool Shader::LoadAtlas(const char* filename)
 			pos3 = std::string::npos;
 		std::string name = line.substr(0,pos);
 		std::string vs_filename = trim(line.substr(pos+1,pos2 - pos));
+
+		//a single file is a compute shader, they are optional so a failure does not stop the atlas
+		if (pos2 == std::string::npos)
+		{
+			std::string cs_code = s_shaders_atlas[vs_filename];
+			if (!cs_code.size())
+			{
+				std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
+				continue;
+			}
+			if (!checkGLVersion(4, 3))
+			{
+				std::cout << " - Compute shader skipped, it needs OpenGL 4.3: " << name << std::endl;
+				continue;
+			}
+			Shader* shader = s_Shaders.count(name) ? s_Shaders[name] : new Shader();
+			if (!shader->compileComputeFromMemory(cs_code))
+			{
+				std::cout << " * Compilation error in compute shader at atlas: " << name << std::endl;
+				s_Shaders.erase(name);
+				delete shader;
+				continue;
+			}
+			s_Shaders[name] = shader;
+			shader->vs_filename = vs_filename;
+			shader->from_atlas = true;
+			std::cout << " + Compute shader from atlas: " << name << std::endl;
+			continue;
+		}
+
 		std::string fs_filename = trim(line.substr(pos2+1,pos3 - pos2));
 		std::string macros = "";
 		if(pos3 != std::string::npos)
@@ -304,8 +341,10 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		exit(0);
 	}
 
-	if (program != 0)
+	if (program != 0) {
+		GLState::forgetProgram(program);
 		glDeleteProgram(program);
+	}
 	program = glCreateProgram();
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -336,12 +375,53 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	UniformBuffer::bindProgramBlocks(program);
+
 #ifdef _DEBUG
 	validate();
 #endif
 
 	compiled = true;
 	locations.clear(); //regenerate table
+	buildUniformTable();
+	readAttributeLocations();
+
+	return true;
+}
+
+bool Shader::compileComputeFromMemory(const std::string& csm)
+{
+	if (program != 0) {
+		GLState::forgetProgram(program);
+		glDeleteProgram(program);
+	}
+	program = glCreateProgram();
+	assert (glGetError() == GL_NO_ERROR);
+
+	if (!createShaderObject(GL_COMPUTE_SHADER, cs, csm))
+	{
+		printf("Compute shader compilation failed\n");
+		return false;
+	}
+
+	glLinkProgram(program);
+	assert (glGetError() == GL_NO_ERROR);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+	{
+		saveProgramInfoLog(program);
+		release();
+		return false;
+	}
+
+	UniformBuffer::bindProgramBlocks(program);
+
+	compiled = true;
+	locations.clear();
+	buildUniformTable();
+	readAttributeLocations();
 
 	return true;
 }
@@ -432,14 +512,26 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (cs)
+	{
+		glDeleteShader(cs);
+		assert (glGetError() == GL_NO_ERROR);
+		cs = 0;
+	}
+
 	if (program)
 	{
+		GLState::forgetProgram(program);
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
 
 	locations.clear();
+	uniform_table.clear();
+	readAttributeLocations();
+	uniform_value_slots.clear();
+	uniform_values.clear();
 
 	compiled = false;
 }
@@ -452,7 +544,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -464,14 +556,15 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	current = NULL;
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -558,6 +651,103 @@ int Shader::getAttribLocation(const char* varname)
 	return loc;
 }
 
+//the meshes read them on every draw, so they are queried only once
+void Shader::readAttributeLocations()
+{
+	for (int i = 0; i < NUM_VERTEX_ATTRIBUTES; ++i)
+		attribute_locations[i] = program ? glGetAttribLocation(program, attribute_names[i]) : -1;
+}
+
+//bytes of a value of a uniform type, 0 for the types that are not cached
+static int getUniformTypeSize(GLenum type)
+{
+	switch (type) {
+		case GL_FLOAT: case GL_INT: case GL_BOOL: case GL_UNSIGNED_INT: return 4;
+		case GL_FLOAT_VEC2: case GL_INT_VEC2: case GL_BOOL_VEC2: return 8;
+		case GL_FLOAT_VEC3: case GL_INT_VEC3: case GL_BOOL_VEC3: return 12;
+		case GL_FLOAT_VEC4: case GL_INT_VEC4: case GL_BOOL_VEC4: case GL_FLOAT_MAT2: return 16;
+		case GL_FLOAT_MAT3: return 36;
+		case GL_FLOAT_MAT4: return 64;
+		case GL_SAMPLER_2D: case GL_SAMPLER_3D: case GL_SAMPLER_CUBE: case GL_SAMPLER_2D_SHADOW: case GL_SAMPLER_2D_ARRAY: return 4;
+	}
+	return 0;
+}
+
+void Shader::buildUniformTable()
+{
+	GLint num_uniforms = 0;
+	GLint max_length = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &num_uniforms);
+	glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+	//at most half full so the probing stays short
+	int size = 8;
+	while (size < num_uniforms * 2)
+		size *= 2;
+	sUniformSlot empty = { 0, -1 };
+	uniform_table.assign(size, empty);
+	uniform_table_mask = size - 1;
+
+	uniform_value_slots.clear();
+	uniform_values.clear();
+
+	std::vector<char> name(max_length + 1);
+	for (int i = 0; i < num_uniforms; ++i) {
+		GLint array_size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(program, i, max_length + 1, NULL, &array_size, &type, &name[0]);
+		GLint location = glGetUniformLocation(program, &name[0]);
+		if (location == -1) //members of the uniform blocks
+			continue;
+
+		//room for its last value (locations are small consecutive numbers in practice)
+		int type_size = getUniformTypeSize(type);
+		if (type_size && location < 4096) {
+			if (location >= uniform_value_slots.size()) {
+				sUniformValue none = { -1, 0, false };
+				uniform_value_slots.resize(location + 1, none);
+			}
+			sUniformValue& slot = uniform_value_slots[location];
+			slot.offset = uniform_values.size();
+			slot.size = type_size * array_size;
+			uniform_values.resize(uniform_values.size() + slot.size);
+		}
+
+		//arrays are listed as "name[0]" but are set by their name
+		char* bracket = strchr(&name[0], '[');
+		if (bracket)
+			*bracket = 0;
+
+		uint32 hash = hashUniformName(&name[0]);
+		uint32 index = hash & uniform_table_mask;
+		while (uniform_table[index].location != -1 && uniform_table[index].hash != hash)
+			index = (index + 1) & uniform_table_mask;
+		if (uniform_table[index].location != -1)
+			std::cout << " - Error: uniforms with the same hash in " << vs_filename << "," << ps_filename << ": " << &name[0] << std::endl;
+		uniform_table[index].hash = hash;
+		uniform_table[index].location = location;
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+bool Shader::isUniformCached(GLint location, const void* data, int size)
+{
+	if (use_uniform_cache && location < uniform_value_slots.size()) {
+		sUniformValue& slot = uniform_value_slots[location];
+		if (slot.offset != -1 && size <= slot.size) {
+			char* value = &uniform_values[slot.offset];
+			if (slot.valid && memcmp(value, data, size) == 0) {
+				num_uniforms_skipped++;
+				return true;
+			}
+			memcpy(value, data, size);
+			slot.valid = true;
+		}
+	}
+	num_uniforms_sent++;
+	return false;
+}
+
 int Shader::getUniformLocation(const char* varname)
 {
 	int loc = getLocation(varname, &locations);
@@ -571,10 +761,8 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
@@ -592,7 +780,10 @@ void Shader::setUniform1(const char* varname, bool input1)
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc, varname);
-	glUniform1i(loc, input1);
+	int value = input1;
+	if (isUniformCached(loc, &value, sizeof(int)))
+		return;
+	glUniform1i(loc, value);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
@@ -600,6 +791,8 @@ void Shader::setUniform1(const char* varname, int input1)
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, &input1, sizeof(int)))
+		return;
 	glUniform1i(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -608,6 +801,9 @@ void Shader::setUniform2(const char* varname, int input1, int input2)
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	int values[2] = { input1, input2 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform2i(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -616,6 +812,9 @@ void Shader::setUniform3(const char* varname, int input1, int input2, int input3
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	int values[3] = { input1, input2, input3 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform3i(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -624,6 +823,9 @@ void Shader::setUniform4(const char* varname, const int input1, const int input2
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	int values[4] = { input1, input2, input3, input4 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform4i(loc, input1, input2, input3, input4);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -632,6 +834,8 @@ void Shader::setUniform1Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(int) * count))
+		return;
 	glUniform1iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -640,6 +844,8 @@ void Shader::setUniform2Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(int) * 2 * count))
+		return;
 	glUniform2iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -648,6 +854,8 @@ void Shader::setUniform3Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(int) * 3 * count))
+		return;
 	glUniform3iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -656,6 +864,8 @@ void Shader::setUniform4Array(const char* varname, const int* input, const int c
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(int) * 4 * count))
+		return;
 	glUniform4iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -664,6 +874,8 @@ void Shader::setUniform1(const char* varname, const float input1)
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, &input1, sizeof(float)))
+		return;
 	glUniform1f(loc, input1);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -672,6 +884,9 @@ void Shader::setUniform2(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	float values[2] = { input1, input2 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform2f(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -680,6 +895,9 @@ void Shader::setUniform3(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	float values[3] = { input1, input2, input3 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform3f(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -688,6 +906,9 @@ void Shader::setUniform4(const char* varname, const float input1, const float in
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	float values[4] = { input1, input2, input3, input4 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
 	glUniform4f(loc, input1, input2, input3, input4);
 	checkGLErrors();
 }
@@ -696,6 +917,8 @@ void Shader::setUniform1Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(float) * count))
+		return;
 	glUniform1fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -704,6 +927,8 @@ void Shader::setUniform2Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(float) * 2 * count))
+		return;
 	glUniform2fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -712,6 +937,8 @@ void Shader::setUniform3Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(float) * 3 * count))
+		return;
 	glUniform3fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -720,6 +947,8 @@ void Shader::setUniform4Array(const char* varname, const float* input, const int
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, input, sizeof(float) * 4 * count))
+		return;
 	glUniform4fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -728,6 +957,8 @@ void Shader::setMatrix44(const char* varname, const float* m)
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, m, sizeof(float) * 16))
+		return;
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -736,6 +967,8 @@ void Shader::setMatrix44( const char* varname, const Matrix44 &m )
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc,varname);
+	if (isUniformCached(loc, m.m, sizeof(Matrix44)))
+		return;
 	glUniformMatrix4fv(loc, 1, GL_FALSE, m.m);
 	assert (glGetError() == GL_NO_ERROR);
 }
@@ -744,10 +977,115 @@ void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
 {
 	GLint loc = getLocation(varname, &locations);
 	CHECK_SHADER_VAR(loc, varname);
+	if (isUniformCached(loc, m_array, sizeof(Matrix44) * num))
+		return;
 	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+void Shader::setUniform(const UniformID& id, int input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, &input, sizeof(int)))
+		return;
+	glUniform1i(loc, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, float input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, &input, sizeof(float)))
+		return;
+	glUniform1f(loc, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector2& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, &input, sizeof(Vector2)))
+		return;
+	glUniform2f(loc, input.x, input.y);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector3& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, &input, sizeof(Vector3)))
+		return;
+	glUniform3f(loc, input.x, input.y, input.z);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector4& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, &input, sizeof(Vector4)))
+		return;
+	glUniform4f(loc, input.x, input.y, input.z, input.w);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, const Matrix44& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, input.m, sizeof(Matrix44)))
+		return;
+	glUniformMatrix4fv(loc, 1, GL_FALSE, input.m);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformID& id, Texture* tex, int slot)
+{
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
+	setUniform(id, slot);
+}
+
+void Shader::setUniform3(const UniformID& id, const int input1, const int input2, const int input3)
+{
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	int values[3] = { input1, input2, input3 };
+	if (isUniformCached(loc, values, sizeof(values)))
+		return;
+	glUniform3i(loc, input1, input2, input3);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform4Array(const UniformID& id, const float* input, const int count)
+{
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, input, sizeof(float) * 4 * count))
+		return;
+	glUniform4fv(loc, count, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setMatrix44Array(const UniformID& id, const Matrix44* m_array, int num)
+{
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id.name);
+	if (isUniformCached(loc, m_array, sizeof(Matrix44) * num))
+		return;
+	glUniformMatrix4fv(loc, num, GL_FALSE, (const GLfloat*)m_array);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
@@ -10,6 +10,8 @@
 #include <map>
 #include "framework.h"
 #include <cassert>
+#include <vector>
+#include <type_traits>
 
 #ifdef _DEBUG
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
@@ -20,6 +22,37 @@
 
 class Texture;
 
+//FNV-1a of a uniform name, constexpr so the names written in the code are hashed when compiling
+//(one return statement so it works with the C++11 constexpr of VS2015)
+constexpr uint32 hashUniformName(const char* name, uint32 hash = 2166136261u)
+{
+	return *name ? hashUniformName(name + 1, (hash ^ (uint32)(unsigned char)*name) * 16777619u) : hash;
+}
+
+//a uniform identified by the hash of its name, create it with UNIFORM_ID("u_name")
+struct UniformID
+{
+	uint32 hash;
+	const char* name; //only for error messages
+	constexpr UniformID(uint32 hash, const char* name) : hash(hash), name(name) {}
+};
+
+//the template argument forces the hash to be computed by the compiler
+#define UNIFORM_ID(name) UniformID(std::integral_constant<uint32, hashUniformName(name)>::value, name)
+
+//vertex attributes fed by the meshes, see Shader::attribute_names
+enum eVertexAttribute {
+	ATTRIB_VERTEX = 0,
+	ATTRIB_NORMAL,
+	ATTRIB_COORD,
+	ATTRIB_COORD1,
+	ATTRIB_COLOR,
+	ATTRIB_BONES,
+	ATTRIB_WEIGHTS,
+	ATTRIB_INSTANCE_MODEL, //mat4, takes four consecutive locations
+	NUM_VERTEX_ATTRIBUTES
+};
+
 class Shader
 {
 	int last_slot;
@@ -29,6 +62,14 @@ class Shader
 public:
 	static Shader* current;
 
+	//skips the glUniform calls that would send the value the uniform already has
+	static bool use_uniform_cache;
+	static long num_uniforms_sent; //since the last reset
+	static long num_uniforms_skipped;
+
+	static const char* attribute_names[NUM_VERTEX_ATTRIBUTES];
+	int attribute_locations[NUM_VERTEX_ATTRIBUTES]; //read when linking, -1 if the program does not use the attribute
+
 	Shader();
 	virtual ~Shader();
 
@@ -40,6 +81,7 @@ public:
 
 	//internal functions
 	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileComputeFromMemory(const std::string& csm); //needs OpenGL 4.3
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -64,6 +106,34 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//same with the hashed identifiers, the location comes from the table filled when linking, no strings involved
+	//use them in the code that runs per draw, the versions above search the name in a map every time
+	void setUniform(const UniformID& id, bool input) { setUniform(id, (int)input); }
+	void setUniform(const UniformID& id, int input);
+	void setUniform(const UniformID& id, float input);
+	void setUniform(const UniformID& id, const Vector2& input);
+	void setUniform(const UniformID& id, const Vector3& input);
+	void setUniform(const UniformID& id, const Vector4& input);
+	void setUniform(const UniformID& id, const Matrix44& input);
+	void setUniform(const UniformID& id, Texture* texture, int slot);
+	void setUniform3(const UniformID& id, const int input1, const int input2, const int input3);
+	void setUniform4Array(const UniformID& id, const float* input, const int count);
+	void setMatrix44Array(const UniformID& id, const Matrix44* m_array, int num);
+
+	//-1 if the program has no active uniform with that name
+	GLint getLocation(const UniformID& id) const
+	{
+		if (!uniform_table.size())
+			return -1;
+		for (uint32 i = id.hash & uniform_table_mask;; i = (i + 1) & uniform_table_mask) {
+			const sUniformSlot& slot = uniform_table[i];
+			if (slot.hash == id.hash)
+				return slot.location;
+			if (slot.location == -1) //empty slot, the hash is not in the table
+				return -1;
+		}
+	}
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -138,9 +208,30 @@ protected:
 
 	GLuint vs;
 	GLuint fs;
+	GLuint cs;
 	GLuint program;
 	std::string log;
 
+	//hash table of the active uniforms by the hash of their name (open addressing, power of two size)
+	struct sUniformSlot {
+		uint32 hash;
+		GLint location; //-1 in the empty slots
+	};
+	std::vector<sUniformSlot> uniform_table;
+	uint32 uniform_table_mask;
+	void buildUniformTable();
+	void readAttributeLocations();
+
+	//last value sent to every active uniform, by location
+	struct sUniformValue {
+		int offset; //in uniform_values, -1 if the location is not cached
+		int size; //in bytes, the whole array for arrays
+		bool valid; //false until the first time it is set
+	};
+	std::vector<sUniformValue> uniform_value_slots;
+	std::vector<char> uniform_values;
+	bool isUniformCached(GLint location, const void* data, int size); //stores the value if it was not
+
 //this is a hack to speed up shader usage (save info locally)
 private: 
 
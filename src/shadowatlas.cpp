@@ -0,0 +1,100 @@
+#include "shadowatlas.h"
+#include "fbo.h"
+#include "texture.h"
+
+#include "includes.h"
+#include "glstate.h"
+
+ShadowAtlas::ShadowAtlas()
+{
+	fbo = NULL;
+	depth_texture = NULL;
+	size = 0;
+	min_tile = 128;
+	max_tile = 1024;
+	used_area = 0;
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	delete fbo;
+}
+
+void ShadowAtlas::create(int size, int min_tile, int max_tile)
+{
+	delete fbo;
+	this->size = size;
+	this->min_tile = min_tile;
+	this->max_tile = max_tile < size ? max_tile : size;
+	fbo = new FBO();
+	fbo->setDepthOnly(size, size);
+	depth_texture = fbo->depth_texture;
+	reset();
+}
+
+void ShadowAtlas::reset()
+{
+	used_area = 0;
+}
+
+//every other bit of the index (the x or the y of a Z-order index)
+static int compactBits(int v)
+{
+	int result = 0;
+	for (int i = 0; v; ++i, v >>= 2)
+		result |= (v & 1) << i;
+	return result;
+}
+
+bool ShadowAtlas::allocate(int& tile_size, Vector4& region)
+{
+	if (!fbo)
+		return false;
+
+	int tiles_per_side = size / min_tile;
+	int total_area = tiles_per_side * tiles_per_side;
+
+	if (tile_size > max_tile)
+		tile_size = max_tile;
+	for (; tile_size >= min_tile; tile_size /= 2) {
+		int side = tile_size / min_tile;
+		int area = side * side;
+		//the tiles come biggest first, so used_area should always be aligned to the area of this one
+		if (used_area + area > total_area || used_area % area)
+			continue;
+
+		int x = compactBits(used_area) * min_tile;
+		int y = compactBits(used_area >> 1) * min_tile;
+		used_area += area;
+		region.set(x / (float)size, y / (float)size, tile_size / (float)size, tile_size / (float)size);
+		return true;
+	}
+
+	tile_size = 0;
+	return false;
+}
+
+void ShadowAtlas::getTileRect(const Vector4& region, int& x, int& y, int& w, int& h)
+{
+	x = (int)(region.x * size + 0.5f);
+	y = (int)(region.y * size + 0.5f);
+	w = (int)(region.z * size + 0.5f);
+	h = (int)(region.w * size + 0.5f);
+}
+
+void ShadowAtlas::bindTile(const Vector4& region)
+{
+	int x, y, w, h;
+	getTileRect(region, x, y, w, h);
+	fbo->bind();
+	glViewport(x, y, w, h);
+	GLState::enable(GL_SCISSOR_TEST);
+	glScissor(x, y, w, h);
+	glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void ShadowAtlas::unbind()
+{
+	GLState::disable(GL_SCISSOR_TEST);
+	fbo->unbind();
+}
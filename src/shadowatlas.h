@@ -0,0 +1,44 @@
+/*	One depth texture shared by the shadowmaps of all the lights, every light renders to its own square tile.
+	Tiles are powers of two and must be requested from the biggest to the smallest, that way placing them
+	one after the other along a Z-order curve packs them without gaps.
+*/
+
+#ifndef SHADOWATLAS_H
+#define SHADOWATLAS_H
+
+#include "framework.h"
+
+class FBO;
+class Texture;
+
+class ShadowAtlas
+{
+public:
+	FBO* fbo;
+	Texture* depth_texture;
+	int size; //in pixels
+	int min_tile;
+	int max_tile;
+	int used_area; //in min_tile units, also where the next tile goes in the Z-order curve
+
+	ShadowAtlas();
+	~ShadowAtlas();
+
+	void create(int size, int min_tile = 128, int max_tile = 1024);
+
+	//frees all the tiles, call it before allocating the ones of the frame
+	void reset();
+
+	//finds room for a tile of tile_size pixels (or smaller if it does not fit, tile_size is updated)
+	//region gets the offset (xy) and size (zw) in uvs, returns false if there is no room at all
+	bool allocate(int& tile_size, Vector4& region);
+
+	//binds the fbo and restricts the viewport (and clears) to the tile
+	void bindTile(const Vector4& region);
+	void unbind();
+
+	//pixel rectangle of a region
+	void getTileRect(const Vector4& region, int& x, int& y, int& w, int& h);
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
+#include <condition_variable>
 
 TaskManager TaskManager::foreground;
 TaskManager TaskManager::background;
@@ -76,4 +77,107 @@ void TaskManager::addTask(Task* task)
 	const std::lock_guard<std::mutex> lock(tasks_mutex);
 	pending_tasks.push_back(task);
 	//release pending_tasks automatically
-}
\ No newline at end of file
+}
+
+//threads of parallelFor, created the first time they are needed and kept waiting for the next call
+class WorkerPool {
+public:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable start_condition;
+	std::condition_variable done_condition;
+	std::function<void(int worker, int start, int end)>* job;
+	std::vector<int> range_starts; //worker i runs [range_starts[i], range_starts[i+1])
+	int num_workers;
+	int generation; //increased on every call, the threads wait for a new one
+	int pending;
+	bool quit;
+
+	WorkerPool() { job = NULL; num_workers = 0; generation = 0; pending = 0; quit = false; }
+
+	~WorkerPool()
+	{
+		{
+			const std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		start_condition.notify_all();
+		for (int i = 0; i < threads.size(); ++i)
+			threads[i].join();
+	}
+
+	void loop(int worker)
+	{
+		int last_generation = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			start_condition.wait(lock, [&] { return quit || generation != last_generation; });
+			if (quit)
+				return;
+			last_generation = generation;
+			if (worker >= num_workers)
+				continue;
+			int start = range_starts[worker];
+			int end = range_starts[worker + 1];
+			lock.unlock();
+
+			(*job)(worker, start, end);
+
+			lock.lock();
+			if (--pending == 0)
+				done_condition.notify_one();
+		}
+	}
+
+	void run(int num_items, int workers, std::function<void(int worker, int start, int end)>& func)
+	{
+		//the threads are the workers 1..n, worker 0 is the calling thread
+		while (threads.size() < workers - 1)
+			threads.push_back(std::thread(&WorkerPool::loop, this, (int)threads.size() + 1));
+
+		int chunk = num_items / workers;
+		int remainder = num_items % workers;
+		int first_end = chunk + (remainder > 0 ? 1 : 0);
+		{
+			const std::lock_guard<std::mutex> lock(mutex);
+			range_starts.resize(workers + 1);
+			range_starts[0] = 0;
+			for (int i = 0; i < workers; ++i)
+				range_starts[i + 1] = range_starts[i] + chunk + (i < remainder ? 1 : 0);
+			job = &func;
+			num_workers = workers;
+			pending = workers - 1;
+			generation++;
+		}
+		start_condition.notify_all();
+
+		func(0, 0, first_end);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_condition.wait(lock, [&] { return pending == 0; });
+		job = NULL;
+	}
+};
+
+static WorkerPool worker_pool;
+
+void parallelFor(int num_items, int num_workers, std::function<void(int worker, int start, int end)> func)
+{
+	if (num_workers > num_items)
+		num_workers = num_items;
+	if (num_workers <= 1)
+	{
+		if (num_items > 0)
+			func(0, 0, num_items);
+		return;
+	}
+
+	worker_pool.run(num_items, num_workers, func);
+}
+
+int getNumWorkers()
+{
+	int num = (int)std::thread::hardware_concurrency();
+	return num > 0 ? num : 1;
+}
@@ -31,4 +31,12 @@ public:
 	void fetchTask();
 	void loop();
 	void startThread();
-};
\ No newline at end of file
+};
+
+//splits [0,num_items) in contiguous ranges and runs one range per worker (worker 0 runs in the calling thread)
+//the other workers are threads kept waiting between calls, it must not be called from inside another parallelFor
+//ranges are assigned in order, so worker i always gets items before worker i+1
+void parallelFor(int num_items, int num_workers, std::function<void(int worker, int start, int end)> func);
+
+//number of workers worth using in this machine
+int getNumWorkers();
\ No newline at end of file
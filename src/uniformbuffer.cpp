@@ -0,0 +1,55 @@
+#include "uniformbuffer.h"
+
+#include <cassert>
+
+//same order than eUniformBlock
+const char* UniformBuffer::block_names[NUM_UNIFORM_BLOCKS] = { "CameraBlock", "LightsBlock", "MaterialBlock" };
+int UniformBuffer::num_uploads = 0;
+
+static_assert(sizeof(sCameraBlock) == 96, "sCameraBlock does not follow the std140 layout");
+static_assert(sizeof(sLightsBlock) == 736, "sLightsBlock does not follow the std140 layout");
+static_assert(sizeof(sMaterialBlock) == 32, "sMaterialBlock does not follow the std140 layout");
+
+UniformBuffer::UniformBuffer()
+{
+	buffer_id = 0;
+	size = 0;
+	block = CAMERA_BLOCK;
+}
+
+UniformBuffer::~UniformBuffer()
+{
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+}
+
+void UniformBuffer::create(eUniformBlock block, int size)
+{
+	this->block = block;
+	this->size = size;
+	if (!buffer_id)
+		glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, block, buffer_id);
+}
+
+void UniformBuffer::upload(const void* data)
+{
+	assert(buffer_id && "create the buffer before uploading to it");
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, block, buffer_id);
+	num_uploads++;
+}
+
+void UniformBuffer::bindProgramBlocks(GLuint program)
+{
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i) {
+		GLuint index = glGetUniformBlockIndex(program, block_names[i]);
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, i);
+	}
+}
@@ -0,0 +1,73 @@
+/*	Uniform buffer objects with the std140 blocks shared by the shaders of the materials.
+	Every block has a fixed binding point, the programs declaring it are linked to that point when they are compiled
+	(see Shader::compileFromMemory), so a block uploaded once is seen by all of them until it changes.
+*/
+
+#ifndef UNIFORMBUFFER_H
+#define UNIFORMBUFFER_H
+
+#include "includes.h"
+#include "framework.h"
+
+enum eUniformBlock {
+	CAMERA_BLOCK = 0, //per camera rendered (view, shadowmap or probe face)
+	LIGHTS_BLOCK = 1, //singlepass lights, per frame
+	MATERIAL_BLOCK = 2, //per material change
+	NUM_UNIFORM_BLOCKS
+};
+
+//the structs below follow the std140 rules (vec3 aligned to 16 bytes, arrays and blocks padded to 16)
+//and must match the blocks with the same name in the shader atlas
+
+struct sCameraBlock {
+	Matrix44 viewprojection;
+	Vector3 camera_position;
+	float time;
+	int gamma_mode;
+	int padding[3];
+};
+
+const int MAX_BLOCK_LIGHTS = 5;
+
+struct sLightsBlock {
+	Vector4 position[MAX_BLOCK_LIGHTS]; //xyz position, w max distance
+	Vector4 color[MAX_BLOCK_LIGHTS]; //xyz color, w type
+	Vector4 direction[MAX_BLOCK_LIGHTS]; //xyz direction, w cosine of the cone angle
+	Vector4 params[MAX_BLOCK_LIGHTS]; //cone exponent, casts shadows, shadow bias
+	Vector4 shadow_tile[MAX_BLOCK_LIGHTS];
+	Matrix44 shadow_viewproj[MAX_BLOCK_LIGHTS];
+	int num_lights;
+	int padding[3];
+};
+
+struct sMaterialBlock {
+	Vector4 color;
+	float alpha_cutoff;
+	float metallic_factor;
+	float roughness_factor;
+	int has_normal;
+};
+
+class UniformBuffer
+{
+public:
+	static const char* block_names[NUM_UNIFORM_BLOCKS];
+	static int num_uploads; //since the last reset, to compare with the draws
+
+	GLuint buffer_id;
+	int size;
+	eUniformBlock block;
+
+	UniformBuffer();
+	~UniformBuffer();
+
+	void create(eUniformBlock block, int size);
+
+	//replaces the content and keeps it bound to the binding point of the block
+	void upload(const void* data);
+
+	//links the blocks declared by a program to their binding points, called after linking it
+	static void bindProgramBlocks(GLuint program);
+};
+
+#endif
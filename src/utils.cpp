@@ -7,6 +7,7 @@
 #endif
 
 #include "includes.h"
+#include "glstate.h"
 
 #include "application.h"
 #include "camera.h"
@@ -26,6 +27,54 @@ long getTime()
 #endif
 }
 
+double getPreciseTime()
+{
+	static double frequency = (double)SDL_GetPerformanceFrequency();
+	return (SDL_GetPerformanceCounter() * 1000.0) / frequency;
+}
+
+void radixSort(std::vector<sSortItem>& items, std::vector<sSortItem>& temp)
+{
+	const int num_passes = sizeof(uint64); //8 bits per pass
+	int num = (int)items.size();
+	if (num < 2)
+		return;
+	temp.resize(num);
+
+	//compute the histograms of every digit at once
+	int counts[num_passes][256];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < num; ++i) {
+		uint64 key = items[i].key;
+		for (int pass = 0; pass < num_passes; ++pass)
+			counts[pass][(key >> (pass * 8)) & 0xFF]++;
+	}
+
+	sSortItem* src = &items[0];
+	sSortItem* dst = &temp[0];
+	for (int pass = 0; pass < num_passes; ++pass) {
+		int* count = counts[pass];
+		int shift = pass * 8;
+
+		//all keys share this digit, nothing to do
+		if (count[(src[0].key >> shift) & 0xFF] == num)
+			continue;
+
+		int offsets[256];
+		int offset = 0;
+		for (int i = 0; i < 256; ++i) {
+			offsets[i] = offset;
+			offset += count[i];
+		}
+		for (int i = 0; i < num; ++i)
+			dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+		std::swap(src, dst);
+	}
+
+	if (src != &items[0])
+		memcpy(&items[0], src, sizeof(sSortItem) * num);
+}
+
 float* snapshot()
 {
 	GLint viewport[4];
@@ -158,6 +207,65 @@ bool checkGLErrors()
 	return true;
 }
 
+bool checkGLVersion(int major, int minor)
+{
+	GLint context_major = 0;
+	GLint context_minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &context_major);
+	glGetIntegerv(GL_MINOR_VERSION, &context_minor);
+	return context_major > major || (context_major == major && context_minor >= minor);
+}
+
+GPUTimer::GPUTimer()
+{
+	time = 0.0f;
+	current = 0;
+	supported = -1;
+	for (int i = 0; i < NUM_QUERIES; ++i) {
+		queries[i] = 0;
+		pending[i] = false;
+	}
+}
+
+GPUTimer::~GPUTimer()
+{
+	if (supported == 1)
+		glDeleteQueries(NUM_QUERIES, queries);
+}
+
+void GPUTimer::begin()
+{
+	if (supported == -1) {
+		supported = checkGLVersion(3, 3) ? 1 : 0;
+		if (supported)
+			glGenQueries(NUM_QUERIES, queries);
+	}
+	if (!supported)
+		return;
+
+	//the query about to be reused is the oldest one, if its result is still not there it is dropped
+	if (pending[current]) {
+		GLint available = 0;
+		glGetQueryObjectiv(queries[current], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(queries[current], GL_QUERY_RESULT, &nanoseconds);
+			time = (float)(nanoseconds / 1000000.0);
+		}
+		pending[current] = false;
+	}
+	glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+}
+
+void GPUTimer::end()
+{
+	if (supported != 1)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	pending[current] = true;
+	current = (current + 1) % NUM_QUERIES;
+}
+
 void stdlog(std::string str)
 {
 	std::cout << str << std::endl;
@@ -214,8 +322,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale)
 	Matrix44 projection_matrix;
 	projection_matrix.ortho(0, Application::instance->window_width / scale, Application::instance->window_height / scale, 0, -1, 1);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
 
 	glMatrixMode(GL_MODELVIEW);
 	glPushMatrix();
@@ -225,6 +333,7 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale)
 	glLoadMatrixf(projection_matrix.m);
 
 	glColor3f(c.x, c.y, c.z);
+	GLState::bindVertexArray(0); //do not touch the VAO of the last mesh
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glVertexPointer(2, GL_FLOAT, 16, buffer);
 	glDrawArrays(GL_QUADS, 0, num_quads * 4);
@@ -234,8 +343,8 @@ bool drawText(float x, float y, std::string text, Vector3 c, float scale)
 	glMatrixMode(GL_MODELVIEW);
 	glPopMatrix();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 
 	return true;
 }
@@ -307,9 +416,10 @@ std::string getGPUStats()
 		nCurAvailMemoryInKB = 0;
 	}
 
-	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Inst: " + std::to_string(Mesh::num_instances_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB - nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
 	Mesh::num_meshes_rendered = 0;
 	Mesh::num_triangles_rendered = 0;
+	Mesh::num_instances_rendered = 0;
 	return str;
 }
 
@@ -324,9 +434,9 @@ void drawGrid()
 	}
 
 	glLineWidth(1);
-	glEnable(GL_BLEND);
-	glDepthMask(false);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	GLState::enable(GL_BLEND);
+	GLState::depthMask(false);
+	GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	Shader* grid_shader = Shader::getDefaultShader("grid");
 	grid_shader->enable();
 	Matrix44 m;
@@ -336,8 +446,8 @@ void drawGrid()
 	grid_shader->setUniform("u_camera_position", Camera::current->eye);
 	grid_shader->setUniform("u_viewprojection", Camera::current->viewprojection_matrix);
 	grid->render(GL_LINES); //background grid
-	glDisable(GL_BLEND);
-	glDepthMask(true);
+	GLState::disable(GL_BLEND);
+	GLState::depthMask(true);
 	grid_shader->disable();
 }
 
@@ -15,17 +15,46 @@
 
 //General functions **************
 long getTime();
+double getPreciseTime(); //in milliseconds, with sub-millisecond resolution (for profiling)
 float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
 
 //generic purposes fuctions
+struct sSortItem {
+	uint64 key;
+	int index;
+};
+void radixSort(std::vector<sSortItem>& items, std::vector<sSortItem>& temp); //stable sort by key in O(n), temp is used as scratch
+
 void drawGrid();
 bool drawText(float x, float y, std::string text, Vector3 c, float scale = 1);
 
 //check opengl errors
 bool checkGLErrors();
 
+//true if the context is at least this version of OpenGL
+bool checkGLVersion(int major, int minor);
+
+//GPU time between begin and end measured with GL_TIME_ELAPSED queries, the results are read some frames later
+//so it never stalls waiting for them (needs OpenGL 3.3, otherwise time stays 0)
+class GPUTimer {
+public:
+	static const int NUM_QUERIES = 4;
+	float time; //ms, the last result available
+
+	GPUTimer();
+	~GPUTimer();
+	void begin();
+	void end();
+
+private:
+	unsigned int queries[NUM_QUERIES];
+	bool pending[NUM_QUERIES];
+	int current;
+	int supported; //-1 until the first begin, it needs the context
+};
+
 //returns the current path
 std::string getPath();
 